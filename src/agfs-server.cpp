@@ -1,36 +1,285 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/fsuid.h>
 #include <dirent.h>
 #include <cstring>
+#include <grp.h>
 #include <pwd.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <openssl/sha.h>
 #include "agfs-server.hpp"
+#include "compressor.hpp"
+#include "delta.hpp"
 #include "constants.hpp"
 #include "agfsio.hpp"
+#include "reactor.hpp"
 
-ClientConnection::ClientConnection(int connfd) {
+//Bytes of directory entries fetched per getdents64 call
+static constexpr size_t DIRENT_BUFFER_LEN = 32 * 1024;
 
-	//Set timeout
-	struct timeval tv;
-	tv.tv_sec = SERVER_BLOCK_SEC;
-	tv.tv_usec = SERVER_BLOCK_USEC;
-	setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)(&tv), sizeof(struct timeval));
-	int iMode = 0;
-	ioctl(connfd, FIONBIO, &iMode);
+//A READDIR cookie is a listing id in the high half and the position of the
+//next entry in the low half.
+static constexpr int LISTING_ID_SHIFT = 32;
+static constexpr agsize_t LISTING_INDEX_MASK = 0xffffffff;
+
+//Fields of a WRITE frame that precede the data: CMD HANDLE SIZE OFFSET
+static constexpr size_t WRITE_HEAD_LEN = sizeof(cmd_t) + sizeof(agfh_t) + 2 * sizeof(agsize_t);
+
+//Fields of a READ reply that precede the data: ERROR SIZE MASK
+static constexpr size_t READ_HEAD_LEN = sizeof(agerr_t) + sizeof(agsize_t) + sizeof(agmask_t);
+
+/*
+ * Switch the filesystem credentials of the calling thread. glibc applies
+ * setgroups() to every thread of the process, so the system call is made
+ * directly; setfsuid() and setfsgid() only ever affect the caller. Worker
+ * threads serve many clients, so the last credentials used are remembered and
+ * switching to the same user again is free.
+ */
+static bool useCredentials(uid_t uid, gid_t gid, const std::vector<gid_t>& groups)
+{
+	thread_local bool known = false;
+	thread_local uid_t currentUid;
+	thread_local gid_t currentGid;
+	thread_local std::vector<gid_t> currentGroups;
+
+	if (known && currentUid == uid && currentGid == gid && currentGroups == groups) {
+		return true;
+	}
+	known = false;
+
+	if (syscall(SYS_setgroups, groups.size(), groups.data()) < 0) {
+		return false;
+	}
+	setfsgid(gid);
+	setfsuid(uid);
+
+	//Both calls return the previous id, so ask again to see if they worked.
+	if ((gid_t)setfsgid(-1) != gid || (uid_t)setfsuid(-1) != uid) {
+		return false;
+	}
+
+	known = true;
+	currentUid = uid;
+	currentGid = gid;
+	currentGroups = groups;
+	return true;
+}
+
+/*
+ * Write all of data into a file at offset, counting what was written. Returns
+ * what the last pwrite() did, or a negative errno.
+ */
+static agerr_t writeAll(int fd, const unsigned char* data, agsize_t size, agsize_t offset,
+	agsize_t& written)
+{
+	agerr_t error = 0;
+	while (written != size) {
+		if ((error = pwrite(fd, data + written, size - written, offset + written)) > 0) {
+			written += error;
+		}
+		else {
+			return -errno;
+		}
+	}
+	return error;
+}
+
+ClientConnection::ClientConnection(int connFd, Reactor& reactor)
+	:reactor_(reactor),
+	 mountPoint_{},
+	 socket_{connFd},
+	 state_{AWAITING_KEY},
+	 uid_{0},
+	 gid_{0},
+	 groups_{},
+	 agreed_(Hello::legacy()),
+	 stream_{connFd},
+	 requests_{0},
+	 inflight_{0},
+	 paused_{false},
+	 jobsLock_{},
+	 waiting_{},
+	 running_{0},
+	 ingesting_{false},
+	 session_{},
+	 listingsLock_{},
+	 listings_{},
+	 nextListing_{1},
+	 listingClock_{0}
+{
+	//Long replies go out in pieces, so a small one never waits long behind
+	//a big read.
+	stream_.setPieceLength(REPLY_PIECE_LEN);
+}
+
+ClientConnection::~ClientConnection()
+{
+	//Every request has finished by now, since each one holds the connection.
+	session_.reset();
+	listings_.clear();
+
+	std::cerr << requests_ << " requests, " << stream_.syscalls() << " syscalls";
+	if (requests_ > 0) {
+		std::cerr << " (" << (double)stream_.syscalls() / requests_ << " per request)";
+	}
+	std::cerr << std::endl;
+
+	close(socket_);
+}
+
+int ClientConnection::fd() const
+{
+	return socket_;
+}
+
+bool ClientConnection::busy() const
+{
+	return inflight_ > 0 || state_ == AUTHENTICATING;
+}
+
+bool ClientConnection::processInput()
+{
+	if (state_ == REJECTED) {
+		return false;
+	}
+
+	//A worker owns the socket until the WRITE it is receiving is in.
+	if (ingesting_) {
+		return true;
+	}
+
+	int got = stream_.pump();
+	if (got == 0) {
+		std::cerr << "Connection lost" << std::endl;
+		return false;
+	} else if (got < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+
+	//The key comes first; nothing else is read until it has been checked.
+	if (state_ == AWAITING_KEY) {
+		std::shared_ptr<Frame> request{new Frame{}};
+		int found = stream_.extract(*request, MAX_KEY_FRAME_LEN);
+		if (found < 0) {
+			std::cerr << "Bad key frame" << std::endl;
+			return false;
+		} else if (found == 0) {
+			return true;
+		}
+
+		state_ = AUTHENTICATING;
+		reactor_.watch(socket_, false);
+		std::shared_ptr<ClientConnection> self{shared_from_this()};
+		reactor_.workers().submit([self, request]() {
+			self->authenticate(*request);
+		});
+		return true;
+	}
+
+	while (state_ == ACCEPTED) {
+		//Each request gets its own frame, since it outlives this call.
+		std::shared_ptr<Frame> request{new Frame{}};
+
+		//Large WRITE data is left on the socket for a worker to splice into
+		//the file. Nothing more is read until it is done.
+		if (spliceable()) {
+			size_t left = stream_.extractHead(*request, WRITE_HEAD_LEN);
+			requests_++;
+			ingesting_ = true;
+			reactor_.watch(socket_, false);
+			submit([this, request, left]() {
+				Frame reply;
+				reply.setId(request->id());
+				processWriteStream(*request, reply, left);
+			});
+			return true;
+		}
+
+		int found = stream_.extract(*request);
+		if (found < 0) {
+			std::cerr << "Protocol error: " << strerror(errno) << std::endl;
+			return false;
+		} else if (found == 0) {
+			break;
+		}
+		requests_++;
+
+		cmd_t cmd = cmd::NONE;
+		agfs_read_cmd(*request, cmd);
+		if (cmd == cmd::STOP) {
+			std::cerr << "STOP called" << std::endl;
+			return false;
+		}
+
+		submit([this, cmd, request]() {
+			dispatch(cmd, *request);
+		});
+	}
+	stream_.trim();
+
+	//Stop reading while the client has too much outstanding. Pause first and
+	//then look again, so a worker finishing in between can't be missed.
+	if (inflight_ >= agreed_.maxInFlight) {
+		reactor_.watch(socket_, false);
+		paused_ = true;
+		if (inflight_ < agreed_.maxInFlight && paused_.exchange(false)) {
+			reactor_.watch(socket_, true);
+		}
+	}
+	return true;
+}
+
+/*
+ * Incoming stack looks like:
+ *
+ *      STRING [SIZE [HELLO]]
+ *
+ * Outgoing stack looks like:
+ *
+ *      CMD [SIZE [HELLO]]
+ *
+ * CMD is ACCEPT, or the reason the connection is refused. A client opening
+ * another connection sends the id of the session it wants to join after its
+ * key; otherwise, or if it sends 0, a new session is started. The id of the
+ * session follows an ACCEPT. A client that says what it can do in a HELLO
+ * gets ours back, and both work to what the two have in common; one that
+ * doesn't is served as the clients that predate the hello were.
+ * Runs on a worker, since it reads the key list and the user database.
+ */
+void ClientConnection::authenticate(Frame& request)
+{
+	Frame reply;
+	reply.setId(request.id());
+
+	//Keys and users are looked up as the daemon, whoever the thread last
+	//served.
+	if (!useCredentials(getuid(), getgid(), std::vector<gid_t>{})) {
+		std::cerr << "Could not restore credentials" << std::endl;
+	}
 
 	//Verify server key
 	std::string clientKey;
-	char key[ASCII_KEY_LEN+1];
-	memset(key, 0, ASCII_KEY_LEN+1);
-	//read(connfd, key, ASCII_KEY_LEN);
-	agfs_read_string(connfd, clientKey);
+	agfs_read_string(request, clientKey);
+
+	agsize_t joinId = 0;
+	if (request.remaining() > 0) {
+		agfs_read_size(request, joinId);
+	}
+
+	Hello offered = Hello::legacy();
+	bool negotiating = request.remaining() > 0 && agfs_read_hello(request, offered) >= 0;
+	if (!negotiating) {
+		offered = Hello::legacy();
+	}
+	agreed_ = Hello::local().agree(offered);
 
 	std::fstream authkeys;
 	authkeys.open(KEY_LIST_PATH, std::fstream::in);
@@ -49,104 +298,196 @@ ClientConnection::ClientConnection(int connfd) {
 		}
 	}
 
+	cmd_t result = cmd::ACCEPT;
+	struct passwd* userPwd = NULL;
 	if(validKey == false) {
-		agfs_write_cmd(connfd, cmd::INVALID_KEY);
-		close(connfd);
-		socket_ = -1;
-		return;
+		result = cmd::INVALID_KEY;
+	} else if((userPwd = getpwnam(user.c_str())) == NULL) {
+		result = cmd::USER_NOT_FOUND;
+	} else {
+		//Requests run with the user's credentials on whichever worker serves
+		//them; the daemon itself stays root.
+		uid_ = userPwd->pw_uid;
+		gid_ = userPwd->pw_gid;
+
+		int count = 0;
+		getgrouplist(user.c_str(), gid_, NULL, &count);
+		groups_.resize(count);
+		if (getgrouplist(user.c_str(), gid_, groups_.data(), &count) < 0) {
+			count = 0;
+		}
+		groups_.resize(count);
+
+		//Check that mount point exists
+		if(!assumeCredentials() || !boost::filesystem::exists(mountPath)) {
+			result = cmd::MOUNT_NOT_FOUND;
+		}
 	}
 
-	//Change user
-	struct passwd* userPwd = getpwnam(user.c_str());
-	if(userPwd == NULL) {
-		agfs_write_cmd(connfd, cmd::USER_NOT_FOUND);
-		close(connfd);
-		socket_ = -1;
-		return;
+	if (result == cmd::ACCEPT) {
+		session_ = joinId != 0 ? Session::join(joinId, clientKey) : Session::create(clientKey);
+		if (!session_) {
+			result = cmd::SESSION_NOT_FOUND;
+		}
+	}
+
+	mountPoint_ = mountPath;
+	agfs_write_cmd(reply, result);
+	if (result == cmd::ACCEPT) {
+		agfs_write_size(reply, session_->id());
+		if (negotiating) {
+			agfs_write_hello(reply, Hello::local());
+		}
+	}
+	sendReply(reply);
+
+	if (result == cmd::ACCEPT) {
+		state_ = ACCEPTED;
 	} else {
-		setuid(userPwd->pw_uid);
-		setgid(userPwd->pw_gid);
+		//Wake the reactor up to a closed socket so it drops the connection.
+		state_ = REJECTED;
+		shutdown(socket_, SHUT_RDWR);
 	}
+	reactor_.watch(socket_, true);
+}
 
-	//Check that mount point exists
-	if(!boost::filesystem::exists(mountPath)) {
-		agfs_write_cmd(connfd, cmd::MOUNT_NOT_FOUND);
-		close(connfd);
-		socket_ = -1;
-		return;
+void ClientConnection::submit(std::function<void()> job)
+{
+	inflight_++;
+
+	//Workers are shared by every client, so one connection only gets a few.
+	{
+		std::lock_guard<std::mutex> lock(jobsLock_);
+		if (running_ >= SERVER_CONN_WORKERS) {
+			waiting_.push_back(std::move(job));
+			return;
+		}
+		running_++;
 	}
+	run(std::move(job));
+}
 
-	socket_ = connfd;
-	mountPoint_ = mountPath;
-	beatsMissed_ = 0;
-}
-
-bool ClientConnection::connected() {
-	return socket_ > -1;
-}
-
-void ClientConnection::processCommands() {
-	//Passed all checks accept connection and keep alive until heartbeat
-	//failure or explicit stop
-	agfs_write_cmd(socket_, cmd::ACCEPT);
-	while(1) {
-		cmd_t cmd = cmd::GETATTR;
-		int respVal = agfs_read_cmd(socket_, cmd);
-		if(respVal <= 0) {
-			std::cout << "Missed heartbeat" << std::endl;
-			beatsMissed_ += 1;
-			if (beatsMissed_ > 5) {
-				close(socket_);
-				socket_ = -1;
-				return;
-			}
+void ClientConnection::run(std::function<void()> job)
+{
+	std::shared_ptr<ClientConnection> self{shared_from_this()};
+	reactor_.workers().submit([self, job]() {
+		if (self->assumeCredentials()) {
+			job();
 		} else {
-			switch(cmd) {
-			case cmd::STOP:
-				std::cerr << "STOP called" << std::endl;
-				close(socket_);
-				socket_ = -1;
-				return;
-			case cmd::HEARTBEAT:
-				std::cerr << "Received heartbeat" << std::endl;
-				processHeartbeat();
-				break;
-			case cmd::GETATTR:
-				std::cerr << "GETATTR called" << std::endl;
-				processGetAttr();
-				break;
-			case cmd::READDIR:
-				std::cerr << "READDIR called" << std::endl;
-				processReaddir();
-				break;
-			case cmd::ACCESS:
-				std::cerr << "ACCESS called" << std::endl;
-				processAccess();
-				break;
-			case cmd::READ:
-				std::cerr << "READ called" << std::endl;
-				processRead();
-				break;
-			case cmd::WRITE:
-				std::cerr << "WRITE called"  << std::endl;
-				processWrite();
-				break;
-			case cmd::OPEN:
-				std::cerr << "OPEN called" << std::endl;
-				processOpen();
-				break;
-			default:
-				std::cerr << "Unknown command" << std::endl;
+			std::cerr << "Could not switch to client credentials" << std::endl;
+		}
+
+		//Pass the worker slot on to the next request waiting for one.
+		std::function<void()> next;
+		{
+			std::lock_guard<std::mutex> lock(self->jobsLock_);
+			if (self->waiting_.empty()) {
+				self->running_--;
+			} else {
+				next = std::move(self->waiting_.front());
+				self->waiting_.pop_front();
 			}
 		}
-		//Do stuff here
+		if (next) {
+			self->run(std::move(next));
+		}
+
+		//Resume reading once there is room for more requests.
+		if (--self->inflight_ < self->agreed_.maxInFlight && self->paused_.exchange(false)) {
+			self->reactor_.watch(self->socket_, true);
+		}
+	});
+}
+
+bool ClientConnection::assumeCredentials()
+{
+	return useCredentials(uid_, gid_, groups_);
+}
+
+void ClientConnection::dispatch(cmd_t cmd, Frame& request) {
+	Frame reply;
+	reply.setId(request.id());
+
+	switch(cmd) {
+	case cmd::HEARTBEAT:
+		std::cerr << "Received heartbeat" << std::endl;
+		processHeartbeat(request, reply);
+		break;
+	case cmd::GETATTR:
+		std::cerr << "GETATTR called" << std::endl;
+		processGetAttr(request, reply);
+		break;
+	case cmd::READDIR:
+		std::cerr << "READDIR called" << std::endl;
+		processReaddir(request, reply);
+		break;
+	case cmd::ACCESS:
+		std::cerr << "ACCESS called" << std::endl;
+		processAccess(request, reply);
+		break;
+	case cmd::READ:
+		std::cerr << "READ called" << std::endl;
+		processRead(request, reply);
+		break;
+	case cmd::WRITE:
+		std::cerr << "WRITE called"  << std::endl;
+		processWrite(request, reply);
+		break;
+	case cmd::PACKED_WRITE:
+		std::cerr << "PACKED_WRITE called"  << std::endl;
+		processPackedWrite(request, reply);
+		break;
+	case cmd::OPEN:
+		std::cerr << "OPEN called" << std::endl;
+		processOpen(request, reply);
+		break;
+	case cmd::RELEASE:
+		std::cerr << "RELEASE called" << std::endl;
+		processRelease(request, reply);
+		break;
+	case cmd::BLOCKHASH:
+		std::cerr << "BLOCKHASH called" << std::endl;
+		processBlockHash(request, reply);
+		break;
+	case cmd::SIGNATURE:
+		std::cerr << "SIGNATURE called" << std::endl;
+		processSignature(request, reply);
+		break;
+	case cmd::PATCH:
+		std::cerr << "PATCH called" << std::endl;
+		processPatch(request, reply);
+		break;
+	case cmd::TRUNCATE:
+		std::cerr << "TRUNCATE called" << std::endl;
+		processTruncate(request, reply);
+		break;
+	default:
+		//Newer clients only send what we said we have, but say so anyway
+		//rather than leave the request waiting.
+		std::cerr << "Unknown command" << std::endl;
+		agfs_write_error(reply, -ENOSYS);
+		sendReply(reply);
+	}
+}
+
+void ClientConnection::sendReply(Frame& reply) {
+	if (stream_.send(reply) < 0) {
+		std::cerr << "Failed to send reply: " << strerror(errno) << std::endl;
 	}
 }
 
-void ClientConnection::processHeartbeat() {
-	agfs_write_cmd(socket_, cmd::HEARTBEAT);
+void ClientConnection::processHeartbeat(Frame& request, Frame& reply) {
+	(void)request;
+	agfs_write_cmd(reply, cmd::HEARTBEAT);
+	sendReply(reply);
 }
 
+/*
+ * Each stack below is the body of a single frame (see framesocket.hpp). The
+ * command that starts every incoming stack has already been consumed, and
+ * the reply goes out under the id of the request.
+ */
+
 /*
  * Incoming stack looks like:
  *
@@ -156,9 +497,9 @@ void ClientConnection::processHeartbeat() {
  *
  *      ERROR [STAT]
  */
-void ClientConnection::processGetAttr() {
+void ClientConnection::processGetAttr(Frame& request, Frame& reply) {
 	std::string path;
-	agfs_read_string(socket_, path);
+	agfs_read_string(request, path);
 	boost::filesystem::path fusePath{path};
 	boost::filesystem::path file{mountPoint_};
 	file /= fusePath;
@@ -170,10 +511,11 @@ void ClientConnection::processGetAttr() {
 		error = -errno;
 	}
 
-	agfs_write_error(socket_, error);
+	agfs_write_error(reply, error);
 	if (error >= 0) {
-		agfs_write_stat(socket_, retValue);
+		agfs_write_stat(reply, retValue);
 	}
+	sendReply(reply);
 }
 
 /*
@@ -185,9 +527,9 @@ void ClientConnection::processGetAttr() {
  *
  *      ERROR
  */
-void ClientConnection::processAccess() {
+void ClientConnection::processAccess(Frame& request, Frame& reply) {
 	std::string path;
-	agfs_read_string(socket_, path);
+	agfs_read_string(request, path);
 
 	//Cosntruct the filepath
 	boost::filesystem::path fusePath{path};
@@ -196,139 +538,254 @@ void ClientConnection::processAccess() {
 
 	//Grab the access mask.
 	agmask_t mask;
-	agfs_read_mask(socket_, mask);
+	agfs_read_mask(request, mask);
 
-	//Attempt to access the file.
-	agerr_t result = access(file.c_str(), mask);
+	//Attempt to access the file. The check has to use the filesystem ids the
+	//worker switched to, not the real ids of the daemon.
+	agerr_t result = 0;
+	if (faccessat(AT_FDCWD, file.c_str(), mask, AT_EACCESS) < 0) {
+		result = -errno;
+	}
 
 	//Write our result
-	agfs_write_error(socket_, result);
+	agfs_write_error(reply, result);
+	sendReply(reply);
 }
 
 /*
  * Incoming stack looks like:
  *
- *      STRING
+ *      STRING SIZE [SIZE]
  *
  * Outgoing stack looks like:
  *
- *      ERROR [SIZE [STRING STAT]*]
+ *      ERROR [SIZE [STRING STAT SIZE]* SIZE]
+ *
+ * or, if the request has its last SIZE,
+ *
+ *      ERROR [MASK [SIZE] BODY]
+ *
+ * A directory is listed in bytewise order of its names, in chunks of at most
+ * READDIR_CHUNK_ENTRIES entries. The incoming SIZE is the cookie to resume
+ * from, 0 to start a new listing. Each entry carries the cookie that resumes
+ * right after it, and the last SIZE is the cookie of the next chunk, 0 once
+ * the listing is finished. Listings are read whole when they start and
+ * dropped once their last chunk is sent, and a cookie whose listing is gone
+ * gets ESTALE.
+ *
+ * A client that can take compressed chunks sends the zlib level it wants
+ * them at, 0 for none. BODY is then the usual chunk, compressed if MASK is
+ * ZLIB, in which case SIZE is its length before compression.
  */
-void ClientConnection::processReaddir() {
+void ClientConnection::processReaddir(Frame& request, Frame& reply) {
 	std::string path;
-	agfs_read_string(socket_, path);
+	agfs_read_string(request, path);
 
-	//Cosntruct the filepath
-	boost::filesystem::path fusePath{path};
-	boost::filesystem::path file{mountPoint_};
-	file /= fusePath;
+	agsize_t cookie = 0;
+	agfs_read_size(request, cookie);
+
+	agsize_t level = 0;
+	bool encoded = request.remaining() > 0 && agfs_read_size(request, level) >= 0;
+	if (!(agreed_.encodings & enc::ZLIB)) {
+		level = 0;
+	}
 
 	agerr_t error = 0;
-	if (!boost::filesystem::exists(file)) {
-		error = -ENOENT;
+	agsize_t id = cookie >> LISTING_ID_SHIFT;
+	size_t index = cookie & LISTING_INDEX_MASK;
+	if (cookie == 0) {
+		//Cosntruct the filepath
+		boost::filesystem::path fusePath{path};
+		boost::filesystem::path file{mountPoint_};
+		file /= fusePath;
+
+		//Opening the directory tells us both whether it exists and whether it
+		//is a directory, and every entry is then looked up relative to it.
+		int dirFd = open(file.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirFd < 0) {
+			error = -errno;
+		} else {
+			error = addListing(dirFd, id);
+		}
 	}
 
-	if (!boost::filesystem::is_directory(file)) {
-		error = -ENOTDIR;
+	std::shared_ptr<Listing> listing;
+	if (error >= 0 && !(listing = findListing(id))) {
+		error = -ESTALE;
 	}
-	agfs_write_error(socket_, error);
+	agfs_write_error(reply, error);
 
 	//Short circuit if we have an error.
 	if (error >= 0) {
-		//Write the number of entries in the directory to the pipe.
+		//An encoded chunk is put together on its own first.
+		Frame chunk;
+		Frame& out = encoded ? chunk : reply;
+
+		//The number of entries is filled in after they have been written.
+		size_t countAt = out.size();
 		agsize_t count = 0;
-		boost::filesystem::directory_iterator end_itr{};
-		for (boost::filesystem::directory_iterator dir_itr(file);
-			dir_itr != end_itr; dir_itr++) {
+		agfs_write_size(out, count);
+
+		struct stat stbuf;
+		size_t end = std::min(listing->order.size(), index + READDIR_CHUNK_ENTRIES);
+		for (; index < end; index++) {
+			const char* name = listing->names.data() + listing->order[index];
+
+			//Entries removed since the directory was read are left out.
+			if (fstatat(listing->dirFd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+				continue;
+			}
+
+			agfs_write_string(out, name);
+			agfs_write_stat(out, stbuf);
+			agfs_write_size(out, (id << LISTING_ID_SHIFT) | (index + 1));
 			count++;
 		}
-		agfs_write_size(socket_, count);
+		agfs_patch_size(out, countAt, count);
 
-		//Write the filenames and associated stat's to the pipe.
-		struct stat stbuf;
-		for (boost::filesystem::directory_iterator dir_itr(file);
-			dir_itr != end_itr; dir_itr++) {
+		if (index < listing->order.size()) {
+			agfs_write_size(out, (id << LISTING_ID_SHIFT) | index);
+		} else {
+			agfs_write_size(out, 0);
 
-			//Write the relative name here
-			agfs_write_string(socket_, dir_itr->path().filename().string());
+			//Nothing is held for a client that comes back for entries its
+			//buffer had no room for; it starts over and skips to them.
+			std::lock_guard<std::mutex> l{listingsLock_};
+			listings_.erase(id);
+		}
 
-			//We need to stat the absolute name here
-			memset(&stbuf, 0, sizeof(struct stat));
-			lstat(dir_itr->path().c_str(), &stbuf);
-			agfs_write_stat(socket_, stbuf);
+		//Names and attributes always compress, so there is no probe. A level
+		//zlib doesn't know fails to pack, and the chunk goes as it is.
+		std::vector<char> packed;
+		if (encoded && level > 0 && chunk.size() >= COMPRESS_MIN_LEN &&
+				Compressor::pack((const char*)chunk.data(), chunk.size(), level, packed)) {
+			agfs_write_mask(reply, enc::ZLIB);
+			agfs_write_size(reply, chunk.size());
+			reply.append(packed.data(), packed.size());
+		} else if (encoded) {
+			agfs_write_mask(reply, enc::NONE);
+			reply.append(chunk.data(), chunk.size());
 		}
 	}
+	sendReply(reply);
 }
 
 /*
  * Incoming stack looks like:
  *
- *      STRING SIZE OFFSET
+ *      HANDLE SIZE OFFSET [SIZE]
  *
  * Outgoing stack looks like:
  *
- *      ERROR [SIZE [DATA]*]
+ *      ERROR [SIZE [MASK] [DATA]*]
+ *
+ * A client that can take compressed data sends the zlib level it wants it
+ * at, 0 for none, and gets a MASK saying whether DATA is compressed. The
+ * outgoing SIZE is always the length of the data before compression.
  */
-void ClientConnection::processRead()
+void ClientConnection::processRead(Frame& request, Frame& reply)
 {
-	std::string path;
-	agfs_read_string(socket_, path);
-
-	//Cosntruct the filepath
-	boost::filesystem::path fusePath{path};
-	boost::filesystem::path file{mountPoint_};
-	file /= fusePath;
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
 
 	agsize_t size = 0;
-	agfs_read_size(socket_, size);
+	agfs_read_size(request, size);
 
 	agsize_t offset = 0;
-	agfs_read_size(socket_, offset);
+	agfs_read_size(request, offset);
 
-	//Process the request
-	agerr_t error = 0;
+	agsize_t level = 0;
+	bool encoded = request.remaining() > 0 && agfs_read_size(request, level) >= 0;
+	if (!(agreed_.encodings & enc::ZLIB)) {
+		level = 0;
+	}
 
-	int fd;
-	if ((fd = open(file.c_str(), O_RDONLY)) < 0)
-	{
-		error = -errno;
-		agfs_write_error(socket_, error);
+	//Never send more than the client takes in one frame, which is never
+	//more than MAX_FRAME_LEN.
+	size = std::min<agsize_t>(size, agreed_.maxFrame - FRAME_HEADER_LEN - READ_HEAD_LEN);
+
+	//Process the request
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	if (!file) {
+		agfs_write_error(reply, -EBADF);
+		sendReply(reply);
 		return;
 	}
 
-	lseek(fd, offset, SEEK_SET);
+	//Large reads of regular files go out with sendfile(), so the data never
+	//passes through our memory. Only what the file holds at offset is
+	//promised to the client. Data to be compressed has to be read in.
+	struct stat info;
+	if (level == 0 && size >= SENDFILE_MIN_LEN && fstat(file->fd, &info) == 0 &&
+			S_ISREG(info.st_mode)) {
+		agsize_t length = 0;
+		if ((off_t)offset < info.st_size) {
+			length = std::min((off_t)size, info.st_size - (off_t)offset);
+		}
+		agfs_write_error(reply, length);
+		agfs_write_size(reply, length);
+		if (encoded) {
+			agfs_write_mask(reply, enc::NONE);
+		}
+		if (stream_.sendFile(reply, file->fd, offset, length) < 0) {
+			std::cerr << "Failed to send reply: " << strerror(errno) << std::endl;
+		}
+		return;
+	}
 
 	//Read the file data into the buffer until we have either hit an error,
-	//or we have satisfied the read request.
+	//or we have satisfied the read request. The buffer is left
+	//uninitialised, since only what pread() filled is sent.
+	agerr_t error = 0;
 	agsize_t total_read = 0;
-	std::vector<unsigned char> buf;
-	buf.resize(size);
+	std::unique_ptr<unsigned char[]> buf{new unsigned char[size]};
 	while (total_read != size &&
-			(error = read(fd, &buf[0] + total_read, size - total_read)) > 0) {
+			(error = pread(file->fd, buf.get() + total_read, size - total_read, offset + total_read)) > 0) {
 		total_read += error;
 	}
 	//Write the total number of bytes sent to the error value,
 	//unless there was a legitimate error.
-	error = error >= 0 ? total_read : error;
-	agfs_write_error(socket_, error);
+	error = error >= 0 ? total_read : -errno;
+	agfs_write_error(reply, error);
 
 	if (error >= 0) {
-		agfs_write_size(socket_, total_read);
-		write(socket_, &buf[0], total_read);
+		//The data goes out in the same frame, straight from the buffer.
+		//It is compressed only if a probe of it shrinks, so data that
+		//already is compressed isn't compressed again.
+		agfs_write_size(reply, total_read);
+		const void* data = buf.get();
+		size_t length = total_read;
+		std::vector<char> packed;
+		if (encoded) {
+			agmask_t encoding = enc::NONE;
+			if (level > 0 && Compressor::compressible((const char*)data, length) &&
+					Compressor::pack((const char*)data, length, level, packed)) {
+				encoding = enc::ZLIB;
+				data = packed.data();
+				length = packed.size();
+			}
+			agfs_write_mask(reply, encoding);
+		}
+		if (stream_.send(reply, data, length) < 0) {
+			std::cerr << "Failed to send reply: " << strerror(errno) << std::endl;
+		}
+	} else {
+		sendReply(reply);
 	}
 }
 
 /*
  * Incoming stack looks like:
- * 
- *      STRING [SIZE OFFSET DATA]
+ *
+ *      HANDLE SIZE OFFSET DATA
  *
  * Outgoing stack looks like:
  *
- *      ERROR [ERROR [SIZE]]
+ *      ERROR [SIZE]
  *
- * The incoming stack will only contain parameters if the first error we return 
- * indicates that that the file is on our machine.
+ * The data always travels with the request, so a write costs one round trip.
+ * If the handle names no open file the data is thrown away and the error
+ * says why.
  *
  * A quick note on the above outgoing stack. Although it may look like we can 
  * get away with using the error value as the size, this is not true because 
@@ -336,61 +793,142 @@ void ClientConnection::processRead()
  * the error to hold the total number of bytes written, we would have a very
  * rare bug that would occur when we tried to write large buffers to files.
  */
-void ClientConnection::processWrite() {
-	std::string path;
-	agfs_read_string(socket_, path);
+void ClientConnection::processWrite(Frame& request, Frame& reply) {
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
 
-	//Cosntruct the filepath
-	boost::filesystem::path fusePath{path};
-	boost::filesystem::path file{mountPoint_};
-	file /= fusePath;
+	agsize_t size = 0;
+	agfs_read_size(request, size);
 
-	//Open the file to the correct location.
-	int fd;
-	agerr_t error = 0;
-	if ((fd = open(file.c_str(), O_WRONLY)) < 0)
-	{
-		error = -errno;
+	agsize_t offset = 0;
+	agfs_read_size(request, offset);
+
+	//The data arrived with the frame; write it into the file.
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	const unsigned char* data = request.take(size);
+	agsize_t total_written = 0;
+	agerr_t error = !file ? -EBADF : data == NULL ? -EIO : 0;
+	if (error >= 0) {
+		error = writeAll(file->fd, data, size, offset, total_written);
 	}
 
-	agfs_write_error(socket_, error);
-	if (error < 0) {
-		return;
+	agfs_write_error(reply, error);
+	if (error >= 0) {
+		agfs_write_size(reply, total_written);
 	}
+	sendReply(reply);
+}
+
+/*
+ * Incoming stack looks like:
+ *
+ *      HANDLE SIZE OFFSET MASK DATA
+ *
+ * Outgoing stack looks like:
+ *
+ *      ERROR [SIZE]
+ *
+ * A WRITE whose DATA, the rest of the frame, is encoded as MASK says. SIZE
+ * is its length once decoded. These are never spliced, since the data has
+ * to pass through our memory to be decoded anyway.
+ */
+void ClientConnection::processPackedWrite(Frame& request, Frame& reply) {
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
 
 	agsize_t size = 0;
-	agfs_read_size(socket_, size);
+	agfs_read_size(request, size);
 
 	agsize_t offset = 0;
-	agfs_read_size(socket_, offset);
+	agfs_read_size(request, offset);
 
-	lseek(fd, offset, SEEK_SET);
+	agmask_t encoding = enc::NONE;
+	agfs_read_mask(request, encoding);
 
-	//Read data into buffer and write data into the file at the same time.
-	std::vector<unsigned char> data{};
-	data.resize(size);
-	agsize_t total_read = 0, total_written = 0;
-	error = 0;
-	while (total_read != size &&
-			(error = read(socket_, &data[0] + total_read, size - total_read)) > 0) {
-		total_read += error;
-
-		//We should be okay to use error here, since we are guaranteed that
-		//it is positive.
-		if ((error = write(fd, &data[0] + total_read - error, error)) > 0) {
-			total_written += error;
-		}
-		else {
-			agfs_write_error(socket_, -errno);
-			return;
+	//No client packs more than a frame can carry unpacked.
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	size_t length = request.remaining();
+	const unsigned char* packed = request.take(length);
+	std::unique_ptr<char[]> data;
+	agsize_t total_written = 0;
+	agerr_t error = 0;
+	if (!file) {
+		error = -EBADF;
+	} else if (encoding != enc::ZLIB || !(agreed_.encodings & enc::ZLIB) || size > MAX_FRAME_LEN) {
+		error = -EINVAL;
+	} else {
+		data.reset(new char[size]);
+		if (!Compressor::unpack(packed, length, data.get(), size)) {
+			error = -EIO;
 		}
 	}
-	close(fd);
+	if (error >= 0) {
+		error = writeAll(file->fd, (const unsigned char*)data.get(), size, offset, total_written);
+	}
 
-	agfs_write_error(socket_, error);
+	agfs_write_error(reply, error);
 	if (error >= 0) {
-		agfs_write_size(socket_, total_written);
+		agfs_write_size(reply, total_written);
 	}
+	sendReply(reply);
+}
+
+bool ClientConnection::spliceable() {
+	agframelen_t length;
+	agreqid_t id;
+	const unsigned char* body = NULL;
+	ssize_t have = stream_.peek(length, id, &body);
+
+	//Worth it only when most of the data is still on the socket. The head
+	//must already be buffered so the worker knows where the data goes.
+	if (have < (ssize_t)WRITE_HEAD_LEN || (size_t)have == length || length > MAX_FRAME_LEN ||
+			length - (size_t)have < SPLICE_MIN_LEN) {
+		return false;
+	}
+
+	cmd_t cmd;
+	memcpy(&cmd, body, sizeof(cmd_t));
+	return be16toh(cmd) == cmd::WRITE;
+}
+
+/*
+ * Same stacks as processWrite(), but only CMD, HANDLE, SIZE and OFFSET have
+ * been read. The left bytes of DATA that follow are moved from the socket
+ * into the file by the kernel. With no file to take them (-1 fails with
+ * EBADF) they are still read, so the stream stays in step.
+ */
+void ClientConnection::processWriteStream(Frame& request, Frame& reply, size_t left) {
+	cmd_t cmd;
+	agfs_read_cmd(request, cmd);
+
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
+
+	agsize_t size = 0;
+	agfs_read_size(request, size);
+
+	agsize_t offset = 0;
+	agfs_read_size(request, offset);
+
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	size_t total_written = 0;
+	int error = 0;
+	if (stream_.receiveFile(file ? file->fd : -1, offset, left, total_written, error) < 0) {
+		//The stream can't be trusted any more; let the reactor drop it.
+		std::cerr << "Failed to receive write: " << strerror(errno) << std::endl;
+		shutdown(socket_, SHUT_RDWR);
+	} else if (error == 0 && size != left) {
+		error = -EIO;
+	}
+
+	ingesting_ = false;
+	reactor_.watch(socket_, true);
+
+	agfs_write_error(reply, error < 0 ? error : (agerr_t)total_written);
+	if (error >= 0) {
+		agfs_write_size(reply, total_written);
+	}
+	sendReply(reply);
 }
 
 /*
@@ -400,12 +938,16 @@ void ClientConnection::processWrite() {
  *
  * Outgoing stack looks like:
  *
- *      ERROR
+ *      ERROR [HANDLE STAT]
+ *
+ * The file stays open until the client releases the handle or disconnects.
+ * The attributes are those of the file once opened, so the client can tell
+ * whether data it cached earlier is still good.
  */
-void ClientConnection::processOpen() {
+void ClientConnection::processOpen(Frame& request, Frame& reply) {
 	//Read in the path
 	std::string path;
-	agfs_read_string(socket_, path);
+	agfs_read_string(request, path);
 
 	//Cosntruct the local filepath
 	boost::filesystem::path fusePath{path};
@@ -414,23 +956,423 @@ void ClientConnection::processOpen() {
 
 	//Read in the mask
 	agmask_t mask = 0;
-	agfs_read_mask(socket_, mask);
+	agfs_read_mask(request, mask);
 
 	//Open the file and write the error
 	agerr_t error = 0;
 	int fd = -1;
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(struct stat));
 	if ((fd = open(file.c_str(), mask)) < 0) {
 		error = -errno;
+	} else if (fstat(fd, &stbuf) < 0) {
+		error = -errno;
+		close(fd);
+	}
+
+	agfs_write_error(reply, error);
+	if (error >= 0) {
+		agfs_write_handle(reply, session_->addFile(fd, file.native()));
+		agfs_write_stat(reply, stbuf);
+	}
+	sendReply(reply);
+}
+
+/*
+ * Incoming stack looks like:
+ *
+ *      HANDLE
+ *
+ * Outgoing stack looks like:
+ *
+ *      ERROR
+ */
+void ClientConnection::processRelease(Frame& request, Frame& reply)
+{
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
+
+	agerr_t error = session_->removeFile(handle) ? 0 : -EBADF;
+
+	agfs_write_error(reply, error);
+	sendReply(reply);
+}
+
+/*
+ * Incoming stack looks like:
+ *
+ *      HANDLE OFFSET COUNT LENGTH
+ *
+ * Outgoing stack looks like:
+ *
+ *      ERROR [SIZE COUNT [HASH]*]
+ *
+ * Hashes COUNT blocks of LENGTH bytes, the first starting at OFFSET. Blocks
+ * past the end of the file are left out, so fewer may come back, and the
+ * last one may be short; SIZE, the size of the file, says how short. Each
+ * HASH is the SHA-256 of a block's data.
+ */
+void ClientConnection::processBlockHash(Frame& request, Frame& reply)
+{
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
+
+	agsize_t offset = 0;
+	agfs_read_size(request, offset);
+
+	agsize_t count = 0;
+	agfs_read_size(request, count);
+
+	agsize_t length = 0;
+	agfs_read_size(request, length);
+
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	struct stat info;
+	agerr_t error = 0;
+	if (!file) {
+		error = -EBADF;
+	} else if (count == 0 || length == 0 || length > BLOCK_HASH_MAX_LEN ||
+			count > BLOCK_HASH_MAX_LEN / length) {
+		error = -EINVAL;
+	} else if (fstat(file->fd, &info) < 0) {
+		error = -errno;
+	}
+	if (error < 0) {
+		agfs_write_error(reply, error);
+		sendReply(reply);
+		return;
+	}
+
+	//Hash each block as it is read, so only one is ever held.
+	std::vector<unsigned char> block(length);
+	std::vector<aghash_t> hashes;
+	for (agsize_t i = 0; i < count && offset + i * length < (agsize_t)info.st_size; i++) {
+		agsize_t start = offset + i * length;
+		size_t have = 0;
+		ssize_t got = 0;
+		while (have < length && (got = pread(file->fd, block.data() + have, length - have,
+				start + have)) > 0) {
+			have += got;
+		}
+		if (got < 0) {
+			error = -errno;
+			break;
+		}
+
+		hashes.emplace_back();
+		SHA256(block.data(), have, hashes.back().data());
+		if (have < length) {
+			break;
+		}
+	}
+
+	agfs_write_error(reply, error);
+	if (error >= 0) {
+		agfs_write_size(reply, info.st_size);
+		agfs_write_size(reply, hashes.size());
+		for (const aghash_t& hash: hashes) {
+			reply.append(hash.data(), hash.size());
+		}
+	}
+	sendReply(reply);
+}
+
+/*
+ * Incoming stack looks like:
+ *
+ *      HANDLE
+ *
+ * Outgoing stack looks like:
+ *
+ *      ERROR [SIZE LENGTH COUNT [SUM HASH]*]
+ *
+ * Signs the file so the client can send a delta of new contents for it. Each
+ * whole block of LENGTH bytes gets its rolling checksum and SHA-256 hash; a
+ * short block at the end is left out. Blocks are DELTA_BLOCK_LEN long unless
+ * the file needs more than DELTA_MAX_BLOCKS of them.
+ */
+void ClientConnection::processSignature(Frame& request, Frame& reply)
+{
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
+
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	struct stat info;
+	agerr_t error = 0;
+	if (!file) {
+		error = -EBADF;
+	} else if (fstat(file->fd, &info) < 0) {
+		error = -errno;
+	}
+	if (error < 0) {
+		agfs_write_error(reply, error);
+		sendReply(reply);
+		return;
+	}
+
+	agsize_t size = info.st_size;
+	agsize_t length = std::max<agsize_t>(DELTA_BLOCK_LEN,
+		(size + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS);
+	agsize_t count = size / length;
+
+	agfs_write_error(reply, 0);
+	agfs_write_size(reply, size);
+	agfs_write_size(reply, length);
+	size_t countAt = reply.size();
+	agfs_write_size(reply, count);
+
+	//Stop at the first block that can't be read; the client makes do with
+	//fewer.
+	std::vector<unsigned char> block(length);
+	agsize_t sent = 0;
+	for (; sent < count; sent++) {
+		size_t have = 0;
+		ssize_t got = 0;
+		while (have < length && (got = pread(file->fd, block.data() + have, length - have,
+				sent * length + have)) > 0) {
+			have += got;
+		}
+		if (have < length) {
+			break;
+		}
+
+		aghash_t hash;
+		SHA256(block.data(), length, hash.data());
+		agfs_write_sum(reply, Delta::checksum(block.data(), length));
+		reply.append(hash.data(), hash.size());
+	}
+	agfs_patch_size(reply, countAt, sent);
+	sendReply(reply);
+}
+
+/*
+ * Incoming stack looks like:
+ *
+ *      HANDLE SIZE COUNT [FROM LENGTH]* DATA
+ *
+ * Outgoing stack looks like:
+ *
+ *      ERROR
+ *
+ * Replaces the contents of the file with SIZE bytes built by the COUNT
+ * instructions in order. Each gives the next LENGTH bytes, copied from offset
+ * FROM of the file as it is now, or taken from DATA if FROM is all ones.
+ *
+ * The new contents are written to a file of their own next to the old one,
+ * which is renamed over the old one once they are all there, so nobody ever
+ * sees a file half patched. The handle then names the new file. It keeps the
+ * old one's owner, group and mode; a file that can't be given them, or that
+ * has other links the rename would break, isn't patched, and the client
+ * writes it in place instead.
+ */
+void ClientConnection::processPatch(Frame& request, Frame& reply)
+{
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
+
+	agsize_t size = 0;
+	agfs_read_size(request, size);
+
+	agsize_t count = 0;
+	agfs_read_size(request, count);
+
+	std::vector<Delta::Instruction> instructions;
+	agsize_t total = 0;
+	agsize_t literal = 0;
+	agerr_t error = 0;
+	if (count > request.remaining() / (2 * sizeof(agsize_t))) {
+		error = -EINVAL;
+	}
+	for (agsize_t i = 0; error == 0 && i < count; i++) {
+		Delta::Instruction instruction;
+		agfs_read_size(request, instruction.from);
+		agfs_read_size(request, instruction.length);
+		instructions.push_back(instruction);
+		total += instruction.length;
+		if (instruction.from == Delta::LITERAL) {
+			literal += instruction.length;
+		}
+	}
+	const unsigned char* data = NULL;
+	if (error == 0 && (total != size || (data = request.take(literal)) == NULL)) {
+		error = -EINVAL;
+	}
+
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	struct stat info;
+	if (error == 0 && !file) {
+		error = -EBADF;
+	} else if (error == 0 && fstat(file->fd, &info) < 0) {
+		error = -errno;
+	} else if (error == 0 && info.st_nlink > 1) {
+		error = -EMLINK;
+	}
+
+	//Build the new contents beside the old.
+	boost::filesystem::path target{error == 0 ? file->path : std::string{}};
+	std::string temporary{(target.parent_path() / ("." + target.filename().native() +
+		".agfs-XXXXXX")).native()};
+	int fd = -1;
+	if (error == 0 && (fd = mkstemp(&temporary[0])) < 0) {
+		error = -errno;
+	}
+	//The owner goes first, since changing it clears the setuid bits.
+	if (fd >= 0 && error == 0 && fchown(fd, info.st_uid, info.st_gid) < 0) {
+		error = -errno;
+	}
+	if (fd >= 0 && error == 0 && fchmod(fd, info.st_mode & 07777) < 0) {
+		error = -errno;
+	}
+
+	for (size_t i = 0; error == 0 && i < instructions.size(); i++) {
+		const Delta::Instruction& instruction = instructions[i];
+		if (instruction.from == Delta::LITERAL) {
+			size_t done = 0;
+			while (error == 0 && done < instruction.length) {
+				ssize_t put = write(fd, data + done, instruction.length - done);
+				if (put < 0) {
+					error = -errno;
+				}
+				done += put > 0 ? put : 0;
+			}
+			data += instruction.length;
+			continue;
+		}
+
+		loff_t from = instruction.from;
+		size_t left = instruction.length;
+		while (error == 0 && left > 0) {
+			ssize_t copied = copy_file_range(file->fd, &from, fd, NULL, left, 0);
+			if (copied < 0) {
+				error = -errno;
+			} else if (copied == 0) {
+				//The old file is shorter than the client was told.
+				error = -EIO;
+			}
+			left -= copied > 0 ? copied : 0;
+		}
 	}
 
-	//We might want to consider sending the file descriptor to the
-	//client in a later iteration.
-	close(fd);
+	//Swap the new file in, under the handle's own descriptor number so
+	//requests already holding it see the new file too.
+	if (error == 0 && fsync(fd) < 0) {
+		error = -errno;
+	}
+	if (error == 0 && rename(temporary.c_str(), file->path.c_str()) < 0) {
+		error = -errno;
+	}
+	if (error == 0 && dup2(fd, file->fd) < 0) {
+		error = -errno;
+	}
+	if (fd >= 0) {
+		if (error < 0) {
+			unlink(temporary.c_str());
+		}
+		close(fd);
+	}
 
-	agfs_write_error(socket_, error);
+	agfs_write_error(reply, error);
+	sendReply(reply);
 }
 
-void ClientConnection::processRelease()
+/*
+ * Incoming stack looks like:
+ *
+ *      HANDLE SIZE
+ *
+ * Outgoing stack looks like:
+ *
+ *      ERROR
+ */
+void ClientConnection::processTruncate(Frame& request, Frame& reply)
 {
+	agfh_t handle = 0;
+	agfs_read_handle(request, handle);
+
+	agsize_t size = 0;
+	agfs_read_size(request, size);
+
+	std::shared_ptr<Session::OpenFile> file{session_->findFile(handle)};
+	agerr_t error = 0;
+	if (!file) {
+		error = -EBADF;
+	} else if (ftruncate(file->fd, size) < 0) {
+		error = -errno;
+	}
 
+	agfs_write_error(reply, error);
+	sendReply(reply);
+}
+
+ClientConnection::Listing::Listing(int dirFd)
+	:dirFd{dirFd},
+	 names{},
+	 order{},
+	 used{0}
+{
+	//Nothing to do here...
+}
+
+ClientConnection::Listing::~Listing()
+{
+	close(dirFd);
+}
+
+agerr_t ClientConnection::addListing(int dirFd, agsize_t& id)
+{
+	std::shared_ptr<Listing> listing{new Listing{dirFd}};
+
+	alignas(struct dirent64) char entries[DIRENT_BUFFER_LEN];
+	long got;
+	while ((got = syscall(SYS_getdents64, dirFd, entries, sizeof(entries))) > 0) {
+		for (long pos = 0; pos < got; ) {
+			struct dirent64* entry = (struct dirent64*)(entries + pos);
+			pos += entry->d_reclen;
+
+			listing->order.push_back(listing->names.size());
+			listing->names.append(entry->d_name, strlen(entry->d_name) + 1);
+		}
+	}
+	if (got < 0) {
+		return -errno;
+	}
+	if (listing->order.size() > LISTING_INDEX_MASK) {
+		return -EOVERFLOW;
+	}
+
+	//strcmp() compares bytes as unsigned, the same order std::string uses.
+	const char* names = listing->names.data();
+	std::sort(listing->order.begin(), listing->order.end(), [names](size_t a, size_t b) {
+		return strcmp(names + a, names + b) < 0;
+	});
+
+	std::lock_guard<std::mutex> l{listingsLock_};
+	id = nextListing_;
+	nextListing_ = nextListing_ % (LISTING_INDEX_MASK >> 1) + 1;
+	listing->used = ++listingClock_;
+	listings_[id] = listing;
+
+	//Drop the listing used least recently; the client has most likely
+	//abandoned it.
+	if (listings_.size() > READDIR_LISTINGS) {
+		std::map<agsize_t, std::shared_ptr<Listing>>::iterator stalest = listings_.begin();
+		for (std::map<agsize_t, std::shared_ptr<Listing>>::iterator it = listings_.begin(); it != listings_.end(); it++) {
+			if (it->second->used < stalest->second->used) {
+				stalest = it;
+			}
+		}
+		listings_.erase(stalest);
+	}
+	return 0;
+}
+
+std::shared_ptr<ClientConnection::Listing> ClientConnection::findListing(agsize_t id)
+{
+	std::lock_guard<std::mutex> l{listingsLock_};
+	std::map<agsize_t, std::shared_ptr<Listing>>::iterator it = listings_.find(id);
+	if (it == listings_.end()) {
+		return std::shared_ptr<Listing>{};
+	}
+	it->second->used = ++listingClock_;
+	return it->second;
 }
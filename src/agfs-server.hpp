@@ -2,39 +2,174 @@
 #define AGFS_SERVER_HPP_INCLUDE
 
 #include <boost/filesystem.hpp>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "agfsio.hpp"
+#include "framesocket.hpp"
+#include "session.hpp"
 
 
+class Reactor;
+
 /**
 * \brief Provides an interface to a connected client.
+* \details Connections are driven by a Reactor: it calls processInput() when
+*          the socket is readable, and every complete request is handed to the
+*          reactor's worker pool. A slow request does not hold up the ones
+*          behind it, and replies carry the id of their request and may go out
+*          in any order. At most SERVER_CONN_WORKERS of a connection's
+*          requests run at once, so a client that stops reading can't tie up
+*          the whole pool. Workers switch their filesystem credentials to the
+*          client's user for each request, so one process serves every user.
 */
 
-class ClientConnection {
+class ClientConnection : public std::enable_shared_from_this<ClientConnection> {
 public:
 	/**
 	 * \brief Create an instance of the connection class.
-	 * \param connFd The file descriptor for the connection to be used.
+	 * \param connFd The non-blocking file descriptor for the connection.
+	 * \param reactor The reactor watching the connection.
 	 */
-	ClientConnection(int connFd);
+	ClientConnection(int connFd, Reactor& reactor);
+	ClientConnection(ClientConnection const&) = delete;
+	ClientConnection& operator=(ClientConnection const&) = delete;
+
+	/// Report the traffic the connection carried and close its socket.
+	~ClientConnection();
 
-  	/// Check whether the connection is still alive.
-	bool connected();
+	/// Returns the socket the connection is served on.
+	int fd() const;
+
+	/**
+	 * \brief Read what the socket has ready and queue each complete request.
+	 * \returns false once the connection should be closed.
+	 */
+	bool processInput();
 
-  	/// loop that processes all commands.
-	void processCommands();
+	/// Returns true while requests are still being served.
+	bool busy() const;
 
 private:
-	void processGetAttr();
-	void processAccess();
-	void processHeartbeat();
-	void processReaddir();
-	void processRead();
-	void processOpen();
-	void processRelease();
-	void processWrite();
+	enum State {
+		AWAITING_KEY,
+		AUTHENTICATING,
+		ACCEPTED,
+		REJECTED
+	};
+
+	//Check the client's key and user, then ACCEPT or reject the connection
+	//and start or join its session.
+	void authenticate(Frame& request);
+
+	//Queue a job for this connection on the worker pool, running it with
+	//the client's credentials.
+	void submit(std::function<void()> job);
+
+	//Hand a job to the worker pool, and the next waiting one once it is done.
+	void run(std::function<void()> job);
+
+	//Switch the calling thread's filesystem credentials to the client's.
+	bool assumeCredentials();
+
+	//Serve one request on a worker thread.
+	void dispatch(cmd_t cmd, Frame& request);
+
+	void processGetAttr(Frame& request, Frame& reply);
+	void processAccess(Frame& request, Frame& reply);
+	void processHeartbeat(Frame& request, Frame& reply);
+	void processReaddir(Frame& request, Frame& reply);
+	void processRead(Frame& request, Frame& reply);
+	void processOpen(Frame& request, Frame& reply);
+	void processRelease(Frame& request, Frame& reply);
+	void processBlockHash(Frame& request, Frame& reply);
+	void processSignature(Frame& request, Frame& reply);
+	void processPatch(Frame& request, Frame& reply);
+	void processTruncate(Frame& request, Frame& reply);
+	void processWrite(Frame& request, Frame& reply);
+	void processPackedWrite(Frame& request, Frame& reply);
+	void processWriteStream(Frame& request, Frame& reply, size_t left);
+
+	//Returns true if the next frame is a WRITE large enough to be worth
+	//splicing straight from the socket into the file.
+	bool spliceable();
+
+	//Send a reply as one frame.
+	void sendReply(Frame& reply);
+
+	Reactor& reactor_;
 
 	boost::filesystem::path mountPoint_;
 	int socket_;
-	int beatsMissed_;
+	std::atomic<State> state_;
+
+	//Filesystem credentials of the user the key maps to
+	uid_t uid_;
+	gid_t gid_;
+	std::vector<gid_t> groups_;
+
+	//What the client and we can both do
+	Hello agreed_;
+
+	//Framed stream over socket_
+	FrameSocket stream_;
+
+	//Number of requests processed, for the syscalls per request statistic
+	uint64_t requests_;
+
+	//Number of requests queued or running; reading pauses at the agreed
+	//maxInFlight
+	std::atomic<size_t> inflight_;
+	std::atomic<bool> paused_;
+
+	//Requests waiting for one of this connection's SERVER_CONN_WORKERS, and
+	//the number running
+	std::mutex jobsLock_;
+	std::deque<std::function<void()>> waiting_;
+	size_t running_;
+
+	//Set while a worker is reading WRITE data off the socket itself
+	std::atomic<bool> ingesting_;
+
+	//The client's open files, shared with its other connections. Set once
+	//the connection is accepted.
+	std::shared_ptr<Session> session_;
+
+	//A directory listing being handed out in chunks: the entry names sorted
+	//bytewise, packed one after another with their terminators.
+	struct Listing {
+		explicit Listing(int dirFd);
+		~Listing();
+
+		int dirFd;
+		std::string names;
+		std::vector<size_t> order;
+
+		//Value of listingClock_ when the listing was last asked for
+		uint64_t used;
+	};
+
+	//Read and sort a whole directory, returning the id of its listing.
+	agerr_t addListing(int dirFd, agsize_t& id);
+
+	//Look up a listing by id and mark it used; empty if it is finished or
+	//was evicted.
+	std::shared_ptr<Listing> findListing(agsize_t id);
+
+	//Listings the client is part way through, keyed by id. Only the
+	//READDIR_LISTINGS most recently used are kept.
+	std::mutex listingsLock_;
+	std::map<agsize_t, std::shared_ptr<Listing>> listings_;
+	agsize_t nextListing_;
+
+	//Counts listing uses, to tell which was used least recently
+	uint64_t listingClock_;
 };
 
 
@@ -39,82 +39,630 @@
 #include <boost/filesystem.hpp>
 #include "serverconnection.hpp"
 #include "disambiguater.hpp"
+#include "attrcache.hpp"
+#include "locationcache.hpp"
+#include "blockcache.hpp"
+#include "diskcache.hpp"
+#include "readahead.hpp"
+#include "writebuffer.hpp"
+#include "workerpool.hpp"
 #include <sys/types.h>
 #include <map>
+#include <deque>
 #include <chrono>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <cstddef>
 
 /**************
  * GLOBALS *
  ***********/
 
 
+//Index of a server in the connections table
+typedef size_t server_id_t;
+
+//Returned by findServer() when no server has the name
+static const server_id_t NO_SERVER = (server_id_t)-1;
+
 //Allocated onto the heap to allow for quick access to which server holds
-//a specific file (cuts down on network traffic).
+//a specific file (cuts down on network traffic). The handle names the file
+//the server holds open for us, so reads and writes never resend the path.
 typedef struct {
-  std::string server;
-  std::string file;
+  server_id_t server;
+  agfh_t handle;
+
+  //Path the file was opened by, kept so writes can drop its cached
+  //attributes without building a new string each time
+  std::string path;
+
+  //What the block cache knows about the file, or null if its data isn't
+  //cached
+  std::shared_ptr<BlockCache::File> cached;
+
+  //Set once the hashes of a run of its blocks named nothing the block cache
+  //held, after which the file's blocks are fetched without asking
+  std::atomic<bool> unmatched;
+
+  //The file's copy in the disk cache, or null if it is read from the server
+  std::shared_ptr<DiskCache::Mapping> local;
+
+  //How the file is being read, for fetching blocks ahead into the cache.
+  //Shared with the fetches, which may still be running when the read that
+  //started them returns.
+  std::shared_ptr<Readahead> readahead;
+
+  //Writes not yet sent to the server, or null if writes go straight out
+  std::shared_ptr<WriteBuffer> writeBack;
 } file_handle_t;
 
-static std::map<std::string, ServerConnection> connections;
+//Allocated onto the heap by opendir. A directory listed from one server is
+//streamed straight from it, with the server's cookies as FUSE offsets. One
+//merged from several servers keeps its merge here while the kernel reads it,
+//and its offsets count the entries handed out so far.
+typedef struct {
+  Disambiguater merge;
+
+  //Server and cookie of each listing being merged, and the last name it
+  //gave, by merge index
+  std::vector<server_id_t> servers;
+  std::vector<agsize_t> cookies;
+  std::vector<std::string> lastNames;
+
+  //Cookie and name of the last entry the kernel took from a streamed
+  //listing, to find the place again if the server has dropped it, and
+  //whether that entry was the listing's last
+  agsize_t streamCookie;
+  std::string streamName;
+  bool streamEnd;
+
+  //Number of entries the kernel has taken
+  off_t position;
+
+  //An entry taken from the merge that the kernel had no room for
+  std::string heldName;
+  struct stat heldStat;
+  bool holding;
+
+  //Whether every server's listing is part of the merge
+  bool complete;
+  agerr_t error;
+} dir_handle_t;
+
+//Servers we hold keys for, in the order the keys were found. Servers are
+//named by their index, so following a file handle needs no lookup. A deque
+//never moves what it holds, which connections need.
+static std::deque<ServerConnection> connections;
 static std::vector<std::thread> heartbeatThreads;
 
+//Hostname, port and key of each keyfile main found. The servers are
+//connected to in agfs_init, after FUSE has daemonized, since the reader
+//thread of a connection made before the fork wouldn't be in the child.
+typedef struct {
+  std::string hostname;
+  std::string port;
+  std::string key;
+} server_key_t;
+static std::vector<server_key_t> serverKeys;
+
+//What we offer every server when connecting. Set by main from the options.
+static Hello serverOffer{Hello::local()};
+
+//Attributes of recently seen paths, so tools that stat the same file over and
+//over don't cost a round trip each time.
+static AttrCache attrCache{std::chrono::milliseconds{ATTR_CACHE_MSEC},
+                           std::chrono::milliseconds{ABSENT_CACHE_MSEC}};
+
+//Servers known to hold each path, so lookups without a {:server:} suffix can
+//go to the right server instead of to all of them.
+static LocationCache locations{};
+
+//Recently read file data, so working sets that are read over and over come
+//from memory instead of from the servers.
+static BlockCache blockCache{(size_t)BLOCK_CACHE_MB * 1024 * 1024};
+
+//Whole copies of files on local disk, so a remount or a job run again
+//reads them at disk speed. Started by main if disk_cache_mb is set.
+static DiskCache diskCache{};
+
+//Threads that copy files into the disk cache. Created in agfs_init.
+static std::unique_ptr<WorkerPool> diskCachePool;
+
+//Threads that fetch blocks into the cache ahead of sequential readers.
+//Created in agfs_init, after FUSE has daemonized.
+static std::unique_ptr<WorkerPool> readaheadPool;
+
+//The most blocks kept fetched ahead of a sequential reader.
+static size_t readaheadBlocks = (size_t)READAHEAD_KB * 1024 / BLOCK_CACHE_BLOCK_LEN;
+
+//Whether to ask servers for the hashes of blocks before fetching them, so
+//data already cached under other files or servers isn't fetched again.
+static bool askBlockHashes = BLOCK_HASHES != 0;
+
+//Number of blocks fetched ahead of readers.
+static std::atomic<uint64_t> blocksReadAhead{0};
+
+//Write-back buffers of the files open for writing, by the path they were
+//opened by, so reading or stat'ing a path can first send what is held back
+//for it.
+static std::mutex writeBacksLock;
+static std::unordered_multimap<std::string, std::shared_ptr<WriteBuffer>> writeBacks;
+static std::atomic<size_t> writeBackCount{0};
+
+//Threads that send held-back writes, and the thread that sends those held
+//back too long. Started in agfs_init.
+static std::unique_ptr<WorkerPool> writeBackPool;
+static std::thread writeBackTimer;
+static std::condition_variable writeBackWake;
+static bool writeBackStopping = false;
+
+//The most bytes of writes held back for one open file; 0 sends every write
+//straight out.
+static size_t writeBackLimit = (size_t)WRITEBACK_KB * 1024;
+
+//The most bytes of a rewritten file held back to be sent as a delta; 0 sends
+//rewrites like any other writes.
+static size_t deltaLimit = (size_t)DELTA_MB * 1024 * 1024;
+
+//Bytes of rewritten files, and the bytes of new data their deltas carried.
+static std::atomic<uint64_t> deltaBytes{0};
+static std::atomic<uint64_t> deltaSent{0};
+
+//Number of writes held back, and of WRITEs they went out as.
+static std::atomic<uint64_t> writesHeld{0};
+static std::atomic<uint64_t> writesSent{0};
+
+//Threads that send the same request to several servers at once. Created in
+//agfs_init, after FUSE has daemonized.
+static std::unique_ptr<WorkerPool> fanOutPool;
+
+//How long a request sent to several servers waits for stragglers.
+static std::chrono::milliseconds fanOutDeadline{FANOUT_MSEC};
+
 /*
- * Assumes an ambiguated path input and queries all servers
- * for that file.
+ * Sends a request to several servers at once and hands each answer to
+ * collect() as it arrives, one at a time. The request may run after we have
+ * given up on it, so it must not refer to the caller's variables. Returns
+ * when every server has answered, when collect() returns true to say it has
+ * heard enough, or when the deadline passes; answers that come in later are
+ * dropped. Returns the number of answers collected.
  */
-std::vector<std::string> checkExistance(const char* path) {
-  std::vector<std::string> retVal{};
+template <typename Result>
+static size_t fanOut(const std::vector<server_id_t>& servers,
+                     std::function<Result(ServerConnection&)> request,
+                     std::function<bool(server_id_t, Result&)> collect) {
+  //One server needs no help from the pool.
+  if (servers.size() <= 1 || !fanOutPool) {
+    size_t answered = 0;
+    for (size_t i = 0; i < servers.size(); i++) {
+      Result result{request(connections[servers[i]])};
+      answered++;
+      if (collect(servers[i], result)) {
+        break;
+      }
+    }
+    return answered;
+  }
 
-  std::map<std::string, ServerConnection>::iterator it;
-  agerr_t error = 0;
-  for (it = connections.begin(); it != connections.end(); ++it) {
-    error = it->second.access(path, F_OK);
-    if (error >= 0) {
-      retVal.push_back(it->first);
+  //Shared with the jobs, which may outlive this call.
+  struct State {
+    std::mutex lock;
+    std::condition_variable arrived;
+    size_t pending;
+    size_t answered;
+    bool finished;
+    std::function<bool(server_id_t, Result&)> collect;
+  };
+  std::shared_ptr<State> state{new State{}};
+  state->pending = servers.size();
+  state->answered = 0;
+  state->finished = false;
+  state->collect = collect;
+
+  for (size_t i = 0; i < servers.size(); i++) {
+    server_id_t server = servers[i];
+    fanOutPool->submit([state, server, request]() {
+      Result result{request(connections[server])};
+
+      std::lock_guard<std::mutex> l{state->lock};
+      state->pending--;
+      if (!state->finished) {
+        state->answered++;
+        if (state->collect(server, result)) {
+          state->finished = true;
+        }
+      }
+      state->arrived.notify_all();
+    });
+  }
+
+  std::unique_lock<std::mutex> l{state->lock};
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + fanOutDeadline;
+  while (!state->finished && state->pending > 0) {
+    if (state->arrived.wait_until(l, deadline) == std::cv_status::timeout) {
+      std::cerr << state->pending << " servers missed the deadline" << std::endl;
+      break;
+    }
+  }
+
+  //Late answers must not touch the caller's variables.
+  state->finished = true;
+  state->collect = nullptr;
+  return state->answered;
+}
+
+/*
+ * Returns the index of the server with a hostname, or NO_SERVER.
+ */
+static server_id_t findServer(boost::string_view name) {
+  if (name.empty()) {
+    return NO_SERVER;
+  }
+  for (server_id_t id = 0; id < connections.size(); id++) {
+    if (name == connections[id].hostname()) {
+      return id;
+    }
+  }
+  return NO_SERVER;
+}
+
+/*
+ * Orders the connected servers to ask about an ambiguated path. The servers
+ * the location cache names come first, and their number is returned; the
+ * rest follow in case the cache is stale.
+ */
+static size_t routeFor(const std::string& file, std::vector<server_id_t>& route, bool& exact) {
+  std::vector<std::string> known{locations.lookup(file, exact)};
+  for (size_t i = 0; i < known.size(); i++) {
+    server_id_t id = findServer(known[i]);
+    if (id != NO_SERVER && connections[id].connected()) {
+      route.push_back(id);
     }
   }
 
+  size_t front = route.size();
+  for (server_id_t id = 0; id < connections.size(); id++) {
+    if (connections[id].connected() &&
+        std::find(route.begin(), route.begin() + front, id) == route.begin() + front) {
+      route.push_back(id);
+    }
+  }
+  return front;
+}
+
+/*
+ * Builds the path FUSE will use for an entry of a listed directory.
+ */
+static std::string childPath(const char* dir, const std::string& name) {
+  std::string child{dir};
+  if (child.empty() || child[child.length() - 1] != '/') {
+    child += '/';
+  }
+  return child + name;
+}
+
+/*
+ * Assumes an ambiguated path input and queries all servers
+ * for that file. Sets cached if the answer came from the location cache
+ * without asking anyone, so the caller can retry if it turns out wrong.
+ */
+std::vector<server_id_t> checkExistance(const char* path, bool& cached) {
+  std::vector<server_id_t> retVal{};
+  cached = false;
+
+  struct stat stbuf;
+  if (attrCache.lookup(path, stbuf) == AttrCache::ABSENT) {
+    return retVal;
+  }
+  uint64_t generation = attrCache.absentGeneration();
+
+  bool exact = false;
+  std::vector<server_id_t> route;
+  size_t known = routeFor(path, route, exact);
+  if (exact && known > 0) {
+    retVal.assign(route.begin(), route.begin() + known);
+    locations.avoided(connections.size());
+    cached = true;
+    return retVal;
+  }
+
+  //Only servers holding the parent directory can hold the file, so the
+  //rest are asked only if none of those has it.
+  std::string file{path};
+  bool allMissing = true;
+  size_t asked = 0;
+  std::vector<server_id_t> group{route.begin(), route.begin() + known};
+  std::vector<server_id_t> rest{route.begin() + known, route.end()};
+  for (int pass = 0; pass < 2 && retVal.empty(); pass++) {
+    std::vector<server_id_t>& servers = pass == 0 ? group : rest;
+    size_t answered = fanOut<agerr_t>(servers,
+      [file](ServerConnection& conn) { return conn.access(file.c_str(), F_OK); },
+      [&retVal, &allMissing](server_id_t server, agerr_t& error) {
+        if (error >= 0) {
+          retVal.push_back(server);
+        } else if (error != -ENOENT) {
+          allMissing = false;
+        }
+        return false;
+      });
+    allMissing = allMissing && answered == servers.size();
+    asked += servers.size();
+  }
+  locations.avoided(connections.size() - asked);
+
+  if (!retVal.empty()) {
+    std::vector<std::string> holders;
+    for (size_t i = 0; i < retVal.size(); i++) {
+      holders.push_back(connections[retVal[i]].hostname());
+    }
+    locations.insert(path, holders);
+  } else if (allMissing && !connections.empty()) {
+    attrCache.insertAbsent(path, generation);
+  }
   return retVal;
 }
 
+/*
+ * Has a file's held-back writes sent in the background, unless that is
+ * already on its way.
+ */
+static void queueFlush(const std::shared_ptr<WriteBuffer>& buffer)
+{
+  if (!writeBackPool) {
+    buffer->flush();
+  } else if (buffer->claimFlush()) {
+    writeBackPool->submit([buffer]() { buffer->flush(); });
+  }
+}
+
+/*
+ * Sends the writes held back for a path before it is read or stat'd, so the
+ * server's answer includes them. A file being rewritten is left alone; it is
+ * answered for from what is held, see replacementFor().
+ */
+static void flushPath(const char* path)
+{
+  if (writeBackCount == 0) {
+    return;
+  }
+
+  std::vector<std::shared_ptr<WriteBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> l{writeBacksLock};
+    auto range = writeBacks.equal_range(std::string{path});
+    for (auto it = range.first; it != range.second; ++it) {
+      buffers.push_back(it->second);
+    }
+  }
+  for (size_t i = 0; i < buffers.size(); i++) {
+    if (buffers[i]->dirty() && !buffers[i]->replacing()) {
+      buffers[i]->flush();
+    }
+  }
+}
+
+/*
+ * Returns the buffer holding the new contents of a path that is being
+ * rewritten, if there is one. Sending them early would give up the delta,
+ * so reads and stats of the path are answered from it until it is flushed.
+ */
+static std::shared_ptr<WriteBuffer> replacementFor(const std::string& path)
+{
+  if (writeBackCount == 0) {
+    return std::shared_ptr<WriteBuffer>{};
+  }
+
+  std::lock_guard<std::mutex> l{writeBacksLock};
+  auto range = writeBacks.equal_range(path);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->replacing()) {
+      return it->second;
+    }
+  }
+  return std::shared_ptr<WriteBuffer>{};
+}
+
+/*
+ * Sends writes that have been held back longer than WRITEBACK_MSEC, until
+ * agfs_destroy stops it.
+ */
+static void writeBackLoop()
+{
+  std::chrono::milliseconds limit{WRITEBACK_MSEC};
+  std::unique_lock<std::mutex> l{writeBacksLock};
+  while (!writeBackStopping) {
+    writeBackWake.wait_for(l, limit / 2);
+    for (auto it = writeBacks.begin(); it != writeBacks.end(); ++it) {
+      if (it->second->age() >= limit) {
+        queueFlush(it->second);
+      }
+    }
+  }
+}
+
+void heartbeatThread(ServerConnection& conn) {
+  std::chrono::seconds beatTime{5};
+  std::chrono::seconds reconnTime{30};
+  bool wasConnected = conn.connected();
+  while(!conn.closed()) {
+    if (!conn.connected()) {
+      std::this_thread::sleep_for(reconnTime);
+      conn.connect();
+    } else {
+      std::this_thread::sleep_for(beatTime);
+      conn.heartbeat();
+    }
+
+    //A server coming or going changes which paths exist, and where.
+    if (conn.connected() != wasConnected) {
+      wasConnected = conn.connected();
+      attrCache.invalidateAbsent();
+      locations.clear();
+    }
+  }
+}
+
+static void* agfs_init(struct fuse_conn_info *conn)
+{
+  //Have O_TRUNC passed to open rather than done beforehand, so a rewrite
+  //can keep the old contents to send a delta against.
+  if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC) {
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+  }
+
+  //Connections own a reader thread, so they are built in place.
+  for (size_t i = 0; i < serverKeys.size(); i++) {
+    const server_key_t& server = serverKeys[i];
+    if (findServer(server.hostname) == NO_SERVER) {
+      connections.emplace_back(server.hostname, server.port, server.key, serverOffer);
+      if (!connections.back().connected() || connections.back().stopped()) {
+        connections.pop_back();
+      }
+    }
+  }
+  for (auto& conn: connections) {
+    heartbeatThreads.push_back(std::thread(heartbeatThread, std::ref(conn)));
+  }
+
+  fanOutPool.reset(new WorkerPool{FANOUT_WORKERS});
+  readaheadPool.reset(new WorkerPool{READAHEAD_WORKERS});
+  diskCachePool.reset(new WorkerPool{DISK_CACHE_WORKERS});
+  writeBackPool.reset(new WorkerPool{WRITEBACK_WORKERS});
+  writeBackTimer = std::thread(writeBackLoop);
+  return NULL;
+}
+
 static void agfs_destroy(void *data)
 {
   (void)data;
+  //Anything still held back goes out while the servers are there to take it.
+  {
+    std::lock_guard<std::mutex> l{writeBacksLock};
+    writeBackStopping = true;
+  }
+  writeBackWake.notify_all();
+  if (writeBackTimer.joinable()) {
+    writeBackTimer.join();
+  }
+  for (auto& entry: writeBacks) {
+    entry.second->flush();
+  }
+  writeBackPool.reset();
+
   //Loop through server connections and send stop signal.
-  std::map<std::string, ServerConnection>::iterator it;
-  for (it = connections.begin(); it != connections.end(); ++it) {
-    it->second.stop();
+  for (size_t i = 0; i < connections.size(); i++) {
+    connections[i].stop();
   }
+  fanOutPool.reset();
+  readaheadPool.reset();
+  diskCachePool.reset();
 
   for (size_t i = 0; i < heartbeatThreads.size(); i++) {
     heartbeatThreads[i].join();
   }
+
+  std::cerr << "Attribute cache: " << attrCache.hits() << " hits ("
+            << attrCache.absentHits() << " missing), "
+            << attrCache.misses() << " misses" << std::endl;
+  std::cerr << "Location cache: " << locations.requestsAvoided()
+            << " requests avoided" << std::endl;
+  std::cerr << "Block cache: " << blockCache.hits() << " hits, "
+            << blockCache.misses() << " misses, "
+            << blockCache.bytes() / (1024 * 1024) << " MB held, "
+            << blocksReadAhead << " read ahead, "
+            << blockCache.adopted() << " found under other files" << std::endl;
+  if (diskCache.enabled()) {
+    std::cerr << "Disk cache: " << diskCache.hits() << " hits, "
+              << diskCache.misses() << " misses, "
+              << diskCache.bytes() / (1024 * 1024) << " MB held" << std::endl;
+  }
+  std::cerr << "Write-back: " << writesHeld << " writes sent as "
+            << writesSent << std::endl;
+  std::cerr << "Delta: " << deltaBytes / (1024 * 1024) << " MB of rewrites sent as "
+            << deltaSent / (1024 * 1024) << " MB" << std::endl;
 }
 
 static int agfs_getattr(const char *path, struct stat *stbuf)
 {
   memset(stbuf, 0, sizeof(struct stat));
+  switch (attrCache.lookup(path, *stbuf)) {
+  case AttrCache::PRESENT:
+    return 0;
+  case AttrCache::ABSENT:
+    return -ENOENT;
+  default:
+    break;
+  }
+  uint64_t generation = attrCache.absentGeneration();
+  flushPath(path);
 
   //Initialize useful structures
-  std::pair<std::string, std::string> id{Disambiguater::ambiguate(path)};
-  std::string server{id.first}, file{id.second};
+  boost::string_view name;
+  server_id_t server = findServer(Disambiguater::ambiguate(path, name));
+  std::string file{name};
   std::pair<struct stat, agerr_t> retVal;
+  retVal.second = -ENOENT;
+
+  //The path is only known to be missing if every server we asked said so.
+  bool asked = false, allMissing = true;
 
-  //If the server is in our map, then only look at that server
-  std::map<std::string, ServerConnection>::iterator it;
-  it = connections.find(server);
-  if (it != connections.end() && it->second.connected()) {
-    retVal = it->second.getattr(file.c_str());
+  //If the server is in our table, then only look at that server
+  if (server != NO_SERVER && connections[server].connected()) {
+    retVal = connections[server].getattr(file.c_str());
+    asked = true;
+    allMissing = retVal.second == -ENOENT;
   } else {
-    //Otherwise, iterate through all connections to find the first such file.
-    for (it = connections.begin(); it != connections.end(); ++it) {
-      if (it->second.connected()) {
-        retVal = it->second.getattr(file.c_str());
+    //Otherwise, ask the servers known to hold the file, and failing that all
+    //the others at once.
+    bool exact = false;
+    std::vector<server_id_t> route;
+    size_t known = routeFor(file, route, exact);
+    std::vector<server_id_t> group{route.begin(), route.begin() + known};
+    std::vector<server_id_t> rest{route.begin() + known, route.end()};
+
+    size_t sent = 0;
+    server_id_t holder = NO_SERVER;
+    for (int pass = 0; pass < 2 && holder == NO_SERVER; pass++) {
+      std::vector<server_id_t>& servers = pass == 0 ? group : rest;
+      if (pass == 1 && exact) {
+        //The servers we expected don't have it any more.
+        locations.invalidate(file);
+      }
 
-        if (retVal.second >= 0) {
-          break;
-        }
+      size_t answered = fanOut<std::pair<struct stat, agerr_t>>(servers,
+        [file](ServerConnection& conn) { return conn.getattr(file.c_str()); },
+        [&retVal, &holder, &allMissing](server_id_t server, std::pair<struct stat, agerr_t>& result) {
+          if (result.second >= 0) {
+            retVal = result;
+            holder = server;
+            return true;
+          } else if (result.second != -ENOENT) {
+            retVal.second = result.second;
+            allMissing = false;
+          }
+          return false;
+        });
+      asked = asked || !servers.empty();
+      allMissing = allMissing && (holder != NO_SERVER || answered == servers.size());
+      sent += servers.size();
+    }
+
+    if (holder != NO_SERVER) {
+      server = holder;
+      locations.avoided(route.size() - sent);
+
+      //A directory may be on several servers, but a file is found on only
+      //one unless its name is suffixed.
+      if (!S_ISDIR(retVal.first.st_mode)) {
+        locations.insert(file, std::vector<std::string>{connections[holder].hostname()});
       }
     }
   }
@@ -122,6 +670,19 @@ static int agfs_getattr(const char *path, struct stat *stbuf)
   agerr_t error = retVal.second;
   if (error >= 0) {
     (*stbuf) = retVal.first;
+
+    //The server still has the old contents of a file being rewritten.
+    std::shared_ptr<WriteBuffer> replacement{replacementFor(path)};
+    agsize_t size = 0;
+    if (replacement && replacement->replacedSize(size)) {
+      stbuf->st_size = size;
+    }
+    attrCache.insert(path, *stbuf);
+
+    //Someone else may have changed the file since we cached its data.
+    blockCache.check(server, file, retVal.first);
+  } else if (asked && allMissing) {
+    attrCache.insertAbsent(path, generation);
   }
 
   return error;
@@ -131,24 +692,47 @@ static int agfs_access(const char *path, int mask)
 {
   agerr_t res = 0;
 
+  struct stat stbuf;
+  if (attrCache.lookup(path, stbuf) == AttrCache::ABSENT) {
+    return -ENOENT;
+  }
+  uint64_t generation = attrCache.absentGeneration();
+
   //Initialize useful structures
-  std::pair<std::string, std::string> id{Disambiguater::ambiguate(path)};
-  std::string server{id.first}, file{id.second};
+  boost::string_view name;
+  server_id_t server = findServer(Disambiguater::ambiguate(path, name));
+  std::string file{name};
 
   //Find the file
-  std::map<std::string, ServerConnection>::iterator it;
-  it = connections.find(server);
-  if (it != connections.end()) {
-    res = it->second.access(file.c_str(), mask);
+  bool allMissing = true;
+  if (server != NO_SERVER) {
+    res = connections[server].access(file.c_str(), mask);
+    allMissing = res == -ENOENT;
   } else {
-    for (it = connections.begin(); it != connections.end(); ++it) {
-      res = it->second.access(file.c_str(), mask);
-      if (res >= 0) {
-        break;
-      }
+    //Any server that has the file will do. Otherwise a server that has it
+    //but refused says more than the ones that don't have it.
+    std::vector<server_id_t> servers;
+    for (server_id_t id = 0; id < connections.size(); id++) {
+      servers.push_back(id);
     }
+
+    res = -ENOENT;
+    size_t answered = fanOut<agerr_t>(servers,
+      [file, mask](ServerConnection& conn) { return conn.access(file.c_str(), mask); },
+      [&res, &allMissing](server_id_t server, agerr_t& error) {
+        (void)server;
+        if (error >= 0 || res == -ENOENT) {
+          res = error;
+        }
+        allMissing = allMissing && error == -ENOENT;
+        return error >= 0;
+      });
+    allMissing = allMissing && answered == servers.size();
   }
 
+  if (res == -ENOENT && allMissing) {
+    attrCache.insertAbsent(path, generation);
+  }
   return res;
 }
 
@@ -166,64 +750,218 @@ static int agfs_readlink(const char *path, char *buf, size_t size)
 
 static int agfs_opendir(const char* path, struct fuse_file_info *fi)
 {
-  // We might want to place a file handle in the fi struct for later use.
   (void)path;
-  (void)fi;
-  std::cerr << "OpenDir unimplemented" << std::endl;
+  dir_handle_t* dir = new dir_handle_t{};
+  dir->position = 0;
+  dir->streamCookie = 0;
+  dir->streamEnd = false;
+  dir->holding = false;
+  dir->complete = false;
+  dir->error = -ENOTDIR;
+  fi->fh = (uint64_t)dir;
   return 0;
 }
 
-static int agfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+/*
+ * Feeds filler a listing from a single server, one chunk at a time, starting
+ * from the cookie FUSE handed back. Stops as soon as the kernel's buffer is
+ * full, so memory stays bounded by one chunk however large the directory is.
+ */
+static int streamDir(ServerConnection& conn, const std::string& file, const char* path,
+                     void* buf, fuse_fill_dir_t filler, off_t offset, dir_handle_t* dir)
 {
-  (void) fi;
-  (void) offset;
+  //The server forgets a listing once it has sent all of it, so the place
+  //is only known for the entry the kernel took last; anywhere else starts
+  //over.
+  agsize_t cookie = offset;
+  if (cookie != dir->streamCookie) {
+    dir->streamName.clear();
+    dir->streamEnd = false;
+  } else if (dir->streamEnd) {
+    return 0;
+  }
+  do {
+    std::pair<ServerConnection::DirChunk, agerr_t> chunk{conn.readdirChunk(file.c_str(), cookie, dir->streamName)};
+    if (chunk.second < 0) {
+      return chunk.second;
+    }
+
+    std::vector<ServerConnection::DirEntry>& entries = chunk.first.entries;
+    for (size_t i = 0; i < entries.size(); i++) {
+      //The listing already carries every entry's attributes, so the getattr
+      //calls that usually follow a readdir can be answered locally.
+      if (entries[i].name != "." && entries[i].name != "..") {
+        attrCache.insert(childPath(path, entries[i].name), entries[i].stbuf);
+      }
+      if (filler(buf, entries[i].name.c_str(), &entries[i].stbuf, entries[i].cookie)) {
+        return 0;
+      }
+      dir->streamCookie = entries[i].cookie;
+      dir->streamName = entries[i].name;
+    }
+    cookie = chunk.first.next;
+  } while (cookie != 0);
+
+  dir->streamEnd = true;
+  return 0;
+}
+
+/*
+ * Starts listing a directory on every server at once. Each server that
+ * answers in time joins the merge with its first chunk; the rest are left
+ * out of this listing.
+ */
+static void startMerge(const std::string& file, dir_handle_t* dir)
+{
+  dir->merge.clearPaths();
+  dir->servers.clear();
+  dir->cookies.clear();
+  dir->lastNames.clear();
+  dir->position = 0;
+  dir->holding = false;
+
+  std::vector<server_id_t> servers;
+  for (server_id_t id = 0; id < connections.size(); id++) {
+    servers.push_back(id);
+  }
 
   //We require two errors, one that is persistent, one that is temporary
-  agerr_t err = -ENOTDIR, temp;
+  agerr_t err = -ENOTDIR;
+  bool complete = true;
+  size_t answered = fanOut<std::pair<ServerConnection::DirChunk, agerr_t>>(servers,
+    [file](ServerConnection& conn) { return conn.readdirChunk(file.c_str(), 0, std::string{}); },
+    [dir, &err, &complete](server_id_t server, std::pair<ServerConnection::DirChunk, agerr_t>& chunk) {
+      if (chunk.second < 0) {
+        complete = complete && chunk.second == -ENOENT;
+        return false;
+      }
+      err = chunk.second;
 
-  //Initialize useful structures
-  std::pair<std::string, std::string> id{Disambiguater::ambiguate(path)};
-  std::string server{id.first}, file{id.second};
+      size_t source = dir->merge.addServer(connections[server].hostname());
+      std::vector<ServerConnection::DirEntry>& entries = chunk.first.entries;
+      for (size_t i = 0; i < entries.size(); i++) {
+        dir->merge.addFilepath(source, entries[i].name, entries[i].stbuf);
+      }
+      if (chunk.first.next == 0) {
+        dir->merge.finish(source);
+      }
+      dir->servers.push_back(server);
+      dir->cookies.push_back(chunk.first.next);
+      dir->lastNames.push_back(entries.empty() ? std::string{} : entries.back().name);
+      return false;
+    });
+
+  dir->complete = complete && answered == servers.size();
+  dir->error = err;
+}
 
-  Disambiguater disam{};
+/*
+ * Takes the next entry of a merged listing, fetching more of a server's
+ * listing whenever the merge runs dry on it. A server that fails part way is
+ * dropped from the listing.
+ */
+static bool nextMerged(const std::string& file, dir_handle_t* dir)
+{
+  size_t source;
+  while ((source = dir->merge.starved()) != Disambiguater::NONE) {
+    std::pair<ServerConnection::DirChunk, agerr_t> chunk{
+      connections[dir->servers[source]].readdirChunk(file.c_str(), dir->cookies[source], dir->lastNames[source])};
+
+    if (chunk.second < 0) {
+      dir->merge.finish(source);
+      dir->complete = false;
+      continue;
+    }
 
-  std::map<std::string, ServerConnection>::iterator it = connections.find(server);
-  if (it != connections.end()) {
-    std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t> retVal{it->second.readdir(file.c_str())};
-    if ((temp = std::get<1>(retVal)) >= 0) {
-      disam.addFilepaths(std::get<0>(retVal), it->first);
-      err = temp;
+    std::vector<ServerConnection::DirEntry>& entries = chunk.first.entries;
+    for (size_t i = 0; i < entries.size(); i++) {
+      dir->merge.addFilepath(source, entries[i].name, entries[i].stbuf);
     }
-  } else {
-    for (it = connections.begin(); it != connections.end(); ++it) {
-      std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t> retVal{it->second.readdir(file.c_str())};
-      if ((temp = std::get<1>(retVal)) >= 0) {
-        disam.addFilepaths(std::get<0>(retVal), it->first);
-        err = temp;
+    if (!entries.empty()) {
+      dir->lastNames[source] = entries.back().name;
+    }
+    dir->cookies[source] = chunk.first.next;
+    if (chunk.first.next == 0) {
+      dir->merge.finish(source);
+    }
+  }
+
+  if (!dir->merge.next(dir->heldName, dir->heldStat)) {
+    return false;
+  }
+  dir->holding = true;
+
+  //If every server is listing, we learn exactly where each entry lives.
+  if (dir->complete && dir->heldName != "." && dir->heldName != "..") {
+    std::string child{childPath(file.c_str(), dir->heldName)};
+    boost::string_view entry;
+    Disambiguater::ambiguate(child, entry);
+    locations.insert(std::string{entry}, dir->merge.holders());
+  }
+  return true;
+}
+
+static int agfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+  dir_handle_t* dir = (dir_handle_t*)fi->fh;
+
+  //Initialize useful structures
+  boost::string_view name;
+  server_id_t server = findServer(Disambiguater::ambiguate(path, name));
+  std::string file{name};
+
+  //A listing that comes from a single server needs no merging, so it is
+  //streamed as the kernel asks for it.
+  if (server == NO_SERVER) {
+    size_t connected = 0;
+    for (server_id_t id = 0; id < connections.size(); id++) {
+      if (connections[id].connected()) {
+        server = id;
+        connected++;
       }
     }
+    if (connected != 1) {
+      server = NO_SERVER;
+    }
+  }
+  if (server != NO_SERVER) {
+    return streamDir(connections[server], file, path, buf, filler, offset, dir);
   }
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+  //The merge only moves forward, so going back (rewinddir, seekdir) starts
+  //it over and skips what came before.
+  if (offset == 0 || offset != dir->position) {
+    startMerge(file, dir);
+  }
+  if (dir->error < 0) {
+    return dir->error;
+  }
 
-  //Fill the buffer with the filenames that were found.
-  std::vector<std::pair<std::string, struct stat>> disamPathsStats{disam.disambiguatedFilepathsWithStats()};
-  for (size_t i = 0; i < disamPathsStats.size(); i++) {
-    filler(buf, disamPathsStats[i].first.c_str(), &disamPathsStats[i].second, 0);
+  while (dir->position < offset && nextMerged(file, dir)) {
+    dir->holding = false;
+    dir->position++;
   }
-  disam.clearPaths();
 
-  return err;
+  while (dir->holding || nextMerged(file, dir)) {
+    //The listing already carries every entry's attributes, so the getattr
+    //calls that usually follow a readdir can be answered locally.
+    if (dir->heldName != "." && dir->heldName != "..") {
+      attrCache.insert(childPath(path, dir->heldName), dir->heldStat);
+    }
+    if (filler(buf, dir->heldName.c_str(), &dir->heldStat, dir->position + 1)) {
+      break;
+    }
+    dir->holding = false;
+    dir->position++;
+  }
+  return 0;
 }
 
 static int agfs_releasedir(const char* path, struct fuse_file_info *fi)
 {
   (void) path;
-  (void) fi;
-  std::cerr << "ReleaseDir unimplemented" << std::endl;
-  // We should probably remove the file handle and any associated data.
+  delete (dir_handle_t*)fi->fh;
   return 0;
 }
 
@@ -241,6 +979,7 @@ static int agfs_mknod(const char *path, mode_t mode, dev_t rdev)
     res = mkfifo(path, mode);
   else
     res = mknod(path, mode, rdev);
+  attrCache.invalidateAbsent();
   if (res == -1)
     return -errno;
 
@@ -252,6 +991,7 @@ static int agfs_mkdir(const char *path, mode_t mode)
   int res;
 
   res = mkdir(path, mode);
+  attrCache.invalidateAbsent();
   if (res == -1)
     return -errno;
 
@@ -263,6 +1003,8 @@ static int agfs_unlink(const char *path)
   int res;
 
   res = unlink(path);
+  attrCache.invalidate(path);
+  locations.invalidate(path);
   if (res == -1)
     return -errno;
 
@@ -274,6 +1016,7 @@ static int agfs_rmdir(const char *path)
   int res;
 
   res = rmdir(path);
+  attrCache.invalidate(path);
   if (res == -1)
     return -errno;
 
@@ -285,6 +1028,7 @@ static int agfs_symlink(const char *to, const char *from)
   int res;
 
   res = symlink(to, from);
+  attrCache.invalidateAbsent();
   if (res == -1)
     return -errno;
 
@@ -296,6 +1040,11 @@ static int agfs_rename(const char *from, const char *to)
   int res;
 
   res = rename(from, to);
+  attrCache.invalidate(from);
+  attrCache.invalidate(to);
+  locations.invalidate(from);
+  locations.invalidate(to);
+  attrCache.invalidateAbsent();
   if (res == -1)
     return -errno;
 
@@ -307,6 +1056,7 @@ static int agfs_link(const char *from, const char *to)
   int res;
 
   res = link(from, to);
+  attrCache.invalidateAbsent();
   if (res == -1)
     return -errno;
 
@@ -363,76 +1113,485 @@ static int agfs_utimens(const char *path, const struct timespec ts[2])
   return 0;
 }
 
+/*
+ * Copies a file into the disk cache in the background. The copy is read
+ * through a handle of its own, so it doesn't matter if the one that asked for
+ * it is closed first, and is dropped if the file has changed since then.
+ */
+static void fillDiskCache(server_id_t server, const std::string& file,
+                          const struct stat& stbuf)
+{
+  if (!diskCachePool || !diskCache.wants(stbuf.st_size)) {
+    return;
+  }
+
+  struct stat opened = stbuf;
+  diskCachePool->submit([server, file, opened]() {
+    ServerConnection& conn = connections[server];
+    diskCache.fill(conn.hostname(), file, opened,
+                   [&conn, &file, &opened](int fd) -> agerr_t {
+      if (!conn.connected()) {
+        return -ENOENT;
+      }
+      struct stat now;
+      std::pair<agfh_t, agerr_t> retVal{conn.open(file.c_str(), O_RDONLY, now)};
+      if (retVal.second < 0) {
+        return retVal.second;
+      }
+
+      agerr_t error = 0;
+      if (now.st_size != opened.st_size || now.st_mtime != opened.st_mtime) {
+        error = -EAGAIN;
+      }
+      std::vector<char> chunk(DISK_CACHE_FETCH_LEN);
+      agsize_t offset = 0;
+      while (error >= 0 && offset < (agsize_t)opened.st_size) {
+        std::pair<agsize_t, agerr_t> read{conn.readFile(retVal.first, chunk.size(), offset,
+                                                        chunk.data())};
+        if (read.second < 0) {
+          error = read.second;
+        } else if (read.first == 0) {
+          //Shorter than it said it was, so it is changing under us.
+          error = -EAGAIN;
+        } else if (pwrite(fd, chunk.data(), read.first, offset) != (ssize_t)read.first) {
+          error = -EIO;
+        }
+        offset += read.first;
+      }
+
+      conn.release(retVal.first);
+      return error;
+    });
+  });
+}
+
+/*
+ * Replaces the contents of a file that is being rewritten. The server signs
+ * the blocks the file holds now and only what isn't among them is sent; the
+ * rest is copied on the server. If that can't be done, the new contents are
+ * written in full.
+ */
+static agerr_t replaceFile(server_id_t server, agfh_t handle, const char* data, size_t length)
+{
+  ServerConnection& conn = connections[server];
+  if (!conn.connected()) {
+    return -ENOENT;
+  }
+
+  Delta::Signature signature;
+  if (conn.signature(handle, signature) >= 0) {
+    Delta delta{signature};
+    delta.encode(data, length);
+    if (conn.patch(handle, length, delta) >= 0) {
+      deltaBytes += length;
+      deltaSent += delta.literal().size();
+      return 0;
+    }
+  }
+
+  for (size_t done = 0; done < length; done += WRITEBACK_WRITE_LEN) {
+    size_t piece = std::min(length - done, WRITEBACK_WRITE_LEN);
+    std::pair<agsize_t, agerr_t> retVal{conn.writeFile(handle, piece, done, data + done)};
+    if (retVal.second < 0 || retVal.first < piece) {
+      return retVal.second < 0 ? retVal.second : -EIO;
+    }
+  }
+  return conn.truncate(handle, length);
+}
+
 static int agfs_open(const char *path, struct fuse_file_info *fi)
 {
-  std::pair<std::string, std::string> id{Disambiguater::ambiguate(path)};
-  std::string server{id.first}, file{id.second};
+  //A large file opened to be rewritten keeps its old contents until the new
+  //ones are all written, so only what changed need be sent. Its size must
+  //already be known; finding it out would cost a round trip. The server has
+  //to read the old contents, so it opens the file for reading as well.
+  int flags = fi->flags;
+  struct stat known;
+  bool delta = deltaLimit > 0 && writeBackLimit > 0 && (flags & O_TRUNC) &&
+      (flags & O_ACCMODE) != O_RDONLY &&
+      attrCache.lookup(path, known) == AttrCache::PRESENT && S_ISREG(known.st_mode) &&
+      (size_t)known.st_size >= DELTA_MIN_LEN;
+  if (delta) {
+    flags = (flags & ~(O_TRUNC | O_ACCMODE)) | O_RDWR;
+  }
+
+  //Opening may truncate or create the file, and writes through it follow.
+  attrCache.invalidate(path);
+  if (fi->flags & O_CREAT) {
+    attrCache.invalidateAbsent();
+  }
+
+  boost::string_view name;
+  boost::string_view serverName{Disambiguater::ambiguate(path, name)};
+  server_id_t server = findServer(serverName);
+  std::string file{name};
 
-  if (server.length() == 0) {
-    std::vector<std::string> servers = checkExistance(path);
+  bool cached = false;
+  if (serverName.empty()) {
+    std::vector<server_id_t> servers = checkExistance(path, cached);
     if (servers.size() != 1) {
       return -ENOENT;
     }
     server = servers[0];
   }
 
-  std::map<std::string, ServerConnection>::iterator it;
-  it = connections.find(server);
   agerr_t error = -ENOENT;
-  if (it != connections.end() && it->second.connected()) {
-    error = it->second.open(file.c_str(), fi->flags);
+  if (server != NO_SERVER && connections[server].connected()) {
+    if (delta && !connections[server].supports(feature::DELTA)) {
+      delta = false;
+      flags = fi->flags;
+    }
+
+    struct stat stbuf;
+    std::pair<agfh_t, agerr_t> retVal{connections[server].open(file.c_str(), flags, stbuf)};
+    if (delta && retVal.second == -EACCES) {
+      //We may only write it, so it is rewritten the ordinary way.
+      delta = false;
+      retVal = connections[server].open(file.c_str(), fi->flags, stbuf);
+    }
+    error = retVal.second;
     if (error >= 0) {
       file_handle_t* fileHandle = new file_handle_t{};
       fileHandle->server = server;
-      fileHandle->file = file;
+      fileHandle->handle = retVal.first;
+      fileHandle->path = path;
+      if (diskCache.enabled() && S_ISREG(stbuf.st_mode)) {
+        const std::string& hostname = connections[server].hostname();
+        if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+          diskCache.invalidate(hostname, file);
+        } else {
+          fileHandle->local = diskCache.open(hostname, file, stbuf);
+          if (!fileHandle->local) {
+            fillDiskCache(server, file, stbuf);
+          }
+        }
+      }
+      if (!fileHandle->local && blockCache.enabled() && S_ISREG(stbuf.st_mode)) {
+        fileHandle->cached = blockCache.open(server, file, stbuf);
+        fileHandle->readahead.reset(new Readahead{});
+      }
+      if (writeBackLimit > 0 && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        agfh_t handle = retVal.first;
+        fileHandle->writeBack.reset(new WriteBuffer{
+          [server, handle](agsize_t offset, const char* data, size_t length) {
+            std::pair<agsize_t, agerr_t> retVal;
+            retVal.second = -ENOENT;
+            ServerConnection& conn = connections[server];
+            if (conn.connected()) {
+              retVal = conn.writeFile(handle, length, offset, data);
+            }
+            writesSent++;
+            return retVal;
+          }});
+        if (delta) {
+          fileHandle->writeBack->replaceWhole([server, handle](const char* data, size_t length) {
+            return replaceFile(server, handle, data, length);
+          });
+        }
+
+        std::lock_guard<std::mutex> l{writeBacksLock};
+        writeBacks.emplace(fileHandle->path, fileHandle->writeBack);
+        writeBackCount++;
+      }
       fi->fh = (uintptr_t)fileHandle;
+      error = 0;
     }
   }
 
+  //The file has moved since we last saw it; look for it everywhere.
+  if (error == -ENOENT && cached) {
+    locations.invalidate(file);
+    return agfs_open(path, fi);
+  }
+
   return error;
 }
 
+/*
+ * Asks the server for the hashes of blocks [first, end) of a file, and names
+ * in the block cache those whose data it already holds under another file, so
+ * they needn't be fetched. A file none of whose blocks turn up is unlikely to
+ * be a copy, so it isn't asked about again. Returns the block after the last
+ * one asked about.
+ */
+static uint64_t adoptBlocks(file_handle_t* fileHandle, uint64_t version, uint64_t first,
+                            uint64_t end)
+{
+  static thread_local std::vector<aghash_t> hashes;
+  ServerConnection& conn = connections[fileHandle->server];
+  end = std::min<uint64_t>(end, first + BLOCK_HASH_MAX_LEN / BLOCK_CACHE_BLOCK_LEN);
+  if (!conn.connected() ||
+      conn.blockHashes(fileHandle->handle, first * BLOCK_CACHE_BLOCK_LEN, end - first,
+                       BLOCK_CACHE_BLOCK_LEN, hashes).second < 0) {
+    return end;
+  }
+
+  size_t adopted = 0;
+  for (size_t i = 0; i < hashes.size(); i++) {
+    adopted += blockCache.adopt(version, first + i, hashes[i]);
+  }
+  if (adopted == 0 && !hashes.empty()) {
+    fileHandle->unmatched = true;
+  }
+  return end;
+}
+
+/*
+ * Fetches blocks [first, end) of a file into the block cache in the
+ * background. Each block is marked finished in the file's readahead whether
+ * or not it could be fetched.
+ */
+static void fetchAhead(file_handle_t* fileHandle, uint64_t version, uint64_t first,
+                       uint64_t end)
+{
+  std::shared_ptr<Readahead> readahead{fileHandle->readahead};
+  server_id_t server = fileHandle->server;
+  agfh_t handle = fileHandle->handle;
+
+  std::function<void(uint64_t)> fetch{[readahead, server, handle, version](uint64_t index) {
+    static thread_local std::vector<char> fetched;
+    ServerConnection& conn = connections[server];
+
+    //Once the file is closing its handle may not be good much longer.
+    if (!readahead->closing() && !blockCache.contains(version, index) &&
+        conn.connected()) {
+      fetched.resize(BLOCK_CACHE_BLOCK_LEN);
+      std::pair<agsize_t, agerr_t> retVal{conn.readFile(handle, BLOCK_CACHE_BLOCK_LEN,
+                                                        index * BLOCK_CACHE_BLOCK_LEN,
+                                                        fetched.data())};
+      if (retVal.second >= 0) {
+        fetched.resize(retVal.first);
+        blockCache.insert(version, index, fetched);
+        blocksReadAhead++;
+      }
+    }
+    readahead->finished(index);
+  }};
+
+  if (!askBlockHashes || fileHandle->unmatched) {
+    for (uint64_t index = first; index < end; index++) {
+      readaheadPool->submit([fetch, index]() { fetch(index); });
+    }
+    return;
+  }
+
+  //One request finds the blocks already cached under other files. The file
+  //can't be released until the fetches are handed out, and the pool outlives
+  //them even while agfs_destroy shuts it down.
+  WorkerPool* pool = readaheadPool.get();
+  pool->submit([pool, fetch, fileHandle, version, first, end]() {
+    uint64_t index = first;
+    while (index < end && !fileHandle->readahead->closing()) {
+      index = adoptBlocks(fileHandle, version, index, end);
+    }
+    for (index = first; index < end; index++) {
+      pool->submit([fetch, index]() { fetch(index); });
+    }
+  });
+}
+
+/*
+ * Reads through the block cache. Blocks that aren't cached are fetched whole
+ * and kept, so the next read of them stays local. A reader going through the
+ * file in order has the blocks after it fetched in the background, and waits
+ * for one still on its way rather than asking for it again. Returns the
+ * number of bytes read, which is short only at the end of the file, or an
+ * error if nothing could be read.
+ */
+static int readBlocks(file_handle_t* fileHandle, ServerConnection& conn, char *buf,
+                      size_t size, off_t offset)
+{
+  //Each thread keeps the buffer it fetches blocks into, and gets back the
+  //buffer of whatever block the cache dropped to make room.
+  static thread_local std::vector<char> fetched;
+
+  uint64_t version = blockCache.version(*fileHandle->cached);
+  uint64_t hashed = 0;
+  size_t done = 0;
+  while (done < size) {
+    uint64_t index = (offset + done) / BLOCK_CACHE_BLOCK_LEN;
+    size_t within = (offset + done) % BLOCK_CACHE_BLOCK_LEN;
+    size_t copied = 0;
+    bool last = false;
+
+    bool hit = blockCache.read(version, index, within, buf + done, size - done, copied, last);
+    if (!hit && fileHandle->readahead->wait(index)) {
+      //It was being fetched ahead; it has landed by now unless that failed.
+      hit = blockCache.read(version, index, within, buf + done, size - done, copied, last);
+    }
+    if (!hit && askBlockHashes && !fileHandle->unmatched && index >= hashed) {
+      //The rest of the read may be cached under other files.
+      hashed = adoptBlocks(fileHandle, version, index,
+                           (offset + size - 1) / BLOCK_CACHE_BLOCK_LEN + 1);
+      hit = blockCache.read(version, index, within, buf + done, size - done, copied, last);
+    }
+
+    if (!hit) {
+      std::pair<agsize_t, agerr_t> retVal;
+      retVal.second = -ENOENT;
+      fetched.resize(BLOCK_CACHE_BLOCK_LEN);
+      if (conn.connected()) {
+        retVal = conn.readFile(fileHandle->handle, BLOCK_CACHE_BLOCK_LEN,
+                               index * BLOCK_CACHE_BLOCK_LEN, fetched.data());
+      }
+      if (retVal.second < 0) {
+        return done > 0 ? done : retVal.second;
+      }
+
+      fetched.resize(retVal.first);
+      if (within < fetched.size()) {
+        copied = std::min(fetched.size() - within, size - done);
+        memcpy(buf + done, fetched.data() + within, copied);
+      }
+      last = fetched.size() < BLOCK_CACHE_BLOCK_LEN;
+      blockCache.insert(version, index, fetched);
+    }
+
+    done += copied;
+    if (last) {
+      return done;
+    }
+  }
+
+  //Only a reader that hasn't reached the end of the file is worth getting
+  //ahead of.
+  uint64_t first, end;
+  fileHandle->readahead->plan(offset, size, readaheadBlocks, first, end);
+  if (first < end && readaheadPool) {
+    fetchAhead(fileHandle, version, first, end);
+  }
+
+  return done;
+}
+
 static int agfs_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi)
 {
   file_handle_t* fileHandle = (file_handle_t*)fi->fh;
-  std::string file{fileHandle->file}, server{fileHandle->server};
+  ServerConnection& conn = connections[fileHandle->server];
+  (void)path;
 
-  std::map<std::string, ServerConnection>::iterator it;
-  std::pair<std::vector<unsigned char>, agerr_t> retVal;
-  retVal.second = -ENOENT;
-  it = connections.find(server);
-  if (it != connections.end() && it->second.connected()) {
-    retVal = it->second.readFile(file.c_str(), size, offset);
-    if (retVal.second >= 0) {
-      memcpy(buf, &retVal.first[0], retVal.first.size());
+  std::shared_ptr<WriteBuffer> replacement{replacementFor(fileHandle->path)};
+  size_t held = 0;
+  if (replacement && replacement->readReplaced(offset, buf, size, held)) {
+    return held;
+  }
+  flushPath(fileHandle->path.c_str());
+
+  if (fileHandle->local) {
+    const DiskCache::Mapping& local = *fileHandle->local;
+    if ((size_t)offset >= local.size()) {
+      return 0;
     }
+    size_t length = std::min(size, local.size() - offset);
+    memcpy(buf, local.data() + offset, length);
+    return length;
   }
 
-  (void)path;
+  if (fileHandle->cached) {
+    return readBlocks(fileHandle, conn, buf, size, offset);
+  }
+
+  //The data lands straight in FUSE's buffer.
+  std::pair<agsize_t, agerr_t> retVal;
+  retVal.second = -ENOENT;
+  if (conn.connected()) {
+    retVal = conn.readFile(fileHandle->handle, size, offset, buf);
+  }
 
-  return retVal.second >= 0 ? retVal.first.size() : retVal.second;
+  return retVal.second >= 0 ? retVal.first : retVal.second;
+}
+
+/*
+ * Holds a write back to be sent with the ones around it. The write is sent
+ * in the background once enough has built up, and the writer waits for the
+ * server only when it gets too far ahead. A background send that failed
+ * fails the next write. A file being rewritten is held until it is flushed,
+ * or until deltaLimit bytes of it are held, when what there is so far goes
+ * out as a delta and the rest is written as usual.
+ */
+static int holdWrite(file_handle_t* fileHandle, const char *buf, size_t size, off_t offset)
+{
+  WriteBuffer& buffer = *fileHandle->writeBack;
+  agerr_t error = buffer.takeError();
+  if (error < 0) {
+    return error;
+  }
+
+  size_t held = buffer.add(offset, buf, size);
+  writesHeld++;
+  attrCache.invalidate(fileHandle->path);
+  if (fileHandle->cached) {
+    blockCache.invalidate(*fileHandle->cached);
+  }
+
+  bool replacing = buffer.replacing();
+  if (held >= (replacing ? deltaLimit : writeBackLimit)) {
+    buffer.flush();
+    if ((error = buffer.takeError()) < 0) {
+      return error;
+    }
+  } else if (!replacing && held >= WRITEBACK_FLUSH_LEN) {
+    queueFlush(fileHandle->writeBack);
+  }
+
+  return size;
 }
 
 static int agfs_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
   file_handle_t* fileHandle = (file_handle_t*)fi->fh;
-  std::string file{fileHandle->file}, server{fileHandle->server};
+  ServerConnection& conn = connections[fileHandle->server];
+
+  if (fileHandle->writeBack) {
+    return holdWrite(fileHandle, buf, size, offset);
+  }
 
-  std::map<std::string, ServerConnection>::iterator it;
   std::pair<agsize_t, agerr_t> retVal;
   retVal.second = -ENOENT;
-  it = connections.find(server);
-  if (it != connections.end() && it->second.connected()) {
-    retVal = it->second.writeFile(file.c_str(), size, offset, buf);
+  if (conn.connected()) {
+    retVal = conn.writeFile(fileHandle->handle, size, offset, buf);
+  }
+  attrCache.invalidate(fileHandle->path);
+  if (fileHandle->cached) {
+    blockCache.invalidate(*fileHandle->cached);
   }
-
   (void)path;
 
   return retVal.second >= 0 ? retVal.first : retVal.second;
 }
 
+static int agfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+  file_handle_t* fileHandle = (file_handle_t*)fi->fh;
+  ServerConnection& conn = connections[fileHandle->server];
+
+  //A server without TRUNCATE gets what it did before there was one.
+  if (!conn.supports(feature::DELTA)) {
+    return agfs_truncate(path, size);
+  }
+
+  //Writes held back came first, so they must land before the cut.
+  if (fileHandle->writeBack) {
+    fileHandle->writeBack->flush();
+    agerr_t error = fileHandle->writeBack->takeError();
+    if (error < 0) {
+      return error;
+    }
+  }
+
+  agerr_t error = -ENOENT;
+  if (conn.connected()) {
+    error = conn.truncate(fileHandle->handle, size);
+  }
+  attrCache.invalidate(fileHandle->path);
+  if (fileHandle->cached) {
+    blockCache.invalidate(*fileHandle->cached);
+  }
+  return error;
+}
+
 static int agfs_statfs(const char *path, struct statvfs *stbuf)
 {
   int res;
@@ -446,27 +1605,62 @@ static int agfs_statfs(const char *path, struct statvfs *stbuf)
 
 static int agfs_release(const char *path, struct fuse_file_info *fi)
 {
-  /* Just a stub. This method is optional and can safely be left
-     unimplemented */
-
   file_handle_t* fileHandle = (file_handle_t*)((uintptr_t)fi->fh);
+  attrCache.invalidate(path);
+
+  //Blocks being fetched ahead use the handle, and held-back writes need it,
+  //so they must finish first.
+  if (fileHandle->readahead) {
+    fileHandle->readahead->close();
+  }
+  if (fileHandle->writeBack) {
+    fileHandle->writeBack->flush();
+
+    std::lock_guard<std::mutex> l{writeBacksLock};
+    auto range = writeBacks.equal_range(fileHandle->path);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == fileHandle->writeBack) {
+        writeBacks.erase(it);
+        writeBackCount--;
+        break;
+      }
+    }
+  }
+
+  //Let the server close its side of the file.
+  ServerConnection& conn = connections[fileHandle->server];
+  if (conn.connected()) {
+    conn.release(fileHandle->handle);
+  }
   delete fileHandle;
 
-  (void) path;
-  (void) fi;
   return 0;
 }
 
+/*
+ * Called on every close() of a file. Sends what is held back for it and
+ * reports any write that failed in the background, since this is the last
+ * chance to tell the application.
+ */
+static int agfs_flush(const char *path, struct fuse_file_info *fi)
+{
+  file_handle_t* fileHandle = (file_handle_t*)fi->fh;
+  (void)path;
+
+  if (!fileHandle->writeBack) {
+    return 0;
+  }
+  fileHandle->writeBack->flush();
+  return fileHandle->writeBack->takeError();
+}
+
 static int agfs_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-  /* Just a stub. This method is optional and can safely be left
-     unimplemented */
-
-  (void) path;
-  (void) isdatasync;
-  (void) fi;
-  return 0;
+  //The server has no fsync of its own, so the most we can do is get the
+  //data to it.
+  (void)isdatasync;
+  return agfs_flush(path, fi);
 }
 
 #ifdef HAVE_SETXATTR
@@ -506,6 +1700,42 @@ static int agfs_removexattr(const char *path, const char *name)
 }
 #endif /* HAVE_SETXATTR */
 
+/************
+ * TUNABLES *
+ ************/
+
+struct agfs_options {
+  int attrCacheMsec;
+  int absentCacheMsec;
+  int fanOutMsec;
+  int blockCacheMb;
+  int readaheadKb;
+  int writeBackKb;
+  int diskCacheMb;
+  int blockHashes;
+  int deltaMb;
+  int compress;
+};
+
+static struct agfs_options options;
+
+#define AGFS_TUNABLE(t, p) { t, offsetof(struct agfs_options, p), 0 }
+
+//Passed as ordinary mount options, e.g. -o attr_cache_ms=500
+static struct fuse_opt agfs_tunables[] = {
+  AGFS_TUNABLE("attr_cache_ms=%d", attrCacheMsec),
+  AGFS_TUNABLE("absent_cache_ms=%d", absentCacheMsec),
+  AGFS_TUNABLE("fanout_ms=%d", fanOutMsec),
+  AGFS_TUNABLE("block_cache_mb=%d", blockCacheMb),
+  AGFS_TUNABLE("readahead_kb=%d", readaheadKb),
+  AGFS_TUNABLE("writeback_kb=%d", writeBackKb),
+  AGFS_TUNABLE("disk_cache_mb=%d", diskCacheMb),
+  AGFS_TUNABLE("block_hashes=%d", blockHashes),
+  AGFS_TUNABLE("delta_mb=%d", deltaMb),
+  AGFS_TUNABLE("compress=%d", compress),
+  FUSE_OPT_END
+};
+
 /************************************
  * OPTIONS PROCESSING (Not working) *
  ************************************/
@@ -567,20 +1797,6 @@ static int agfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 }*/
 
 
-void heartbeatThread(ServerConnection& conn) {
-  std::chrono::seconds beatTime{5};
-  std::chrono::seconds reconnTime{30};
-  while(!conn.closed()) {
-    if (!conn.connected()) {
-      std::this_thread::sleep_for(reconnTime);
-      conn.connect();
-    } else {
-      std::this_thread::sleep_for(beatTime);
-      conn.heartbeat();
-    }
-  }
-}
-
 static const boost::filesystem::path KEYDIRPATH(".agfs");
 static const std::string EXTENSION(".agkey");
 
@@ -590,12 +1806,43 @@ static struct fuse_operations agfs_oper;
 
 int main(int argc, char *argv[])
 {
+  //Pull our own options out before FUSE sees the command line.
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  options.attrCacheMsec = ATTR_CACHE_MSEC;
+  options.absentCacheMsec = ABSENT_CACHE_MSEC;
+  options.fanOutMsec = FANOUT_MSEC;
+  options.blockCacheMb = BLOCK_CACHE_MB;
+  options.readaheadKb = READAHEAD_KB;
+  options.writeBackKb = WRITEBACK_KB;
+  options.diskCacheMb = DISK_CACHE_MB;
+  options.blockHashes = BLOCK_HASHES;
+  options.deltaMb = DELTA_MB;
+  options.compress = COMPRESS;
+  if (fuse_opt_parse(&args, &options, agfs_tunables, NULL) == -1) {
+    return 1;
+  }
+  attrCache.setTtl(std::chrono::milliseconds{options.attrCacheMsec},
+                   std::chrono::milliseconds{options.absentCacheMsec});
+  fanOutDeadline = std::chrono::milliseconds{options.fanOutMsec};
+  blockCache.setBudget((size_t)std::max(options.blockCacheMb, 0) * 1024 * 1024);
+  readaheadBlocks = (size_t)std::max(options.readaheadKb, 0) * 1024 / BLOCK_CACHE_BLOCK_LEN;
+  writeBackLimit = (size_t)std::max(options.writeBackKb, 0) * 1024;
+  askBlockHashes = options.blockHashes != 0;
+  deltaLimit = (size_t)std::max(options.deltaMb, 0) * 1024 * 1024;
+  if (options.compress == 0) {
+    serverOffer.encodings = enc::NONE;
+  }
+
   path homeDir{getenv("HOME")};
   homeDir /= KEYDIRPATH;
   if(!exists(homeDir)) {
     std::cerr << "Could not find key directory: ~/.agfs" << std::endl;
     exit(1);
   }
+  if (options.diskCacheMb > 0 &&
+      !diskCache.start((homeDir / "cache").native(), (size_t)options.diskCacheMb * 1024 * 1024)) {
+    std::cerr << "Could not use disk cache: ~/.agfs/cache" << std::endl;
+  }
 
   directory_iterator end_itr; // default construction yields past-the-end
   for ( directory_iterator itr( homeDir ); itr != end_itr; ++itr ) {
@@ -606,26 +1853,20 @@ int main(int argc, char *argv[])
         keyfile.open(itr->path().native(), std::fstream::in);
         if(keyfile.is_open()) {
           std::cout << "Opened keyfile" << std::endl;
-          std::string hostname, port, key;
-          keyfile >> hostname;
-          keyfile >> port;
-          keyfile >> key;
-          ServerConnection connection{hostname, port, key};
-          if (connection.connected() && !connection.stopped()) {
-            connections.insert(std::make_pair(hostname, connection));
-          }
+          server_key_t server;
+          keyfile >> server.hostname;
+          keyfile >> server.port;
+          keyfile >> server.key;
+          serverKeys.push_back(server);
         }
         keyfile.close();
       }
     }
   }
 
-  for (auto& connPair: connections) {
-    heartbeatThreads.push_back(std::thread(heartbeatThread, std::ref(connPair.second)));
-  }
-
   memset(&agfs_oper, 0, sizeof(struct fuse_operations));
 
+  agfs_oper.init = agfs_init;
   agfs_oper.destroy = agfs_destroy;
   agfs_oper.getattr = agfs_getattr;
   agfs_oper.access = agfs_access;
@@ -643,12 +1884,14 @@ int main(int argc, char *argv[])
   agfs_oper.chmod = agfs_chmod;
   agfs_oper.chown = agfs_chown;
   agfs_oper.truncate = agfs_truncate;
+  agfs_oper.ftruncate = agfs_ftruncate;
   agfs_oper.utimens = agfs_utimens;
   agfs_oper.open = agfs_open;
   agfs_oper.read = agfs_read;
   agfs_oper.write = agfs_write;
   agfs_oper.statfs = agfs_statfs;
   agfs_oper.release = agfs_release;
+  agfs_oper.flush = agfs_flush;
   agfs_oper.fsync = agfs_fsync;
 #ifdef HAVE_SETXATTR
   agfs_oper.setxattr = agfs_setxattr;
@@ -657,5 +1900,7 @@ int main(int argc, char *argv[])
   agfs_oper.removexattr = agfs_removexattr;
 #endif
 
-  return fuse_main(argc, argv, &agfs_oper, NULL);
+  int ret = fuse_main(args.argc, args.argv, &agfs_oper, NULL);
+  fuse_opt_free_args(&args);
+  return ret;
 }
@@ -11,7 +11,7 @@
 #include <iostream>
 
 #include "constants.hpp"
-#include "agfs-server.hpp"
+#include "reactor.hpp"
 
 int openPort(char* port){
   int listenfd, optval=1, error;
@@ -50,7 +50,8 @@ int openPort(char* port){
     return -1;
   }
  
-  if (listen(listenfd, 1) == -1){
+  //Let a burst of clients queue up while the reactor gets to them.
+  if (listen(listenfd, SOMAXCONN) == -1){
     printf("listen failed\n");
     return -1;
   }
@@ -75,36 +76,16 @@ int main(int argc, char** argv){
   }
 
   //Create the port to listen on
-
-  int lfd, connfd;
-  struct sockaddr_in client;
-  socklen_t clientlen;
-
-  lfd = openPort(argv[1]);
+  int lfd = openPort(argv[1]);
 
   if (lfd < 0) {
     printf("Could not open file descriptor for listening\n");
     return 1;
   }
 
-  while (1) {
-    clientlen = sizeof client;
-    connfd = accept(lfd, (struct sockaddr*)&client, &clientlen);
-    if(connfd == -1) continue;
-
-    pid_t pid;
-    //Could fork here
-    if((pid = fork()) < 0) {
-      cerr << "Fork Error" << endl;
-    } else if(pid == 0) {
-      close(lfd);
-      ClientConnection client{connfd};
-      if(client.connected()) {
-        client.processCommands();
-      }
-      break;
-    }
-    cerr << "Forked client" << endl;
-    close(connfd);
-  }
-}
\ No newline at end of file
+  //Serve every client from this process; requests switch to the client's
+  //user on the worker thread that runs them.
+  Reactor reactor{lfd};
+  reactor.run();
+  return 1;
+}
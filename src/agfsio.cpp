@@ -1,196 +1,304 @@
 #include "agfsio.hpp"
+#include "framesocket.hpp"
+#include <algorithm>
 #include <endian.h>
-#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
 
+Frame::Frame()
+	:buffer_{},
+	 readPos_{0},
+	 id_{0}
+{
+	//Nothing to do here...
+}
+
+void Frame::clear()
+{
+	buffer_.clear();
+	readPos_ = 0;
+}
+
+void Frame::append(const void* data, size_t length)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	buffer_.insert(buffer_.end(), bytes, bytes + length);
+}
+
+void Frame::overwrite(size_t offset, const void* data, size_t length)
+{
+	memcpy(&buffer_[offset], data, length);
+}
+
+int Frame::consume(void* data, size_t length)
+{
+	if (length > remaining()) {
+		readPos_ = buffer_.size();
+		return -1;
+	}
+
+	memcpy(data, buffer_.data() + readPos_, length);
+	readPos_ += length;
+	return length;
+}
+
+const unsigned char* Frame::take(size_t length)
+{
+	if (length > remaining()) {
+		readPos_ = buffer_.size();
+		return NULL;
+	}
+
+	const unsigned char* bytes = buffer_.data() + readPos_;
+	readPos_ += length;
+	return bytes;
+}
+
+unsigned char* Frame::prepare(size_t length)
+{
+	buffer_.resize(length);
+	readPos_ = 0;
+	return buffer_.data();
+}
+
+unsigned char* Frame::extend(size_t length)
+{
+	size_t start = buffer_.size();
+	buffer_.resize(start + length);
+	return buffer_.data() + start;
+}
 
+const unsigned char* Frame::data() const
+{
+	return buffer_.data();
+}
+
+size_t Frame::size() const
+{
+	return buffer_.size();
+}
+
+size_t Frame::remaining() const
+{
+	return buffer_.size() - readPos_;
+}
+
+agreqid_t Frame::id() const
+{
+	return id_;
+}
 
-int agfs_write_cmd(int fd, cmd_t cmd)
+void Frame::setId(agreqid_t id)
+{
+	id_ = id;
+}
+
+int agfs_write_cmd(Frame& frame, cmd_t cmd)
 {
 	cmd = htobe16(cmd);
-	return write(fd, &cmd, sizeof(cmd_t));
+	frame.append(&cmd, sizeof(cmd_t));
+	return sizeof(cmd_t);
 }
 
-int agfs_read_cmd(int fd, cmd_t& cmd)
+int agfs_read_cmd(Frame& frame, cmd_t& cmd)
 {
-	int err = read(fd, &cmd, sizeof(cmd_t));
+	int err = frame.consume(&cmd, sizeof(cmd_t));
 	cmd = be16toh(cmd);
 	return err;
 }
 
-int agfs_write_mask(int fd, agmask_t mask)
+int agfs_write_mask(Frame& frame, agmask_t mask)
 {
 	mask = htobe32(mask);
-	return write(fd, &mask, sizeof(agmask_t));
+	frame.append(&mask, sizeof(agmask_t));
+	return sizeof(agmask_t);
 }
 
-int agfs_read_mask(int fd, agmask_t& mask)
+int agfs_read_mask(Frame& frame, agmask_t& mask)
 {
-	int err = read(fd, &mask, sizeof(agmask_t));
+	int err = frame.consume(&mask, sizeof(agmask_t));
 	mask = be32toh(mask);
 	return err;
 }
 
-int agfs_write_size(int fd, agsize_t size)
+int agfs_write_sum(Frame& frame, agsum_t sum)
+{
+	sum = htobe32(sum);
+	frame.append(&sum, sizeof(agsum_t));
+	return sizeof(agsum_t);
+}
+
+int agfs_read_sum(Frame& frame, agsum_t& sum)
+{
+	int err = frame.consume(&sum, sizeof(agsum_t));
+	sum = be32toh(sum);
+	return err;
+}
+
+int agfs_write_size(Frame& frame, agsize_t size)
+{
+	size = htobe64(size);
+	frame.append(&size, sizeof(agsize_t));
+	return sizeof(agsize_t);
+}
+
+int agfs_patch_size(Frame& frame, size_t offset, agsize_t size)
 {
 	size = htobe64(size);
-	return write(fd, &size, sizeof(agsize_t));
+	frame.overwrite(offset, &size, sizeof(agsize_t));
+	return sizeof(agsize_t);
 }
 
-int agfs_read_size(int fd, agsize_t& size)
+int agfs_read_size(Frame& frame, agsize_t& size)
 {
-	int error = read(fd, &size, sizeof(agsize_t));
+	int error = frame.consume(&size, sizeof(agsize_t));
 	size = be64toh(size);
 	return error;
 }
 
-int agfs_write_error(int fd, agerr_t err)
+int agfs_write_handle(Frame& frame, agfh_t handle)
+{
+	handle = htobe64(handle);
+	frame.append(&handle, sizeof(agfh_t));
+	return sizeof(agfh_t);
+}
+
+int agfs_read_handle(Frame& frame, agfh_t& handle)
+{
+	int error = frame.consume(&handle, sizeof(agfh_t));
+	handle = be64toh(handle);
+	return error;
+}
+
+int agfs_write_error(Frame& frame, agerr_t err)
 {
 	err = htobe64(err);
-	return write(fd, &err, sizeof(agerr_t));
+	frame.append(&err, sizeof(agerr_t));
+	return sizeof(agerr_t);
 }
 
-int agfs_read_error(int fd, agerr_t& err)
+int agfs_read_error(Frame& frame, agerr_t& err)
 {
-	int error = read(fd, &err, sizeof(agerr_t));
+	int error = frame.consume(&err, sizeof(agerr_t));
 	err = be64toh(err);
 	return error;
 }
 
-int agfs_write_string(int fd, const std::string& str)
+int agfs_write_string(Frame& frame, const std::string& str)
 {
-	int total_written = 0, err;
-	if ((err = agfs_write_size(fd, str.length())) < 0)
-	{
-		return err;
-	}
-	total_written += err;
+	int total_written = agfs_write_size(frame, str.length());
 
-	if ((err = write(fd, str.c_str(), str.length() * sizeof(char))) < 0)
-	{
-		return err;
-	}
-	total_written += err;
+	frame.append(str.c_str(), str.length() * sizeof(char));
+	total_written += str.length() * sizeof(char);
 
 	return total_written;
 }
 
-int agfs_read_string(int fd, std::string& str)
+int agfs_read_string(Frame& frame, std::string& str)
 {
 	int total_read = 0, err;
 	agsize_t pathLen = 0;
-	if ((err = agfs_read_size(fd, pathLen)) < 0)
+	if ((err = agfs_read_size(frame, pathLen)) < 0)
 	{
 		return err;
 	}
 	total_read += err;
 
-	char* string = (char*)malloc(sizeof(char) * (pathLen + 1));
-	err = read(fd, string, pathLen);
-	string[pathLen] = 0;
-	str = string;
-	free(string);
+	//Never trust the peer's length more than the bytes we actually received.
+	if (pathLen > frame.remaining())
+	{
+		frame.consume(NULL, pathLen);
+		str.clear();
+		return -1;
+	}
 
-	if (err < 0)
+	str.resize(pathLen);
+	if (pathLen > 0)
 	{
-		return err;
+		frame.consume(&str[0], pathLen);
 	}
-	total_read += err;
+	total_read += pathLen;
 
 	return total_read;
 }
 
-int agfs_write_stat(int fd, struct stat& buf)
+int agfs_write_stat(Frame& frame, const struct stat& buf)
 {
-	int temp, total_written = 0;
+	int total_written = 0;
 
 	agdev_t dev = buf.st_dev;
 	dev = htobe64(dev);
-	if ((temp = write(fd, &dev, sizeof(agdev_t))) < 0) {
-		return temp;
-	}
-	total_written += temp;
+	frame.append(&dev, sizeof(agdev_t));
+	total_written += sizeof(agdev_t);
 
 	agmode_t mode = buf.st_mode;
 	mode = htobe32(mode);
-	if ((temp = write(fd, &mode, sizeof(agmode_t))) < 0) {
-		return temp;
-	}
-	total_written += temp;
+	frame.append(&mode, sizeof(agmode_t));
+	total_written += sizeof(agmode_t);
 
 	agsize_t size = buf.st_size;
-	if ((temp = agfs_write_size(fd, size)) < 0) {
-		return temp;
-	}
-	total_written += temp;
+	total_written += agfs_write_size(frame, size);
 
 	agtime_t atime = buf.st_atime;
 	atime = htobe64(atime);
-	if ((temp = write(fd, &atime, sizeof(agtime_t))) < 0) {
-		return temp;
-	}
-	total_written += temp;
+	frame.append(&atime, sizeof(agtime_t));
+	total_written += sizeof(agtime_t);
 
 	agtime_t mtime = buf.st_mtime;
 	mtime = htobe64(mtime);
-	if ((temp = write(fd, &mtime, sizeof(agtime_t))) < 0) {
-		return temp;
-	}
-	total_written += temp;
+	frame.append(&mtime, sizeof(agtime_t));
+	total_written += sizeof(agtime_t);
 
 	agtime_t ctimestamp = buf.st_ctime;
 	ctimestamp = htobe64(ctimestamp);
-	if ((temp = write(fd, &ctimestamp, sizeof(agtime_t))) < 0) {
-		return temp;
-	}
-	total_written += temp;
+	frame.append(&ctimestamp, sizeof(agtime_t));
+	total_written += sizeof(agtime_t);
 
 	return total_written;
 }
 
-int agfs_read_stat(int fd, struct stat& buf)
+int agfs_read_stat(Frame& frame, struct stat& buf)
 {
 	int temp, total_read = 0;
 	memset(&buf, 0, sizeof(struct stat));
 
 	agdev_t dev;
-	if ((temp = read(fd, &dev, sizeof(agdev_t))) < 0) {
+	if ((temp = frame.consume(&dev, sizeof(agdev_t))) < 0) {
 		return temp;
 	}
 	dev = be64toh(dev);
 	total_read += temp;
 
 	agmode_t mode;
-	if ((temp = read(fd, &mode, sizeof(agmode_t))) < 0) {
+	if ((temp = frame.consume(&mode, sizeof(agmode_t))) < 0) {
 		return temp;
 	}
 	mode = be32toh(mode);
 	total_read += temp;
 
 	agsize_t size = 0;
-	if ((temp = agfs_read_size(fd, size)) < 0) {
+	if ((temp = agfs_read_size(frame, size)) < 0) {
 		return temp;
 	}
 	total_read += temp;
 
 	agtime_t atime = 0;
-	if ((temp = read(fd, &atime, sizeof(agtime_t))) < 0) {
+	if ((temp = frame.consume(&atime, sizeof(agtime_t))) < 0) {
 		return temp;
 	}
 	atime = be64toh(atime);
 	total_read += temp;
 
 	agtime_t mtime = 0;
-	if ((temp = read(fd, &mtime, sizeof(agtime_t))) < 0) {
+	if ((temp = frame.consume(&mtime, sizeof(agtime_t))) < 0) {
 		return temp;
 	}
 	mtime = be64toh(mtime);
 	total_read += temp;
 
 	agtime_t ctimestamp = 0;
-	if ((temp = read(fd, &ctimestamp, sizeof(agtime_t))) < 0) {
+	if ((temp = frame.consume(&ctimestamp, sizeof(agtime_t))) < 0) {
 		return temp;
 	}
 	ctimestamp = be64toh(ctimestamp);
@@ -205,3 +313,65 @@ int agfs_read_stat(int fd, struct stat& buf)
 
 	return total_read;
 }
+
+int agfs_write_hello(Frame& frame, const Hello& hello)
+{
+	int total_written = 0;
+	total_written += agfs_write_size(frame, hello.version);
+	total_written += agfs_write_mask(frame, hello.features);
+	total_written += agfs_write_size(frame, hello.maxFrame);
+	total_written += agfs_write_size(frame, hello.maxInFlight);
+	total_written += agfs_write_mask(frame, hello.encodings);
+	return total_written;
+}
+
+int agfs_read_hello(Frame& frame, Hello& hello)
+{
+	if (agfs_read_size(frame, hello.version) < 0 ||
+		agfs_read_mask(frame, hello.features) < 0 ||
+		agfs_read_size(frame, hello.maxFrame) < 0 ||
+		agfs_read_size(frame, hello.maxInFlight) < 0 ||
+		agfs_read_mask(frame, hello.encodings) < 0) {
+		return -1;
+	}
+	return 2 * sizeof(agmask_t) + 3 * sizeof(agsize_t);
+}
+
+Hello Hello::local()
+{
+	Hello hello;
+	hello.version = PROTOCOL_VERSION;
+	hello.features = FEATURES;
+	hello.maxFrame = MAX_FRAME_LEN;
+	hello.maxInFlight = MAX_IN_FLIGHT;
+	hello.encodings = ENCODINGS;
+	return hello;
+}
+
+Hello Hello::legacy()
+{
+	//Every build so far has had the same limits.
+	Hello hello;
+	hello.version = 0;
+	hello.features = feature::NONE;
+	hello.maxFrame = MAX_FRAME_LEN;
+	hello.maxInFlight = MAX_IN_FLIGHT;
+	hello.encodings = enc::NONE;
+	return hello;
+}
+
+Hello Hello::agree(const Hello& other) const
+{
+	//Limits too small to work with are taken for a broken peer.
+	if (other.maxFrame < HELLO_MIN_FRAME_LEN || other.maxInFlight < HELLO_MIN_IN_FLIGHT) {
+		return agree(legacy());
+	}
+
+	Hello agreed;
+	agreed.version = std::min(version, other.version);
+	agreed.features = features & other.features;
+	agreed.maxFrame = std::min(maxFrame, other.maxFrame);
+	agreed.maxInFlight = std::min(maxInFlight, other.maxInFlight);
+	agreed.encodings = encodings & other.encodings;
+	return agreed;
+}
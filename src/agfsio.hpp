@@ -6,107 +6,262 @@
  * This file is meant to serve as a wrapper for networking between devices with
  * different endianness. The IO methods present in this file and accompanying
  * cpp file will all handle endianness appropriately. In addition, after having
- * written data to a socket the corresponding read method can be called on the
- * other end and the exact same data will come out (assuming there are no IO
- * errors with the pipe).
+ * written data to a frame the corresponding read method can be called on the
+ * frame received at the other end and the exact same data will come out.
+ *
+ * None of these helpers touch a socket. A whole request or reply is encoded
+ * into a Frame and handed to a FrameSocket (see framesocket.hpp), which sends
+ * it with a single system call.
  */
 
+#include <sys/stat.h>
+#include <string>
+#include <vector>
 #include "constants.hpp"
 
 /**
- * \brief Write a command on the connection.
- * \details Handles endianness and writes a command to a provided connection.
- * \param fd The file descriptor of the connection to write on
+ * \brief The encoded body of one message on an AgFS connection.
+ * \details Writes append to the end of the frame and reads consume from the
+ *          front, so a frame can be filled on one peer and drained in the same
+ *          order on the other.
+ */
+class Frame {
+public:
+	Frame();
+
+	/// Discard the contents of the frame, keeping its allocation.
+	void clear();
+
+	/// Append raw bytes to the end of the frame.
+	void append(const void* data, size_t length);
+
+	/// Overwrite bytes that were appended earlier, starting at offset.
+	void overwrite(size_t offset, const void* data, size_t length);
+
+	/**
+	 * \brief Consume raw bytes from the front of the frame.
+	 * \returns The number of bytes consumed, or -1 if the frame is too short.
+	 */
+	int consume(void* data, size_t length);
+
+	/**
+	 * \brief Consume raw bytes from the front of the frame without copying.
+	 * \returns A pointer to the bytes inside the frame, or NULL if the frame
+	 *          is too short.
+	 */
+	const unsigned char* take(size_t length);
+
+	/// Resize the frame to hold a received message and rewind it.
+	unsigned char* prepare(size_t length);
+
+	/// Grow the frame by length bytes for more of a received message.
+	unsigned char* extend(size_t length);
+
+	/// Returns the encoded bytes of the frame.
+	const unsigned char* data() const;
+
+	/// Returns the encoded size of the frame.
+	size_t size() const;
+
+	/// Returns the number of bytes that have not been consumed yet.
+	size_t remaining() const;
+
+	/// Returns the id of the request this frame belongs to.
+	agreqid_t id() const;
+
+	/// Tag the frame as belonging to a request.
+	void setId(agreqid_t id);
+
+private:
+	std::vector<unsigned char> buffer_;
+	size_t readPos_;
+	agreqid_t id_;
+};
+
+/**
+ * \brief What one end of a connection can do, as the two ends tell each other
+ *        when connecting.
+ * \details Both ends send their own and then work to what they agree on, so a
+ *          new feature can be rolled out one host at a time: it is only used
+ *          between two hosts that both have it. A peer that predates the hello
+ *          is taken to be legacy().
+ */
+struct Hello {
+	/// Returns what this build can do.
+	static Hello local();
+
+	/// Returns what a peer that sends no hello can do.
+	static Hello legacy();
+
+	/// Returns what both ends can do: the lower version and limits, and the
+	/// features and encodings that both have. A hello with limits below
+	/// HELLO_MIN_FRAME_LEN or HELLO_MIN_IN_FLIGHT is taken to be legacy().
+	Hello agree(const Hello& other) const;
+
+	agsize_t version;
+	agmask_t features;
+
+	//Largest frame this end receives, and most requests it serves at once
+	agsize_t maxFrame;
+	agsize_t maxInFlight;
+
+	agmask_t encodings;
+};
+
+/**
+ * \brief Write a command on the frame.
+ * \details Handles endianness and writes a command to a provided frame.
+ * \param frame The frame to write on
  * \param cmd The command to write
  */
-int agfs_write_cmd(int fd, cmd_t cmd);
+int agfs_write_cmd(Frame& frame, cmd_t cmd);
 
 /**
-* \brief Read a command on the connection.
-* \details Handles endianness and read a command from a provided connection.
-* \param fd The file descriptor of the connection to read on
+* \brief Read a command from the frame.
+* \details Handles endianness and read a command from a provided frame.
+* \param frame The frame to read from
 * \param cmd The command buffer to read into.
 */
-int agfs_read_cmd(int fd, cmd_t& cmd);
+int agfs_read_cmd(Frame& frame, cmd_t& cmd);
 
 /**
- * \brief Write a mask on the connection.
- * \details Handles endianness and writes a mask to a provided connection.
- * \param fd The file descriptor of the connection to write on
+ * \brief Write a mask on the frame.
+ * \details Handles endianness and writes a mask to a provided frame.
+ * \param frame The frame to write on
  * \param mask The mask to write
  */
-int agfs_write_mask(int fd, agmask_t mask);
+int agfs_write_mask(Frame& frame, agmask_t mask);
 
 /**
-* \brief Read a mask on the connection.
-* \details Handles endianness and read a mask from a provided connection.
-* \param fd The file descriptor of the connection to read on
+* \brief Read a mask from the frame.
+* \details Handles endianness and read a mask from a provided frame.
+* \param frame The frame to read from
 * \param mask The mask buffer to read into.
 */
-int agfs_read_mask(int fd, agmask_t& mask);
+int agfs_read_mask(Frame& frame, agmask_t& mask);
+
+/**
+ * \brief Write a checksum on the frame.
+ * \details Handles endianness and writes a checksum to a provided frame.
+ * \param frame The frame to write on
+ * \param sum The checksum to write
+ */
+int agfs_write_sum(Frame& frame, agsum_t sum);
+
+/**
+* \brief Read a checksum from the frame.
+* \details Handles endianness and read a checksum from a provided frame.
+* \param frame The frame to read from
+* \param sum The checksum buffer to read into.
+*/
+int agfs_read_sum(Frame& frame, agsum_t& sum);
 
 /**
- * \brief Write a size to the connection.
- * \details Handles endianness and writes a size to a provided connection.
- * \param fd The file descriptor of the connection to write on
+ * \brief Write a size to the frame.
+ * \details Handles endianness and writes a size to a provided frame.
+ * \param frame The frame to write on
  * \param size The size to write
  */
-int agfs_write_size(int fd, agsize_t size);
+int agfs_write_size(Frame& frame, agsize_t size);
 
 /**
-* \brief Read a size from the connection.
-* \details Handles endianness and read a size from a provided connection.
-* \param fd The file descriptor of the connection to read on
+* \brief Read a size from the frame.
+* \details Handles endianness and read a size from a provided frame.
+* \param frame The frame to read from
 * \param size The size buffer to read into.
 */
-int agfs_read_size(int fd, agsize_t& size);
+int agfs_read_size(Frame& frame, agsize_t& size);
+
+/**
+ * \brief Replace a size written on the frame earlier.
+ * \details Lets a count be reserved before the items it counts and filled in
+ *          afterwards, so they can be produced in one pass.
+ * \param frame The frame to patch
+ * \param offset Where the size was written, i.e. frame.size() before writing
+ * \param size The size to write
+ */
+int agfs_patch_size(Frame& frame, size_t offset, agsize_t size);
+
+/**
+ * \brief Write a file handle to the frame.
+ * \details Handles endianness and writes a file handle to a provided frame.
+ * \param frame The frame to write on
+ * \param handle The file handle to write
+ */
+int agfs_write_handle(Frame& frame, agfh_t handle);
+
+/**
+* \brief Read a file handle from the frame.
+* \details Handles endianness and read a file handle from a provided frame.
+* \param frame The frame to read from
+* \param handle The file handle buffer to read into.
+*/
+int agfs_read_handle(Frame& frame, agfh_t& handle);
+
+/**
+* \brief Write an error on the frame.
+* \details Handles endianness and writes an error to a provided frame.
+* \param frame The frame to write on
+* \param err The error to write
+*/
+int agfs_write_error(Frame& frame, agerr_t err);
+
+/**
+* \brief Read an error from the frame.
+* \details Handles endianness and reads an error from a provided frame.
+* \param frame The frame to read from
+* \param err The error buffer to read into
+*/
+int agfs_read_error(Frame& frame, agerr_t& err);
 
 /**
-* \brief Write an error on the connection.
-* \details Handles endianness and writes an error to a provided connection.
-* \param fd The file descriptor of the connection to write on
-* \param cmd The error to write
+* \brief Write a stat struct on the frame.
+* \details Handles endianness and writes a stat struct to a provided frame.
+* \param frame The frame to write on
+* \param buf The stat struct to write
 */
-int agfs_write_error(int fd, agerr_t err);
+int agfs_write_stat(Frame& frame, const struct stat& buf);
 
 /**
-* \brief Read an error on the connection.
-* \details Handles endianness and reads an error from a provided connection.
-* \param fd The file descriptor of the connection to read on
-* \param cmd The error buffer to read into
+* \brief Read a stat struct from the frame.
+* \details Handles endianness and reads a stat struct from a provided frame.
+* \param frame The frame to read from
+* \param buf The stat struct buffer to read into
 */
-int agfs_read_error(int fd, agerr_t& err);
+int agfs_read_stat(Frame& frame, struct stat& buf);
 
 /**
-* \brief Write a string on the connection.
-* \details Handles endianness and writes a string to a provided connection.
-* \param fd The file descriptor of the connection to write on
-* \param cmd The string to write
+* \brief Write a string on the frame.
+* \details Handles endianness and writes a string to a provided frame.
+* \param frame The frame to write on
+* \param str The string to write
 */
-int agfs_write_stat(int fd, struct stat& buf);
+int agfs_write_string(Frame& frame, const std::string& str);
 
 /**
-* \brief Read a string on the connection.
-* \details Handles endianness and reads a string to a provided connection.
-* \param fd The file descriptor of the connection to read on
-* \param cmd The string buffer to read into
+* \brief Read a string from the frame.
+* \details Handles endianness and reads a string from a provided frame.
+* \param frame The frame to read from
+* \param str The string buffer to read into
 */
-int agfs_read_stat(int fd, struct stat& buf);
+int agfs_read_string(Frame& frame, std::string& str);
 
 /**
-* \brief Write a stat struct on the connection.
-* \details Handles endianness and writes a stat struct to a provided connection.
-* \param fd The file descriptor of the connection to write on
-* \param cmd The stat struct to write
+* \brief Write a hello on the frame.
+* \details Handles endianness and writes a hello to a provided frame.
+* \param frame The frame to write on
+* \param hello The hello to write
 */
-int agfs_write_string(int fd, const std::string& str);
+int agfs_write_hello(Frame& frame, const Hello& hello);
 
 /**
-* \brief Read a stat struct on the connection.
-* \details Handles endianness and reads a stat struct to a provided connection.
-* \param fd The file descriptor of the connection to read on
-* \param cmd The stat struct buffer to read into
+* \brief Read a hello from the frame.
+* \details Handles endianness and reads a hello from a provided frame. Later
+*          versions may add fields after the ones read here; they are left on
+*          the frame.
+* \param frame The frame to read from
+* \param hello The hello buffer to read into
 */
-int agfs_read_string(int fd, std::string& str);
+int agfs_read_hello(Frame& frame, Hello& hello);
 
 #endif
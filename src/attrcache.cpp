@@ -0,0 +1,145 @@
+#include "attrcache.hpp"
+#include <functional>
+#include <string.h>
+
+AttrCache::AttrCache(std::chrono::milliseconds ttl, std::chrono::milliseconds absentTtl)
+	:ttlMsec_{ttl.count()},
+	 absentTtlMsec_{absentTtl.count()},
+	 absentGeneration_{0},
+	 shards_(ATTR_CACHE_SHARDS),
+	 hits_{0},
+	 absentHits_{0},
+	 misses_{0}
+{
+	//Nothing to do here...
+}
+
+void AttrCache::setTtl(std::chrono::milliseconds ttl, std::chrono::milliseconds absentTtl)
+{
+	ttlMsec_ = ttl.count();
+	absentTtlMsec_ = absentTtl.count();
+}
+
+AttrCache::Lookup AttrCache::lookup(const std::string& path, struct stat& stbuf)
+{
+	Shard& shard = shardFor(path);
+	{
+		std::lock_guard<std::mutex> l{shard.lock};
+		std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(path);
+		if (it != shard.entries.end()) {
+			Entry& entry = it->second;
+			bool live = clock::now() < entry.expires &&
+				(!entry.absent || entry.generation == absentGeneration_);
+			if (live && entry.absent) {
+				hits_++;
+				absentHits_++;
+				return ABSENT;
+			} else if (live) {
+				stbuf = entry.stbuf;
+				hits_++;
+				return PRESENT;
+			}
+			shard.entries.erase(it);
+		}
+	}
+
+	misses_++;
+	return UNKNOWN;
+}
+
+void AttrCache::insert(const std::string& path, const struct stat& stbuf)
+{
+	int64_t ttl = ttlMsec_;
+	if (ttl <= 0) {
+		return;
+	}
+
+	Entry entry;
+	entry.stbuf = stbuf;
+	entry.expires = clock::now() + std::chrono::milliseconds{ttl};
+	entry.absent = false;
+	entry.generation = 0;
+	store(path, entry);
+}
+
+void AttrCache::insertAbsent(const std::string& path, uint64_t generation)
+{
+	int64_t ttl = absentTtlMsec_;
+	if (ttl <= 0) {
+		return;
+	}
+
+	Entry entry;
+	memset(&entry.stbuf, 0, sizeof(struct stat));
+	entry.expires = clock::now() + std::chrono::milliseconds{ttl};
+	entry.absent = true;
+	entry.generation = generation;
+	store(path, entry);
+}
+
+uint64_t AttrCache::absentGeneration() const
+{
+	return absentGeneration_;
+}
+
+void AttrCache::invalidate(const std::string& path)
+{
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> l{shard.lock};
+	shard.entries.erase(path);
+}
+
+void AttrCache::invalidateAbsent()
+{
+	absentGeneration_++;
+}
+
+uint64_t AttrCache::hits() const
+{
+	return hits_;
+}
+
+uint64_t AttrCache::absentHits() const
+{
+	return absentHits_;
+}
+
+uint64_t AttrCache::misses() const
+{
+	return misses_;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+AttrCache::Shard& AttrCache::shardFor(const std::string& path)
+{
+	return shards_[std::hash<std::string>{}(path) % shards_.size()];
+}
+
+void AttrCache::store(const std::string& path, const Entry& entry)
+{
+	clock::time_point now = clock::now();
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> l{shard.lock};
+
+	//Keep a full shard bounded: drop what has expired, and if that isn't
+	//enough start over rather than track recency.
+	if (shard.entries.size() >= ATTR_CACHE_ENTRIES / ATTR_CACHE_SHARDS) {
+		std::unordered_map<std::string, Entry>::iterator it = shard.entries.begin();
+		while (it != shard.entries.end()) {
+			if (it->second.expires <= now ||
+					(it->second.absent && it->second.generation != absentGeneration_)) {
+				it = shard.entries.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (shard.entries.size() >= ATTR_CACHE_ENTRIES / ATTR_CACHE_SHARDS) {
+			shard.entries.clear();
+		}
+	}
+
+	shard.entries[path] = entry;
+}
@@ -0,0 +1,120 @@
+#ifndef ATTRCACHE_HPP_INC
+#define ATTRCACHE_HPP_INC
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "constants.hpp"
+
+/**
+ * \brief Remembers file attributes for a short time so repeated getattr calls
+ *        don't each cost a round trip.
+ * \details Entries are keyed by the path FUSE hands us, braces and all, and
+ *          expire after the TTL. The table is split into shards with their
+ *          own locks so lookups from different FUSE threads rarely contend.
+ *
+ *          Paths that no server has are remembered too, with their own
+ *          (shorter) TTL, so tools probing for files that don't exist get
+ *          their ENOENT without asking every server again.
+ */
+class AttrCache {
+public:
+	/// What the cache knows about a path.
+	enum Lookup {
+		UNKNOWN,
+		PRESENT,
+		ABSENT
+	};
+
+	/**
+	 * \brief Create an empty cache.
+	 * \param ttl How long an entry stays valid. Zero disables the cache.
+	 * \param absentTtl How long a path stays known to be missing. Zero
+	 *        disables negative entries.
+	 */
+	AttrCache(std::chrono::milliseconds ttl, std::chrono::milliseconds absentTtl);
+	AttrCache(AttrCache const&) = delete;
+	AttrCache& operator=(AttrCache const&) = delete;
+
+	/// Change how long entries added from now on stay valid.
+	void setTtl(std::chrono::milliseconds ttl, std::chrono::milliseconds absentTtl);
+
+	/**
+	 * \brief Look up the attributes of a path.
+	 * \returns PRESENT and fills stbuf if live attributes were found, ABSENT
+	 *          if the path is known not to exist, UNKNOWN otherwise.
+	 */
+	Lookup lookup(const std::string& path, struct stat& stbuf);
+
+	/// Remember the attributes of a path.
+	void insert(const std::string& path, const struct stat& stbuf);
+
+	/**
+	 * \brief Remember that no server has a path.
+	 * \param generation The value of absentGeneration() taken before the
+	 *        servers were asked, so an answer that raced with a create is
+	 *        not kept.
+	 */
+	void insertAbsent(const std::string& path, uint64_t generation);
+
+	/// Returns a value that changes every time invalidateAbsent() is called.
+	uint64_t absentGeneration() const;
+
+	/// Forget a path, because we changed it ourselves.
+	void invalidate(const std::string& path);
+
+	/**
+	 * \brief Forget every path remembered as missing.
+	 * \details Used when a file may have appeared: something was created or
+	 *          renamed, or the set of connected servers changed. It costs
+	 *          the same however many entries there are.
+	 */
+	void invalidateAbsent();
+
+	/// Returns the number of lookups answered from the cache.
+	uint64_t hits() const;
+
+	/// Returns how many of those hits were for paths known to be missing.
+	uint64_t absentHits() const;
+
+	/// Returns the number of lookups that had to go to a server.
+	uint64_t misses() const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct Entry {
+		struct stat stbuf;
+		clock::time_point expires;
+
+		//Negative entries only count while absentGeneration_ is unchanged
+		bool absent;
+		uint64_t generation;
+	};
+
+	struct Shard {
+		std::mutex lock;
+		std::unordered_map<std::string, Entry> entries;
+	};
+
+	//Returns the shard a path lives in.
+	Shard& shardFor(const std::string& path);
+
+	//Store an entry, keeping the shard bounded.
+	void store(const std::string& path, const Entry& entry);
+
+	std::atomic<int64_t> ttlMsec_;
+	std::atomic<int64_t> absentTtlMsec_;
+	std::atomic<uint64_t> absentGeneration_;
+	std::vector<Shard> shards_;
+
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> absentHits_;
+	std::atomic<uint64_t> misses_;
+};
+
+#endif
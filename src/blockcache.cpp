@@ -0,0 +1,320 @@
+#include "blockcache.hpp"
+#include <algorithm>
+#include <functional>
+#include <string.h>
+#include <openssl/sha.h>
+
+BlockCache::File::File()
+	:version_{0},
+	 size_{0},
+	 mtime_{0},
+	 ctime_{0}
+{
+	//Nothing to do here...
+}
+
+BlockCache::BlockCache(size_t budget)
+	:budget_{budget},
+	 nextVersion_{1},
+	 refs_(BLOCK_CACHE_SHARDS),
+	 chunks_(BLOCK_CACHE_SHARDS),
+	 files_(BLOCK_CACHE_SHARDS),
+	 hits_{0},
+	 misses_{0},
+	 adopted_{0}
+{
+	for (ChunkShard& shard: chunks_) {
+		shard.bytes = 0;
+	}
+}
+
+void BlockCache::setBudget(size_t budget)
+{
+	budget_ = budget;
+}
+
+bool BlockCache::enabled() const
+{
+	return budget_ > 0;
+}
+
+std::shared_ptr<BlockCache::File> BlockCache::open(size_t server, const std::string& path,
+	const struct stat& stbuf)
+{
+	std::string name{nameOf(server, path)};
+	FileShard& shard = shardFor(name);
+	std::lock_guard<std::mutex> l{shard.lock};
+
+	std::unordered_map<std::string, std::shared_ptr<File>>::iterator it = shard.files.find(name);
+	if (it != shard.files.end()) {
+		update(*it->second, stbuf, false);
+		return it->second;
+	}
+
+	//Keep a full shard bounded by forgetting files nobody has open. Their
+	//blocks are left to age out.
+	if (shard.files.size() >= BLOCK_CACHE_FILES / BLOCK_CACHE_SHARDS) {
+		it = shard.files.begin();
+		while (it != shard.files.end()) {
+			if (it->second.use_count() == 1) {
+				it = shard.files.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	std::shared_ptr<File> file{new File{}};
+	update(*file, stbuf, true);
+	shard.files[name] = file;
+	return file;
+}
+
+void BlockCache::check(size_t server, const std::string& path, const struct stat& stbuf)
+{
+	if (!S_ISREG(stbuf.st_mode)) {
+		return;
+	}
+
+	std::string name{nameOf(server, path)};
+	FileShard& shard = shardFor(name);
+	std::lock_guard<std::mutex> l{shard.lock};
+	std::unordered_map<std::string, std::shared_ptr<File>>::iterator it = shard.files.find(name);
+	if (it != shard.files.end()) {
+		update(*it->second, stbuf, false);
+	}
+}
+
+void BlockCache::invalidate(File& file)
+{
+	file.version_ = nextVersion_++;
+}
+
+uint64_t BlockCache::version(const File& file) const
+{
+	return file.version_;
+}
+
+bool BlockCache::read(uint64_t version, uint64_t index, size_t offset, char* buf,
+	size_t length, size_t& copied, bool& last)
+{
+	aghash_t hash;
+	if (!lookup(BlockKey{version, index}, hash)) {
+		misses_++;
+		return false;
+	}
+
+	ChunkShard& shard = shardFor(hash);
+	std::lock_guard<std::mutex> l{shard.lock};
+	std::unordered_map<aghash_t, std::list<Chunk>::iterator, HashHash>::iterator it =
+		shard.index.find(hash);
+	if (it == shard.index.end()) {
+		misses_++;
+		return false;
+	}
+
+	//Move the data to the front of the recency list.
+	shard.chunks.splice(shard.chunks.begin(), shard.chunks, it->second);
+	const std::vector<char>& data = it->second->data;
+
+	copied = 0;
+	if (offset < data.size()) {
+		copied = std::min(data.size() - offset, length);
+		memcpy(buf, data.data() + offset, copied);
+	}
+	last = data.size() < BLOCK_CACHE_BLOCK_LEN;
+	hits_++;
+	return true;
+}
+
+bool BlockCache::contains(uint64_t version, uint64_t index)
+{
+	aghash_t hash;
+	if (!lookup(BlockKey{version, index}, hash)) {
+		return false;
+	}
+	ChunkShard& shard = shardFor(hash);
+	std::lock_guard<std::mutex> l{shard.lock};
+	return shard.index.count(hash) > 0;
+}
+
+void BlockCache::insert(uint64_t version, uint64_t index, std::vector<char>& data)
+{
+	if (budget_ == 0) {
+		return;
+	}
+
+	aghash_t hash;
+	SHA256((const unsigned char*)data.data(), data.size(), hash.data());
+	{
+		ChunkShard& shard = shardFor(hash);
+		std::lock_guard<std::mutex> l{shard.lock};
+
+		//Another file, or another reader, may have brought the same data.
+		std::unordered_map<aghash_t, std::list<Chunk>::iterator, HashHash>::iterator it =
+			shard.index.find(hash);
+		if (it != shard.index.end()) {
+			shard.chunks.splice(shard.chunks.begin(), shard.chunks, it->second);
+		} else {
+			shard.chunks.emplace_front();
+			Chunk& chunk = shard.chunks.front();
+			chunk.hash = hash;
+			chunk.data.swap(data);
+			shard.index[hash] = shard.chunks.begin();
+			shard.bytes += chunk.data.capacity();
+			evict(shard, data);
+		}
+	}
+	name(BlockKey{version, index}, hash);
+}
+
+bool BlockCache::adopt(uint64_t version, uint64_t index, const aghash_t& hash)
+{
+	if (budget_ == 0) {
+		return false;
+	}
+
+	{
+		ChunkShard& shard = shardFor(hash);
+		std::lock_guard<std::mutex> l{shard.lock};
+		std::unordered_map<aghash_t, std::list<Chunk>::iterator, HashHash>::iterator it =
+			shard.index.find(hash);
+		if (it == shard.index.end()) {
+			return false;
+		}
+		shard.chunks.splice(shard.chunks.begin(), shard.chunks, it->second);
+	}
+	name(BlockKey{version, index}, hash);
+	adopted_++;
+	return true;
+}
+
+uint64_t BlockCache::hits() const
+{
+	return hits_;
+}
+
+uint64_t BlockCache::misses() const
+{
+	return misses_;
+}
+
+uint64_t BlockCache::adopted() const
+{
+	return adopted_;
+}
+
+size_t BlockCache::bytes()
+{
+	size_t total = 0;
+	for (ChunkShard& shard: chunks_) {
+		std::lock_guard<std::mutex> l{shard.lock};
+		total += shard.bytes;
+	}
+	return total;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+bool BlockCache::BlockKey::operator==(const BlockKey& other) const
+{
+	return version == other.version && index == other.index;
+}
+
+size_t BlockCache::BlockKeyHash::operator()(const BlockKey& key) const
+{
+	return std::hash<uint64_t>{}(key.version * 0x9e3779b97f4a7c15ULL ^ key.index);
+}
+
+size_t BlockCache::HashHash::operator()(const aghash_t& hash) const
+{
+	//The hash is already as good as random.
+	uint64_t value;
+	memcpy(&value, hash.data(), sizeof(value));
+	return value;
+}
+
+BlockCache::RefShard& BlockCache::shardFor(const BlockKey& key)
+{
+	return refs_[BlockKeyHash{}(key) % refs_.size()];
+}
+
+BlockCache::ChunkShard& BlockCache::shardFor(const aghash_t& hash)
+{
+	//Use other bits than the shard's map does.
+	return chunks_[hash[BLOCK_HASH_LEN - 1] % chunks_.size()];
+}
+
+BlockCache::FileShard& BlockCache::shardFor(const std::string& name)
+{
+	return files_[std::hash<std::string>{}(name) % files_.size()];
+}
+
+std::string BlockCache::nameOf(size_t server, const std::string& path)
+{
+	return std::to_string(server) + ':' + path;
+}
+
+void BlockCache::update(File& file, const struct stat& stbuf, bool fresh)
+{
+	agsize_t size = stbuf.st_size;
+	if (fresh || file.size_ != size || file.mtime_ != stbuf.st_mtime ||
+			file.ctime_ != stbuf.st_ctime) {
+		file.version_ = nextVersion_++;
+		file.size_ = size;
+		file.mtime_ = stbuf.st_mtime;
+		file.ctime_ = stbuf.st_ctime;
+	}
+}
+
+bool BlockCache::lookup(const BlockKey& key, aghash_t& hash)
+{
+	RefShard& shard = shardFor(key);
+	std::lock_guard<std::mutex> l{shard.lock};
+	std::unordered_map<BlockKey, std::list<Ref>::iterator, BlockKeyHash>::iterator it =
+		shard.index.find(key);
+	if (it == shard.index.end()) {
+		return false;
+	}
+	shard.refs.splice(shard.refs.begin(), shard.refs, it->second);
+	hash = it->second->hash;
+	return true;
+}
+
+void BlockCache::name(const BlockKey& key, const aghash_t& hash)
+{
+	RefShard& shard = shardFor(key);
+	std::lock_guard<std::mutex> l{shard.lock};
+	std::unordered_map<BlockKey, std::list<Ref>::iterator, BlockKeyHash>::iterator it =
+		shard.index.find(key);
+	if (it != shard.index.end()) {
+		it->second->hash = hash;
+		shard.refs.splice(shard.refs.begin(), shard.refs, it->second);
+		return;
+	}
+
+	shard.refs.push_front(Ref{key, hash});
+	shard.index[key] = shard.refs.begin();
+
+	size_t limit = budget_ / BLOCK_CACHE_BLOCK_LEN * BLOCK_CACHE_REFS_PER_BLOCK / refs_.size();
+	while (shard.refs.size() > std::max<size_t>(limit, 1)) {
+		shard.index.erase(shard.refs.back().key);
+		shard.refs.pop_back();
+	}
+}
+
+void BlockCache::evict(ChunkShard& shard, std::vector<char>& spare)
+{
+	size_t limit = budget_ / chunks_.size();
+	while (shard.bytes > limit && !shard.chunks.empty()) {
+		Chunk& oldest = shard.chunks.back();
+		shard.bytes -= oldest.data.capacity();
+		shard.index.erase(oldest.hash);
+		if (spare.capacity() == 0) {
+			spare.swap(oldest.data);
+		}
+		shard.chunks.pop_back();
+	}
+}
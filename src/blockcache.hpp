@@ -0,0 +1,230 @@
+#ifndef BLOCKCACHE_HPP_INC
+#define BLOCKCACHE_HPP_INC
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "constants.hpp"
+
+/**
+ * \brief Keeps recently read file data in memory so reading it again doesn't
+ *        go back to the server.
+ * \details Files are cached in blocks of BLOCK_CACHE_BLOCK_LEN bytes, under a
+ *          memory budget. Data is kept by its SHA-256 hash, so blocks that
+ *          are the same in several files, or on several servers, are held
+ *          once; each block of a file just names the data it holds. Data and
+ *          names are split into shards with their own locks. Each data shard
+ *          drops its least recently used data once it holds more than its
+ *          part of the budget, and each name shard keeps a few times as many
+ *          names as there is room for data.
+ *
+ *          A file is cached under a version, which changes whenever the file
+ *          changes. Blocks of an old version are never served again and are
+ *          left to age out. The version changes when we write to the file,
+ *          and when its size, mtime or ctime differ from what they were the
+ *          last time the file was opened or stat'd. The server reports times
+ *          in whole seconds, so a change of the same size made by someone else
+ *          within the second is not noticed.
+ *
+ *          Given a block's hash from the server, adopt() names data already
+ *          held under another file, so the block needn't be fetched at all.
+ *          Hashes from the server are only ever used to find data; data is
+ *          always kept under the hash of what actually arrived.
+ */
+class BlockCache {
+public:
+	/// What the cache knows about one file on one server.
+	class File {
+	public:
+		File();
+		File(File const&) = delete;
+		File& operator=(File const&) = delete;
+
+	private:
+		friend class BlockCache;
+
+		//Version the file's blocks are cached under. Versions are never reused,
+		//even by different files.
+		std::atomic<uint64_t> version_;
+
+		//Attributes the version was taken from; guarded by the file's shard
+		agsize_t size_;
+		time_t mtime_;
+		time_t ctime_;
+	};
+
+	/**
+	 * \brief Create an empty cache.
+	 * \param budget Number of bytes of file data to keep. Zero disables the
+	 *        cache.
+	 */
+	explicit BlockCache(size_t budget);
+	BlockCache(BlockCache const&) = delete;
+	BlockCache& operator=(BlockCache const&) = delete;
+
+	/// Change how many bytes of file data the cache keeps.
+	void setBudget(size_t budget);
+
+	/// Returns true unless the budget is zero.
+	bool enabled() const;
+
+	/**
+	 * \brief Find the record of a file being opened.
+	 * \details The file gets a new version if stbuf shows it has changed.
+	 * \param server Index of the server holding the file.
+	 * \param path Path of the file on that server.
+	 * \param stbuf Attributes of the file once opened.
+	 */
+	std::shared_ptr<File> open(size_t server, const std::string& path, const struct stat& stbuf);
+
+	/// Give a file a new version if stbuf shows it has changed.
+	void check(size_t server, const std::string& path, const struct stat& stbuf);
+
+	/// Give a file a new version, because we changed it ourselves.
+	void invalidate(File& file);
+
+	/**
+	 * \brief Returns the version to read a file's blocks under.
+	 * \details Taken before asking the server for a block, so a block that
+	 *          raced with a change to the file is stored under the old version.
+	 */
+	uint64_t version(const File& file) const;
+
+	/**
+	 * \brief Copy part of a block out of the cache.
+	 * \param version The file's version, from version().
+	 * \param index Which block of the file, counting from 0.
+	 * \param offset Where in the block to start copying.
+	 * \param copied Set to the number of bytes copied.
+	 * \param last Set if the block ends the file.
+	 * \returns false if the block is not cached.
+	 */
+	bool read(uint64_t version, uint64_t index, size_t offset, char* buf, size_t length,
+		size_t& copied, bool& last);
+
+	/// Returns true if a block is cached, without counting a hit or a miss.
+	bool contains(uint64_t version, uint64_t index);
+
+	/**
+	 * \brief Store a block read from the server.
+	 * \details The block is taken from data, which is handed back the buffer
+	 *          of a block dropped to make room, or left empty. If the same data
+	 *          is already held, data is left as it is. A block shorter than
+	 *          BLOCK_CACHE_BLOCK_LEN is taken to end the file.
+	 */
+	void insert(uint64_t version, uint64_t index, std::vector<char>& data);
+
+	/**
+	 * \brief Name the data a block holds, from a hash the server sent.
+	 * \returns false if no data with that hash is cached, so the block must
+	 *          still be fetched.
+	 */
+	bool adopt(uint64_t version, uint64_t index, const aghash_t& hash);
+
+	/// Returns the number of blocks read from the cache.
+	uint64_t hits() const;
+
+	/// Returns the number of blocks that had to come from a server.
+	uint64_t misses() const;
+
+	/// Returns the number of blocks adopt() found already cached.
+	uint64_t adopted() const;
+
+	/// Returns the number of bytes of file data held.
+	size_t bytes();
+
+private:
+	struct BlockKey {
+		uint64_t version;
+		uint64_t index;
+
+		bool operator==(const BlockKey& other) const;
+	};
+
+	struct BlockKeyHash {
+		size_t operator()(const BlockKey& key) const;
+	};
+
+	struct HashHash {
+		size_t operator()(const aghash_t& hash) const;
+	};
+
+	//A block of a file and the hash of the data it holds
+	struct Ref {
+		BlockKey key;
+		aghash_t hash;
+	};
+
+	struct Chunk {
+		aghash_t hash;
+		std::vector<char> data;
+	};
+
+	struct RefShard {
+		std::mutex lock;
+
+		//Most recently used first
+		std::list<Ref> refs;
+		std::unordered_map<BlockKey, std::list<Ref>::iterator, BlockKeyHash> index;
+	};
+
+	struct ChunkShard {
+		std::mutex lock;
+
+		//Most recently used first
+		std::list<Chunk> chunks;
+		std::unordered_map<aghash_t, std::list<Chunk>::iterator, HashHash> index;
+		size_t bytes;
+	};
+
+	struct FileShard {
+		std::mutex lock;
+		std::unordered_map<std::string, std::shared_ptr<File>> files;
+	};
+
+	//Returns the shard a block's name lives in.
+	RefShard& shardFor(const BlockKey& key);
+
+	//Returns the shard data with a hash lives in.
+	ChunkShard& shardFor(const aghash_t& hash);
+
+	//Returns the shard a file's record lives in.
+	FileShard& shardFor(const std::string& name);
+
+	//Returns the name of a file's record.
+	static std::string nameOf(size_t server, const std::string& path);
+
+	//Give a file a new version if stbuf differs from the attributes it was
+	//taken from. The caller holds the file's shard lock.
+	void update(File& file, const struct stat& stbuf, bool fresh);
+
+	//Find the hash of the data a block holds.
+	bool lookup(const BlockKey& key, aghash_t& hash);
+
+	//Note the hash of the data a block holds, forgetting the least recently
+	//used names if the shard has too many.
+	void name(const BlockKey& key, const aghash_t& hash);
+
+	//Drop least recently used data until the shard fits its part of the
+	//budget, keeping the buffer of one of them in spare. The caller holds
+	//the shard lock.
+	void evict(ChunkShard& shard, std::vector<char>& spare);
+
+	std::atomic<size_t> budget_;
+	std::atomic<uint64_t> nextVersion_;
+	std::vector<RefShard> refs_;
+	std::vector<ChunkShard> chunks_;
+	std::vector<FileShard> files_;
+
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> misses_;
+	std::atomic<uint64_t> adopted_;
+};
+
+#endif
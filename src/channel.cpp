@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <iostream>
+#include "channel.hpp"
+#include "agfsio.hpp"
+#include <unistd.h>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+Channel::Counts::Counts()
+	:requests{0},
+	 framesSent{0},
+	 framesReceived{0},
+	 syscalls{0}
+{
+	//Nothing to do here...
+}
+
+Channel::Counts& Channel::Counts::operator+=(const Counts& other)
+{
+	requests += other.requests;
+	framesSent += other.framesSent;
+	framesReceived += other.framesReceived;
+	syscalls += other.syscalls;
+	return *this;
+}
+
+Channel::Slot::Slot()
+	:busy{false},
+	 done{false},
+	 generation{0},
+	 error{0},
+	 reply{},
+	 ready{}
+{
+	//Nothing to do here...
+}
+
+Channel::Channel(const std::string& hostname, const std::string& port)
+	:hostname_{hostname},
+	 port_{port},
+	 socket_{-1},
+	 stream_{},
+	 reader_{},
+	 slots_(MAX_IN_FLIGHT),
+	 partial_(MAX_IN_FLIGHT),
+	 inflight_{0},
+	 lastUsed_{std::chrono::steady_clock::now().time_since_epoch().count()},
+	 requests_{0},
+	 agreed_(Hello::legacy()),
+	 closed_{false}
+{
+	//Nothing to do here...
+}
+
+Channel::~Channel()
+{
+	shutdownSocket();
+}
+
+/*
+ * Outgoing stack looks like:
+ *
+ *      STRING SIZE HELLO
+ *
+ * Incoming stack looks like:
+ *
+ *      CMD [SIZE [HELLO]]
+ *
+ * The SIZE we send is the session to join, 0 to start one, and our HELLO what
+ * we can do. The server answers with its own. The handshake frames use
+ * request id 0.
+ */
+cmd_t Channel::connect(const std::string& key, agsize_t& session, const Hello& offer)
+{
+	//Get rid of whatever is left of the previous connection first.
+	shutdownSocket();
+
+	std::lock_guard<std::mutex> l{monitor_};
+
+	//Perform DNS lookup and handle DNS errors.
+	int fd = dnsLookup(port_.c_str());
+
+	switch (fd){
+	case DNS_ERROR:
+		std::cerr << "Failed DNS lookup" << std::endl;
+		return cmd::NONE;
+	case SOCKET_FAILURE:
+		std::cerr << "Failed to create socket" << std::endl;
+		return cmd::NONE;
+	case CONNECTION_FAILURE:
+		std::cerr << "Could not connect to server " << hostname_ << ":" << port_ << std::endl;
+		return cmd::NONE;
+	default:
+		break;
+	}
+
+	//Set timeout
+	struct timeval tv;
+	tv.tv_sec = CLIENT_BLOCK_SEC;
+	tv.tv_usec = CLIENT_BLOCK_USEC;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)(&tv), sizeof(struct timeval));
+	int iMode = 0;
+	ioctl(fd, FIONBIO, &iMode);
+	stream_.reset(fd);
+
+	//The receive timeout only bounds each read. A reply that pauses part
+	//way through is waited for as long as its request would be.
+	stream_.setStallTimeout(CLIENT_REQUEST_SEC * 1000);
+
+	//send key for verification, the session to join, and what we can do
+	Frame request, reply;
+	agfs_write_string(request, key);
+	agfs_write_size(request, session);
+	agfs_write_hello(request, offer);
+
+	cmd_t servResp = cmd::NONE;
+	if (stream_.send(request) == 0 && stream_.recv(reply) > 0) {
+		agfs_read_cmd(reply, servResp);
+	}
+
+	//A server that predates sessions doesn't name one.
+	agsize_t joined = 0;
+	if (servResp == cmd::ACCEPT && agfs_read_size(reply, joined) < 0) {
+		joined = 0;
+	}
+	session = joined;
+
+	//Nor one that predates the hello what it can do.
+	Hello server = Hello::legacy();
+	if (servResp == cmd::ACCEPT && agfs_read_hello(reply, server) < 0) {
+		server = Hello::legacy();
+	}
+	{
+		std::lock_guard<std::mutex> p{pendingLock_};
+		agreed_ = offer.agree(server);
+	}
+
+	if (servResp != cmd::ACCEPT) {
+		close(fd);
+		stream_.reset(-1);
+		return servResp;
+	}
+
+	socket_ = fd;
+	reader_ = std::thread(&Channel::readReplies, this);
+	return servResp;
+}
+
+bool Channel::connected() const
+{
+	return socket_ >= 0;
+}
+
+Hello Channel::agreed() const
+{
+	std::lock_guard<std::mutex> l{pendingLock_};
+	return agreed_;
+}
+
+bool Channel::closed() const
+{
+	return closed_;
+}
+
+void Channel::stop()
+{
+	{
+		//Set first, so the reader knows the server hanging up is expected.
+		std::lock_guard<std::mutex> l{monitor_};
+		closed_ = true;
+		if (connected()) {
+			Frame request;
+			agfs_write_cmd(request, cmd::STOP);
+			stream_.send(request);
+		}
+	}
+	shutdownSocket();
+}
+
+size_t Channel::load() const
+{
+	return inflight_;
+}
+
+std::chrono::steady_clock::duration Channel::idle() const
+{
+	if (inflight_ > 0) {
+		return std::chrono::steady_clock::duration::zero();
+	}
+	return std::chrono::steady_clock::now().time_since_epoch() -
+		std::chrono::steady_clock::duration(lastUsed_);
+}
+
+Channel::Counts Channel::counts() const
+{
+	Counts counts;
+	counts.requests = requests_;
+	counts.framesSent = stream_.framesSent();
+	counts.framesReceived = stream_.framesReceived();
+	counts.syscalls = stream_.syscalls();
+	return counts;
+}
+
+/*
+ * The low 16 bits of a request id select its slot and the high 16 bits hold
+ * the slot's generation, which starts at 1 so that id 0 never names a
+ * request.
+ */
+agreqid_t Channel::acquire() {
+	std::unique_lock<std::mutex> l{pendingLock_};
+	while (true) {
+		size_t usable = std::max<size_t>(std::min<size_t>(agreed_.maxInFlight, slots_.size()), 1);
+		for (size_t i = 0; i < usable; i++) {
+			Slot& slot = slots_[i];
+			if (!slot.busy) {
+				slot.busy = true;
+				slot.done = false;
+				slot.error = 0;
+				if (++slot.generation == 0) {
+					slot.generation = 1;
+				}
+				inflight_++;
+				return ((agreqid_t)slot.generation << 16) | i;
+			}
+		}
+		slotFree_.wait(l);
+	}
+}
+
+void Channel::release(agreqid_t id) {
+	{
+		std::lock_guard<std::mutex> l{pendingLock_};
+		Slot& slot = slots_[id & 0xffff];
+		slot.busy = false;
+		slot.reply.clear();
+		lastUsed_ = std::chrono::steady_clock::now().time_since_epoch().count();
+		inflight_--;
+	}
+	slotFree_.notify_one();
+}
+
+agerr_t Channel::send(agreqid_t id, Frame& request, const void* payload, size_t length) {
+	std::lock_guard<std::mutex> l{monitor_};
+	if (!connected()) {
+		return -ENOTCONN;
+	}
+	requests_++;
+
+	request.setId(id);
+	if (stream_.send(request, payload, length) < 0) {
+		agerr_t error = -errno;
+		disconnect();
+		return error;
+	}
+	return 0;
+}
+
+agerr_t Channel::await(agreqid_t id, Frame& reply) {
+	std::unique_lock<std::mutex> l{pendingLock_};
+	Slot& slot = slots_[id & 0xffff];
+
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::seconds(CLIENT_REQUEST_SEC);
+	if (!slot.ready.wait_until(l, deadline, [&slot]() { return slot.done; })) {
+		return -ETIMEDOUT;
+	}
+
+	//Leave the slot ready for a follow-up exchange under the same id.
+	slot.done = false;
+	if (slot.error < 0) {
+		return slot.error;
+	}
+	std::swap(reply, slot.reply);
+	return 0;
+}
+
+agerr_t Channel::roundTrip(Frame& request, Frame& reply) {
+	agreqid_t id = acquire();
+	agerr_t error = send(id, request);
+	if (error >= 0) {
+		error = await(id, reply);
+	}
+	release(id);
+	return error;
+}
+
+void Channel::disconnect() {
+	//The descriptor itself is closed by shutdownSocket(), once no thread can
+	//be using it any more.
+	int fd = stream_.fd();
+	socket_ = -1;
+	if (fd >= 0) {
+		shutdown(fd, SHUT_RDWR);
+	}
+
+	std::lock_guard<std::mutex> l{pendingLock_};
+	for (size_t i = 0; i < slots_.size(); i++) {
+		if (slots_[i].busy) {
+			slots_[i].error = -EIO;
+			slots_[i].done = true;
+			slots_[i].ready.notify_one();
+		}
+	}
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+void Channel::readReplies() {
+	Frame whole;
+	while (true) {
+		agframelen_t length;
+		agreqid_t id;
+		bool more;
+		int err = stream_.recvHead(length, id, more);
+		if (err < 0 && errno == EAGAIN) {
+			//Only the receive timeout; the heartbeat notices dead servers.
+			continue;
+		}
+		if (err <= 0) {
+			break;
+		}
+
+		//Replies to requests that were abandoned are read and dropped. Their
+		//slot may have been reused, and a late piece must not touch the new
+		//request's reply.
+		size_t index = id & 0xffff;
+		bool live = false;
+		if (index < slots_.size()) {
+			std::lock_guard<std::mutex> l{pendingLock_};
+			live = slots_[index].busy && slots_[index].generation == (id >> 16);
+		}
+
+		//Large replies come in pieces, possibly with other replies between
+		//them. Each is put back together in place, without copying.
+		Frame* reply = &whole;
+		bool append = false;
+		if (live && (more || partial_[index].id() == id)) {
+			reply = &partial_[index];
+			append = reply->id() == id;
+		}
+		reply->setId(id);
+		if (stream_.recvBody(*reply, length, append) <= 0) {
+			break;
+		}
+		if (!live || more) {
+			continue;
+		}
+
+		//The request may have been abandoned while its reply came in.
+		std::lock_guard<std::mutex> l{pendingLock_};
+		Slot& slot = slots_[index];
+		if (slot.busy && slot.generation == (id >> 16)) {
+			std::swap(slot.reply, *reply);
+			slot.done = true;
+			slot.ready.notify_one();
+		}
+		reply->setId(0);
+	}
+
+	if (!closed_) {
+		std::cerr << "Lost connection to server " << hostname_ << std::endl;
+	}
+	disconnect();
+}
+
+void Channel::shutdownSocket() {
+	disconnect();
+	if (reader_.joinable()) {
+		reader_.join();
+	}
+
+	std::lock_guard<std::mutex> l{monitor_};
+	if (stream_.fd() >= 0) {
+		close(stream_.fd());
+		stream_.reset(-1);
+	}
+}
+
+int Channel::dnsLookup(const char* port) {
+  struct addrinfo hints, *hostaddress = NULL;
+  int error, fd;
+
+  memset(&hints, 0, sizeof(hints));
+
+  hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_CANONNAME;
+
+  if ((error = getaddrinfo(hostname_.c_str(), port, &hints, &hostaddress)) != 0) {
+    return DNS_ERROR;
+  }
+
+  fd = socket(hostaddress->ai_family, hostaddress->ai_socktype, hostaddress->ai_protocol);
+
+  if (fd == -1) {
+  	freeaddrinfo(hostaddress);
+  	return SOCKET_FAILURE;
+  }
+
+  if (::connect(fd, hostaddress->ai_addr, hostaddress->ai_addrlen) == -1) {
+  	close(fd);
+  	freeaddrinfo(hostaddress);
+  	return CONNECTION_FAILURE;
+  }
+
+  freeaddrinfo(hostaddress);
+
+  return fd;
+}
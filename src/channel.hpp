@@ -0,0 +1,167 @@
+#ifndef CHANNEL_HPP_INC
+#define CHANNEL_HPP_INC
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include "constants.hpp"
+#include "framesocket.hpp"
+
+/**
+ * \brief One authenticated connection to a server.
+ * \details Any number of threads may issue requests at once. Each request is
+ *          tagged with its own id and a dedicated reader thread hands every
+ *          reply to the thread waiting for it, so up to MAX_IN_FLIGHT requests
+ *          share the socket without waiting on each other. A ServerConnection
+ *          spreads its requests over several channels in one session.
+ */
+class Channel {
+public:
+	/// Traffic a channel has carried.
+	struct Counts {
+		Counts();
+
+		uint64_t requests;
+		uint64_t framesSent;
+		uint64_t framesReceived;
+		uint64_t syscalls;
+
+		Counts& operator+=(const Counts& other);
+	};
+
+	Channel(const std::string& hostname, const std::string& port);
+	Channel(Channel const&) = delete;
+	Channel& operator=(Channel const&) = delete;
+	~Channel();
+
+	/**
+	 * \brief Connect and authenticate, dropping any earlier connection.
+	 * \param key The key we authenticate with.
+	 * \param session The session to join, or 0 to start one. Set to the
+	 *        session the server put the channel in, or 0 if it didn't say.
+	 * \param offer What we can do. The channel then works to what both ends
+	 *        can, see agreed().
+	 * \returns The server's answer: ACCEPT, the reason it refused, or NONE if
+	 *          it couldn't be reached.
+	 */
+	cmd_t connect(const std::string& key, agsize_t& session, const Hello& offer);
+
+	/// Returns true if the channel can carry requests
+	bool connected() const;
+
+	/// Returns what both ends agreed on when connecting
+	Hello agreed() const;
+
+	/// Returns true once stop() was called
+	bool closed() const;
+
+	/// Tell the server we are leaving and close the socket.
+	void stop();
+
+	/// Returns the number of requests in flight.
+	size_t load() const;
+
+	/// Returns how long the channel has gone without a request in flight.
+	std::chrono::steady_clock::duration idle() const;
+
+	/// Returns the traffic the channel has carried.
+	Counts counts() const;
+
+	/// Claim a slot for a new request, waiting if too many are in flight.
+	agreqid_t acquire();
+
+	/// Give a slot back once its request is finished.
+	void release(agreqid_t id);
+
+	/// Send a request tagged with id. Returns 0 or a negative errno.
+	agerr_t send(agreqid_t id, Frame& request, const void* payload = NULL, size_t length = 0);
+
+	/// Wait for the reply to the request id. Returns 0 or a negative errno.
+	agerr_t await(agreqid_t id, Frame& reply);
+
+	/// Send a request and wait for its reply. Returns 0 or a negative errno.
+	agerr_t roundTrip(Frame& request, Frame& reply);
+
+	/// Mark the channel as failed and fail every request in flight.
+	void disconnect();
+
+private:
+	//A request in flight, waiting for its reply.
+	struct Slot {
+		Slot();
+
+		bool busy;
+		bool done;
+
+		//Bumped every time the slot is reused, so late replies are dropped
+		uint16_t generation;
+
+		//Set instead of reply when the connection failed
+		agerr_t error;
+
+		Frame reply;
+		std::condition_variable ready;
+	};
+
+	//Body of the reader thread: dispatch replies until the connection fails.
+	void readReplies();
+
+	//Stop the reader thread and close the socket.
+	void shutdownSocket();
+
+	int dnsLookup(const char* port);
+
+	//The server we connect to, for messages
+	std::string hostname_;
+	std::string port_;
+
+	//Serializes connecting and sending on the socket
+	std::mutex monitor_;
+
+	//Socket descriptor, or -1 once the connection has failed
+	std::atomic<int> socket_;
+
+	//Framed stream over the socket; may outlive socket_ until reconnecting
+	FrameSocket stream_;
+
+	//Dispatches replies to the slots waiting for them
+	std::thread reader_;
+
+	//Guards slots_ and agreed_
+	mutable std::mutex pendingLock_;
+
+	//Signalled when a slot is released
+	std::condition_variable slotFree_;
+
+	//Requests in flight, indexed by the low bits of their id
+	std::vector<Slot> slots_;
+
+	//Replies being received in pieces, indexed like slots_. Only the reader
+	//thread touches them; an id of 0 means nothing is being put together.
+	std::vector<Frame> partial_;
+
+	//Number of slots in use, and when the last one was given back
+	std::atomic<size_t> inflight_;
+	std::atomic<std::chrono::steady_clock::rep> lastUsed_;
+
+	//Number of requests issued, for the syscalls per request statistic
+	std::atomic<uint64_t> requests_;
+
+	//What both ends can do; only the first maxInFlight slots are used
+	Hello agreed_;
+
+	//Connection closed
+	std::atomic<bool> closed_;
+
+	enum {
+		DNS_ERROR = -1,
+		SOCKET_FAILURE = -2,
+		CONNECTION_FAILURE = -3
+	};
+};
+
+#endif
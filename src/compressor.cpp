@@ -0,0 +1,207 @@
+#include "compressor.hpp"
+#include <algorithm>
+#include <string>
+#include <zlib.h>
+
+//Speeds measured once per process, as a start for every link's estimates.
+struct Calibration {
+	Calibration();
+
+	double speed[2];
+	double inflate;
+};
+
+//Time compressing something like a log or a listing at both levels.
+Calibration::Calibration()
+{
+	std::string sample;
+	uint32_t seed = 1;
+	while (sample.size() < 256 * 1024) {
+		seed = seed * 1103515245 + 12345;
+		sample += "entry " + std::to_string(seed % 100000) + " size " +
+			std::to_string((seed >> 8) % 4096) + ((seed & 1) ? " ok\n" : " retry\n");
+	}
+
+	const int levels[2] = {COMPRESS_FAST_LEVEL, COMPRESS_BEST_LEVEL};
+	std::vector<char> out;
+	for (size_t i = 0; i < 2; i++) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Compressor::pack(sample.data(), sample.size(), levels[i], out);
+		std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+		speed[i] = sample.size() / std::max(took.count(), 1e-6);
+	}
+
+	std::vector<char> back(sample.size());
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Compressor::unpack((const unsigned char*)out.data(), out.size(), back.data(), back.size());
+	std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+	inflate = sample.size() / std::max(took.count(), 1e-6);
+}
+
+Compressor::Compressor()
+	:lock_{},
+	 bandwidth_{0},
+	 latency_{0},
+	 inflate_{0},
+	 sinceSample_{0},
+	 active_{0},
+	 bytes_{0},
+	 packed_{0}
+{
+	static const Calibration calibration;
+	for (size_t i = 0; i < 2; i++) {
+		speed_[i] = calibration.speed[i];
+
+		//A guess until real data has been compressed
+		ratio_[i] = 0.5;
+	}
+	inflate_ = calibration.inflate;
+}
+
+int Compressor::level(size_t length)
+{
+	if (length < COMPRESS_MIN_LEN) {
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> l{lock_};
+	if (bandwidth_ == 0) {
+		return 0;
+	}
+
+	//Seconds per byte each way takes, end to end.
+	const int levels[2] = {COMPRESS_FAST_LEVEL, COMPRESS_BEST_LEVEL};
+	double best = 1 / bandwidth_;
+	int chosen = 0;
+	for (size_t i = 0; i < 2; i++) {
+		double cost = 1 / speed_[i] + 1 / inflate_ + ratio_[i] / bandwidth_;
+		if (cost < best) {
+			best = cost;
+			chosen = levels[i];
+		}
+	}
+
+	if (chosen != 0 && ++sinceSample_ >= COMPRESS_SAMPLE_EVERY) {
+		sinceSample_ = 0;
+		return 0;
+	}
+	return chosen;
+}
+
+void Compressor::roundTrip(Duration elapsed)
+{
+	std::lock_guard<std::mutex> l{lock_};
+	average(latency_, std::chrono::duration<double>(elapsed).count());
+}
+
+void Compressor::starting()
+{
+	active_++;
+}
+
+void Compressor::transferred(size_t length, size_t wire, int level, Duration elapsed)
+{
+	size_t sharing = active_--;
+	if (length == 0) {
+		return;
+	}
+
+	if (level != 0) {
+		bytes_ += length;
+		packed_ += wire;
+		std::lock_guard<std::mutex> l{lock_};
+		average(ratio_[slot(level)], (double)wire / length);
+		return;
+	}
+
+	if (wire < COMPRESS_SAMPLE_LEN) {
+		return;
+	}
+
+	//Transfers under way at once each get a share of the link. At least a
+	//quarter of the time is put down to the data, so a round trip that
+	//happened to be slow can't make the link look endless.
+	std::lock_guard<std::mutex> l{lock_};
+	double seconds = std::chrono::duration<double>(elapsed).count();
+	seconds = std::max(seconds - latency_, seconds / 4);
+	average(bandwidth_, wire * std::max<size_t>(sharing, 1) / std::max(seconds, 1e-6));
+}
+
+bool Compressor::compress(const char* data, size_t length, int level, std::vector<char>& out)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool packed = pack(data, length, level, out);
+	std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+	std::lock_guard<std::mutex> l{lock_};
+	average(speed_[slot(level)], length / std::max(took.count(), 1e-6));
+	return packed;
+}
+
+bool Compressor::decompress(const unsigned char* data, size_t length, char* out, size_t expected)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool unpacked = unpack(data, length, out, expected);
+	std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+	if (unpacked) {
+		std::lock_guard<std::mutex> l{lock_};
+		average(inflate_, expected / std::max(took.count(), 1e-6));
+	}
+	return unpacked;
+}
+
+uint64_t Compressor::bytes() const
+{
+	return bytes_;
+}
+
+uint64_t Compressor::packed() const
+{
+	return packed_;
+}
+
+bool Compressor::compressible(const char* data, size_t length)
+{
+	if (length < COMPRESS_MIN_LEN) {
+		return false;
+	}
+
+	//The middle of a file says more than its start, which is often a header.
+	size_t probe = std::min(length, COMPRESS_PROBE_LEN);
+	thread_local std::vector<char> out;
+	return pack(data + (length - probe) / 2, probe, COMPRESS_FAST_LEVEL, out) &&
+		out.size() * 100 <= probe * COMPRESS_PROBE_PERCENT;
+}
+
+bool Compressor::pack(const char* data, size_t length, int level, std::vector<char>& out)
+{
+	uLongf packed = compressBound(length);
+	out.resize(packed);
+	if (compress2((Bytef*)out.data(), &packed, (const Bytef*)data, length, level) != Z_OK) {
+		out.clear();
+		return false;
+	}
+	out.resize(packed);
+	return packed < length;
+}
+
+bool Compressor::unpack(const unsigned char* data, size_t length, char* out, size_t expected)
+{
+	uLongf unpacked = expected;
+	return uncompress((Bytef*)out, &unpacked, data, length) == Z_OK && unpacked == expected;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+size_t Compressor::slot(int level)
+{
+	return level >= COMPRESS_BEST_LEVEL ? 1 : 0;
+}
+
+void Compressor::average(double& estimate, double sample)
+{
+	estimate = estimate == 0 ? sample : estimate + (sample - estimate) / 8;
+}
@@ -0,0 +1,110 @@
+#ifndef COMPRESSOR_HPP_INC
+#define COMPRESSOR_HPP_INC
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include "constants.hpp"
+
+/**
+ * \brief Compresses the data going over one link to a server, when that makes
+ *        it arrive sooner.
+ * \details Whether to compress, and how hard, is a trade of CPU time against
+ *          time on the wire. The compressor measures both sides: the bandwidth
+ *          of the link from transfers sent as they are and how many shared
+ *          it, the round trip time from requests too small to be slowed by
+ *          it, and the speed and ratio of each zlib level from the frames it
+ *          compresses. Each transfer then uses whichever of sending it raw, a
+ *          quick level or a thorough one is expected to get the data across
+ *          soonest.
+ *
+ *          A frame is only compressed if a probe from its middle shrinks, so
+ *          data that is already compressed (archives, images, video) goes as
+ *          it is without being compressed whole first.
+ */
+class Compressor {
+public:
+	typedef std::chrono::steady_clock::duration Duration;
+
+	Compressor();
+	Compressor(Compressor const&) = delete;
+	Compressor& operator=(Compressor const&) = delete;
+
+	/**
+	 * \brief Choose how to send length bytes.
+	 * \returns The zlib level to compress them at, or 0 to send them as they are.
+	 */
+	int level(size_t length);
+
+	/// Record the round trip time of a request too small to be slowed by the link.
+	void roundTrip(Duration elapsed);
+
+	/// Note that a transfer is starting. Each is then recorded with transferred().
+	void starting();
+
+	/**
+	 * \brief Record a transfer, even one that failed.
+	 * \param length Number of bytes of data transferred.
+	 * \param wire Number of bytes they took on the link.
+	 * \param level The level they were compressed at, or 0 if they weren't.
+	 * \param elapsed Time from sending the request to having the reply.
+	 */
+	void transferred(size_t length, size_t wire, int level, Duration elapsed);
+
+	/// Compress data, timing it. Returns false if it didn't get smaller.
+	bool compress(const char* data, size_t length, int level, std::vector<char>& out);
+
+	/// Decompress data, timing it. Returns false unless exactly expected bytes came out.
+	bool decompress(const unsigned char* data, size_t length, char* out, size_t expected);
+
+	/// Returns the number of bytes of data that travelled compressed.
+	uint64_t bytes() const;
+
+	/// Returns the number of bytes they took on the link.
+	uint64_t packed() const;
+
+	/// Returns true if a probe of the data compresses well enough.
+	static bool compressible(const char* data, size_t length);
+
+	/// Compress data with zlib. Returns false if it didn't get smaller.
+	static bool pack(const char* data, size_t length, int level, std::vector<char>& out);
+
+	/// Decompress data with zlib. Returns false unless exactly expected bytes came out.
+	static bool unpack(const unsigned char* data, size_t length, char* out, size_t expected);
+
+private:
+	//Index of a level in speed_ and ratio_
+	static size_t slot(int level);
+
+	//Fold a new measurement into a running estimate.
+	static void average(double& estimate, double sample);
+
+	//Guards the estimates
+	std::mutex lock_;
+
+	//Bytes per second of the link, or 0 until it has been measured
+	double bandwidth_;
+
+	//Seconds a request takes with nothing to send
+	double latency_;
+
+	//Bytes per second compressed, and the fraction of its size the data
+	//comes out at, for COMPRESS_FAST_LEVEL and COMPRESS_BEST_LEVEL
+	double speed_[2];
+	double ratio_[2];
+
+	//Bytes per second decompressed
+	double inflate_;
+
+	//Transfers compressed since the last one sent as it is
+	size_t sinceSample_;
+
+	//Transfers under way, which share the link
+	std::atomic<size_t> active_;
+
+	std::atomic<uint64_t> bytes_;
+	std::atomic<uint64_t> packed_;
+};
+
+#endif
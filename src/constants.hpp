@@ -6,6 +6,7 @@
 #ifndef CONSTANTS_HPP_INC
 #define CONSTANTS_HPP_INC
 
+#include <array>
 #include <cstdint>
 #include <string>
 
@@ -26,6 +27,29 @@ typedef uint32_t agmode_t;
 typedef uint32_t agmask_t;
 typedef uint64_t agtime_t;
 
+/**
+ * Identifies a request and its reply on a connection
+ */
+typedef uint32_t agreqid_t;
+
+/**
+ * Opaque handle naming a file the server holds open for a client
+ */
+typedef uint64_t agfh_t;
+
+/// Length in bytes of the SHA-256 hash that names a block of file data
+constexpr size_t BLOCK_HASH_LEN = 32;
+
+/**
+ * Names a block of file data by its contents
+ */
+typedef std::array<unsigned char, BLOCK_HASH_LEN> aghash_t;
+
+/**
+ * Rolling checksum of a block of file data
+ */
+typedef uint32_t agsum_t;
+
 /// Provides the key length in bytes (hex encoded)
 constexpr int KEY_LEN = 256;
 
@@ -35,9 +59,172 @@ constexpr size_t ASCII_KEY_LEN = 512;
 constexpr int CLIENT_BLOCK_SEC = 1;
 constexpr int CLIENT_BLOCK_USEC = 0;
 
+/// Number of seconds a client waits for a reply before giving up
+constexpr int CLIENT_REQUEST_SEC = 30;
+
+/// Default number of milliseconds the client trusts cached file attributes
+constexpr int ATTR_CACHE_MSEC = 1000;
+
+/// Default number of milliseconds the client remembers that no server has a path
+constexpr int ABSENT_CACHE_MSEC = 500;
+
+/// Number of independently locked parts of the client's attribute cache
+constexpr size_t ATTR_CACHE_SHARDS = 16;
+
+/// Maximum number of paths the client's attribute cache holds
+constexpr size_t ATTR_CACHE_ENTRIES = 64 * 1024;
+
+/// Number of independently locked parts of the client's location cache
+constexpr size_t LOCATION_CACHE_SHARDS = 16;
+
+/// Maximum number of paths the client remembers the servers of
+constexpr size_t LOCATION_CACHE_ENTRIES = 64 * 1024;
+
+/// Default number of megabytes of file data the client keeps in memory
+constexpr int BLOCK_CACHE_MB = 128;
+
+/// Size of the blocks the client caches file data in
+constexpr size_t BLOCK_CACHE_BLOCK_LEN = 128 * 1024;
+
+/// Number of independently locked parts of the client's block cache
+constexpr size_t BLOCK_CACHE_SHARDS = 16;
+
+/// Maximum number of files the client's block cache keeps versions of
+constexpr size_t BLOCK_CACHE_FILES = 64 * 1024;
+
+/// Number of file blocks the client's block cache remembers the hash of for
+/// each block of data it can hold
+constexpr size_t BLOCK_CACHE_REFS_PER_BLOCK = 2;
+
+/// Default for whether the client asks a server for the hashes of blocks before
+/// fetching them, so data already cached under another file isn't fetched again
+constexpr int BLOCK_HASHES = 1;
+
+/// Maximum number of bytes of file data the server hashes for one BLOCKHASH
+constexpr size_t BLOCK_HASH_MAX_LEN = 32 * 1024 * 1024;
+
+/// Default number of megabytes of whole files the client keeps on local disk; 0
+/// leaves the disk cache off
+constexpr int DISK_CACHE_MB = 0;
+
+/// Files larger than this share of the disk cache are not copied into it
+constexpr size_t DISK_CACHE_FILE_SHARE = 4;
+
+/// Size of the reads the client copies a file into the disk cache with
+constexpr size_t DISK_CACHE_FETCH_LEN = 1024 * 1024;
+
+/// Number of client threads copying files into the disk cache
+constexpr size_t DISK_CACHE_WORKERS = 2;
+
+/// Default number of kilobytes the client reads ahead of a sequential reader
+constexpr int READAHEAD_KB = 8 * 1024;
+
+/// Number of blocks read ahead when a file is first read sequentially
+constexpr size_t READAHEAD_MIN_BLOCKS = 4;
+
+/// Number of client threads fetching blocks ahead of readers
+constexpr size_t READAHEAD_WORKERS = 16;
+
+/// Default number of kilobytes of writes the client holds back for one open file
+constexpr int WRITEBACK_KB = 8 * 1024;
+
+/// Held-back writes to a file start going out once there are this many bytes
+constexpr size_t WRITEBACK_FLUSH_LEN = 1024 * 1024;
+
+/// Number of milliseconds a write may be held back before it is sent anyway
+constexpr int WRITEBACK_MSEC = 500;
+
+/// Largest piece of held-back data sent in one WRITE
+constexpr size_t WRITEBACK_WRITE_LEN = 4 * 1024 * 1024;
+
+/// Number of client threads sending held-back writes
+constexpr size_t WRITEBACK_WORKERS = 4;
+
+/// Default number of megabytes of a rewritten file the client holds back so it
+/// can send only what changed; 0 sends rewrites in full
+constexpr int DELTA_MB = 128;
+
+/// Files smaller than this are always rewritten in full
+constexpr size_t DELTA_MIN_LEN = 1024 * 1024;
+
+/// Smallest block the server signs a file in for a delta
+constexpr size_t DELTA_BLOCK_LEN = 8 * 1024;
+
+/// Maximum number of blocks the server signs a file in; larger files get
+/// larger blocks
+constexpr size_t DELTA_MAX_BLOCKS = 64 * 1024;
+
+/// Default for whether the client asks servers to compress file data and
+/// listings; 0 never does
+constexpr int COMPRESS = 1;
+
+/// Frames shorter than this are never compressed
+constexpr size_t COMPRESS_MIN_LEN = 4 * 1024;
+
+/// Bytes from the middle of a frame compressed to see if the rest is worth it
+constexpr size_t COMPRESS_PROBE_LEN = 4 * 1024;
+
+/// A frame is compressed only if its probe shrinks to this percentage or less
+constexpr size_t COMPRESS_PROBE_PERCENT = 90;
+
+/// Transfers at least this large measure the bandwidth of the link
+constexpr size_t COMPRESS_SAMPLE_LEN = 64 * 1024;
+
+/// While compressing, one transfer in this many is sent as it is, so the
+/// bandwidth of the link keeps being measured
+constexpr size_t COMPRESS_SAMPLE_EVERY = 32;
+
+/// zlib levels the client chooses between: quick, and thorough for slow links
+constexpr int COMPRESS_FAST_LEVEL = 1;
+constexpr int COMPRESS_BEST_LEVEL = 6;
+
+/// Number of client threads sending requests that go to every server
+constexpr size_t FANOUT_WORKERS = 16;
+
+/// Default number of milliseconds a request sent to every server waits for answers
+constexpr int FANOUT_MSEC = 2000;
+
+/// Maximum number of requests a client keeps in flight on one connection
+constexpr size_t MAX_IN_FLIGHT = 64;
+
+/// Maximum number of connections a client opens to one server for file data
+constexpr size_t BULK_CONNECTIONS = 4;
+
+/// Number of seconds an unused file data connection stays open
+constexpr int BULK_IDLE_SEC = 30;
+
+/// Number of threads serving requests for every client of the server
+constexpr size_t SERVER_WORKERS = 32;
+
+/// Most workers one connection's requests hold at once. The rest wait their
+/// turn, since a request may block its worker on a client that is slow to
+/// take the reply or to send a WRITE's data.
+constexpr size_t SERVER_CONN_WORKERS = SERVER_WORKERS / 8;
+
 constexpr int SERVER_BLOCK_SEC = 10;
 constexpr int SERVER_BLOCK_USEC = 0;
 
+/// Reads at least this large are sent to the client straight from the page cache
+constexpr size_t SENDFILE_MIN_LEN = 16 * 1024;
+
+/// Replies larger than this go out in pieces that smaller replies may overtake
+constexpr size_t REPLY_PIECE_LEN = 128 * 1024;
+
+/// Bytes of replies the server lets queue in a socket before waiting for the client
+constexpr int REPLY_QUEUE_LEN = 256 * 1024;
+
+/// WRITE data at least this large is spliced from the socket into the file
+constexpr size_t SPLICE_MIN_LEN = 64 * 1024;
+
+/// Maximum number of directory entries the server sends in one READDIR reply
+constexpr size_t READDIR_CHUNK_ENTRIES = 1024;
+
+/// Number of sorted directory listings the server keeps for one client
+constexpr size_t READDIR_LISTINGS = 16;
+
+/// Number of seconds a client may stay silent before the server drops it
+constexpr int SERVER_IDLE_SEC = 6 * SERVER_BLOCK_SEC;
+
 // Default locations
 const std::string KEY_LIST_PATH = "/var/lib/agfs/authkeys";
 const std::string KEY_NAME_PATH = "/var/lib/agfs/";
@@ -86,6 +273,69 @@ namespace cmd {
 
     /// Command to OPEN a file
     constexpr cmd_t OPEN = 12;
+
+    /// Command to RELEASE a file handle returned by OPEN
+    constexpr cmd_t RELEASE = 13;
+
+    /// Command(?) to reply that the session a connection tried to join has ended
+    constexpr cmd_t SESSION_NOT_FOUND = 14;
+
+    /// Command to hash the blocks of part of an open file
+    constexpr cmd_t BLOCKHASH = 15;
+
+    /// Command to sign the blocks of an open file for a delta
+    constexpr cmd_t SIGNATURE = 16;
+
+    /// Command to replace the contents of an open file with a delta
+    constexpr cmd_t PATCH = 17;
+
+    /// Command to truncate an open file
+    constexpr cmd_t TRUNCATE = 18;
+
+    /// Command to execute a WRITE whose data is compressed
+    constexpr cmd_t PACKED_WRITE = 19;
 }
 
+/**
+ * \brief The encodings data may travel in, as bits of a MASK
+ */
+namespace enc {
+	/// Data as it is
+	constexpr agmask_t NONE = 0;
+
+	/// Data compressed with zlib
+	constexpr agmask_t ZLIB = 1;
+}
+
+/// Encodings this build can send and receive
+constexpr agmask_t ENCODINGS = enc::ZLIB;
+
+/// Version of the protocol this build speaks; peers that predate the hello are 0
+constexpr agsize_t PROTOCOL_VERSION = 1;
+
+/// Smallest frame size a peer may say it takes; a hello naming less is ignored
+constexpr agsize_t HELLO_MIN_FRAME_LEN = 1024 * 1024;
+
+/// Fewest requests a peer may say it serves at once; a hello naming less is ignored
+constexpr agsize_t HELLO_MIN_IN_FLIGHT = 4;
+
+/**
+ * \brief Optional parts of the protocol, as bits of a MASK
+ * \details A peer only sends a command in one of these to a peer that said it
+ *          has it, since older servers don't answer commands they don't know.
+ */
+namespace feature {
+	/// No optional commands
+	constexpr agmask_t NONE = 0;
+
+	/// BLOCKHASH
+	constexpr agmask_t BLOCK_HASHES = 1;
+
+	/// SIGNATURE, PATCH and TRUNCATE
+	constexpr agmask_t DELTA = 2;
+}
+
+/// Features this build has
+constexpr agmask_t FEATURES = feature::BLOCK_HASHES | feature::DELTA;
+
 #endif
@@ -0,0 +1,142 @@
+#include "delta.hpp"
+#include <unordered_map>
+#include <openssl/sha.h>
+
+constexpr agsize_t Delta::LITERAL;
+
+//Splits a checksum into the two halves it is rolled in.
+static void split(const unsigned char* data, size_t length, uint32_t& a, uint32_t& b)
+{
+	a = b = 0;
+	for (size_t i = 0; i < length; i++) {
+		a += data[i];
+		b += (length - i) * data[i];
+	}
+}
+
+static agsum_t join(uint32_t a, uint32_t b)
+{
+	return (a & 0xffff) | (b << 16);
+}
+
+Delta::Delta(const Signature& signature)
+	:signature_{signature}
+{
+	//Nothing to do here...
+}
+
+void Delta::encode(const char* data, size_t length)
+{
+	instructions_.clear();
+	literal_.clear();
+
+	size_t block = signature_.blockLength;
+	const std::vector<agsum_t>& sums = signature_.sums;
+	if (block == 0 || sums.empty() || length < block) {
+		emit(LITERAL, length, data);
+		return;
+	}
+
+	//Blocks by checksum. Most windows match nothing, and a bitmap turns them
+	//away without a lookup.
+	std::unordered_map<agsum_t, std::vector<size_t>> blocks;
+	std::vector<bool> tags(1 << 16);
+	for (size_t i = 0; i < sums.size(); i++) {
+		blocks[sums[i]].push_back(i);
+		tags[(sums[i] ^ (sums[i] >> 16)) & 0xffff] = true;
+	}
+
+	const unsigned char* bytes = (const unsigned char*)data;
+	const size_t none = sums.size();
+	size_t at = 0;
+	size_t pending = 0;
+	size_t next = 0;
+	uint32_t a, b;
+	split(bytes, block, a, b);
+	while (at + block <= length) {
+		agsum_t sum = join(a, b);
+		size_t match = none;
+		if (tags[(sum ^ (sum >> 16)) & 0xffff]) {
+			std::unordered_map<agsum_t, std::vector<size_t>>::iterator it = blocks.find(sum);
+			if (it != blocks.end()) {
+				aghash_t hash;
+				SHA256(bytes + at, block, hash.data());
+
+				//Blocks that follow the last match keep a copy in one piece.
+				for (size_t index: it->second) {
+					if (signature_.hashes[index] == hash) {
+						match = index;
+						if (index == next) {
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		if (match != none) {
+			emit(LITERAL, at - pending, data + pending);
+			emit(match * block, block, NULL);
+			at += block;
+			pending = at;
+			next = match + 1;
+			if (at + block <= length) {
+				split(bytes + at, block, a, b);
+			}
+			continue;
+		}
+
+		//Slide the window on by a byte.
+		if (at + block < length) {
+			uint32_t out = bytes[at];
+			a += bytes[at + block] - out;
+			b += a - block * out;
+		}
+		at++;
+	}
+	emit(LITERAL, length - pending, data + pending);
+}
+
+const std::vector<Delta::Instruction>& Delta::instructions() const
+{
+	return instructions_;
+}
+
+const std::vector<char>& Delta::literal() const
+{
+	return literal_;
+}
+
+agsum_t Delta::checksum(const unsigned char* data, size_t length)
+{
+	uint32_t a, b;
+	split(data, length, a, b);
+	return join(a, b);
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+void Delta::emit(agsize_t from, agsize_t length, const char* data)
+{
+	if (length == 0) {
+		return;
+	}
+
+	if (from == LITERAL) {
+		literal_.insert(literal_.end(), data, data + length);
+	}
+
+	//Runs of literal bytes, and copies of neighbouring blocks, are one
+	//instruction each.
+	if (!instructions_.empty()) {
+		Instruction& last = instructions_.back();
+		if ((from == LITERAL && last.from == LITERAL) ||
+				(from != LITERAL && last.from != LITERAL && last.from + last.length == from)) {
+			last.length += length;
+			return;
+		}
+	}
+	instructions_.push_back(Instruction{from, length});
+}
@@ -0,0 +1,68 @@
+#ifndef DELTA_HPP_INC
+#define DELTA_HPP_INC
+
+#include <cstdint>
+#include <vector>
+#include "constants.hpp"
+
+/**
+ * \brief Works out how to build the new contents of a file from the blocks of
+ *        its old contents, so a rewrite sends only what changed.
+ * \details This is the rsync algorithm. The server signs each whole block of
+ *          the old file with a rolling checksum and a SHA-256 hash. The client
+ *          slides a window the length of a block over the new contents, one
+ *          byte at a time; where the window's checksum and hash match a block,
+ *          the block is copied from the old file and the window jumps past it.
+ *          Everything else is sent as it is. Matches are found wherever they
+ *          have moved to, so data inserted or removed in the middle of a file
+ *          costs only its own length.
+ *
+ *          The new contents are described by instructions, each giving the
+ *          next stretch of the file: either copied from an offset in the old
+ *          file, or taken from the literal data, in order.
+ */
+class Delta {
+public:
+	/// Marks an instruction whose bytes come from the literal data.
+	static constexpr agsize_t LITERAL = ~(agsize_t)0;
+
+	/// The server's description of the old contents.
+	struct Signature {
+		agsize_t blockLength;
+
+		//Checksum and hash of each whole block, in order
+		std::vector<agsum_t> sums;
+		std::vector<aghash_t> hashes;
+	};
+
+	struct Instruction {
+		agsize_t from;
+		agsize_t length;
+	};
+
+	explicit Delta(const Signature& signature);
+	Delta(Delta const&) = delete;
+	Delta& operator=(Delta const&) = delete;
+
+	/// Work out the instructions for new contents.
+	void encode(const char* data, size_t length);
+
+	/// Returns the instructions encode() came up with.
+	const std::vector<Instruction>& instructions() const;
+
+	/// Returns the bytes that must be sent, in the order they are used.
+	const std::vector<char>& literal() const;
+
+	/// Returns the rolling checksum of a block, as the server signs it.
+	static agsum_t checksum(const unsigned char* data, size_t length);
+
+private:
+	//Add the next stretch of the new contents.
+	void emit(agsize_t from, agsize_t length, const char* data);
+
+	const Signature& signature_;
+	std::vector<Instruction> instructions_;
+	std::vector<char> literal_;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "disambiguater.hpp"
+#include "constants.hpp"
+
+/*
+ * Times the merge of one large directory listed by several servers. Each
+ * server lists the given number of files, in bytewise order, and one name in
+ * eight is on every server so it needs a suffix. Listings are fed to the
+ * merge in READDIR_CHUNK_ENTRIES chunks whenever it runs dry on one, the way
+ * agfs_readdir feeds it.
+ *
+ *      usage: disambiguater-bench [entries per server [servers]]
+ */
+
+//One name in this many is shared by every server
+static constexpr size_t SHARED_EVERY = 8;
+
+/*
+ * The name of a server's index-th entry. Names grow with the index, so each
+ * server's listing comes out sorted.
+ */
+static std::string entryName(size_t server, size_t index)
+{
+	char name[64];
+	if (index % SHARED_EVERY == 0) {
+		snprintf(name, sizeof(name), "entry-%010zu", index);
+	} else {
+		snprintf(name, sizeof(name), "entry-%010zu-%zu", index, server);
+	}
+	return name;
+}
+
+int main(int argc, char** argv)
+{
+	size_t entries = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	size_t servers = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+
+	struct stat stbuf;
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_mode = S_IFREG | 0644;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	Disambiguater merge;
+	std::vector<size_t> fed(servers, 0);
+	for (size_t i = 0; i < servers; i++) {
+		merge.addServer("server" + std::to_string(i));
+	}
+
+	std::string name;
+	size_t merged = 0;
+	size_t suffixed = 0;
+	for (;;) {
+		size_t source;
+		while ((source = merge.starved()) != Disambiguater::NONE) {
+			size_t end = std::min(entries, fed[source] + READDIR_CHUNK_ENTRIES);
+			for (; fed[source] < end; fed[source]++) {
+				merge.addFilepath(source, entryName(source, fed[source]), stbuf);
+			}
+			if (fed[source] == entries) {
+				merge.finish(source);
+			}
+		}
+
+		if (!merge.next(name, stbuf)) {
+			break;
+		}
+		merged++;
+		if (name.find("{:") != std::string::npos) {
+			suffixed++;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Merged " << entries << " entries from each of " << servers << " servers into "
+	          << merged << " (" << suffixed << " suffixed) in " << seconds << " s" << std::endl;
+	return merged == entries * servers ? 0 : 1;
+}
@@ -5,154 +5,173 @@
 #include <sys/stat.h>
 #include <string.h>
 
-const std::string Disambiguater::BEGIN_BRACE = "{:";
-const std::string Disambiguater::END_BRACE = ":}";
+const boost::string_view Disambiguater::BEGIN_BRACE{"{:"};
+const boost::string_view Disambiguater::END_BRACE{":}"};
+
+constexpr size_t Disambiguater::NONE;
 
 Disambiguater::Disambiguater()
-	:filemap_{},
-	 directorymap_{}
+	:sources_{},
+	 group_{},
+	 groupAt_{0},
+	 holders_{}
 {
 	//Nothing to do here...
 }
 
-agerr_t Disambiguater::addFilepath(std::pair<std::string, struct stat> value, std::string server)
+size_t Disambiguater::addServer(const std::string& server)
 {
-	std::string path{value.first};
-	struct stat stbuf = value.second;
-	if (S_ISDIR(stbuf.st_mode)) {
-		directorymap_[path] = stbuf;
-	} else {
-		for (size_t i = 0; i < filemap_[path].size(); i++) {
-			if (filemap_[path][i].first == server) {
-				return -EEXIST;
-			}
-		}
-		filemap_[path].push_back(std::pair<std::string, struct stat>{server, stbuf});
-	}
-
-	return 0;
+	Source source;
+	source.server = server;
+	source.head = 0;
+	source.finished = false;
+	sources_.push_back(source);
+	return sources_.size() - 1;
 }
 
-agerr_t Disambiguater::addFilepath(std::string path, std::string server)
+void Disambiguater::addFilepath(size_t source, const std::string& name, const struct stat& stbuf)
 {
-	struct stat stbuf;
-	memset(&stbuf, 0, sizeof(struct stat));
-	//We don't need to check if the map has the path in it, since
-	//the map will just create a new vector if it doesn't contain 
-	//the path.
-	std::pair<std::string, struct stat> value{server, stbuf};
-	for (size_t i = 0; i < filemap_[path].size(); i++) {
-		if (filemap_[path][i].first == server) {
-			return -EEXIST;
-		}
+	Source& src = sources_[source];
+
+	//Everything merged so far has been handed out, so the space can be reused.
+	if (src.head > 0 && src.head == src.entries.size()) {
+		src.arena.clear();
+		src.entries.clear();
+		src.head = 0;
 	}
 
-	filemap_[path].push_back(value);
-	return 0;
+	Entry entry;
+	entry.offset = src.arena.size();
+	entry.length = name.size();
+	entry.stbuf = stbuf;
+	src.arena.append(name);
+	src.entries.push_back(entry);
 }
 
-agerr_t Disambiguater::addFilepaths(std::vector<std::pair<std::string, struct stat>> paths, std::string server)
+void Disambiguater::finish(size_t source)
 {
-	agerr_t error = 0;
-	for (size_t i = 0; i < paths.size(); i++) {
-      if ((error = addFilepath(paths[i], server)) < 0) {
-      	break;
-      }
-    }
-    return error;
+	sources_[source].finished = true;
 }
 
-agerr_t Disambiguater::addFilepaths(std::vector<std::string> paths, std::string server)
+size_t Disambiguater::starved() const
 {
-	agerr_t error = 0;
-	for (size_t i = 0; i < paths.size(); i++) {
-      if ((error = addFilepath(paths[i], server)) < 0) {
-      	break;
-      }
-    }
-    return error;
+	//The rest of the current group is already known.
+	if (groupAt_ < group_.size()) {
+		return NONE;
+	}
+
+	for (size_t i = 0; i < sources_.size(); i++) {
+		if (!sources_[i].finished && sources_[i].head == sources_[i].entries.size()) {
+			return i;
+		}
+	}
+	return NONE;
 }
 
-std::vector<std::string> Disambiguater::disambiguatedFilepaths()
+bool Disambiguater::next(std::string& name, struct stat& stbuf)
 {
-	std::vector<std::string> filenames;
-
-	std::map<std::string, std::vector<std::pair<std::string, struct stat>>>::iterator it;
-	for (it = filemap_.begin(); it != filemap_.end(); ++it) {
-		std::string filepath{it->first};
-		std::vector<std::pair<std::string, struct stat>> servers{it->second};
-
-		if (servers.size() == 1) {
-			filenames.push_back(filepath);
-		} else {
-			for (size_t i = 0; i < servers.size(); i++) {
-				filenames.push_back(filepath + BEGIN_BRACE + servers[i].first + END_BRACE);
-			}
-		}
+	if (groupAt_ == group_.size() && !nextGroup()) {
+		return false;
 	}
 
-	std::map<std::string, struct stat>::iterator dir_itr;
-	for (dir_itr = directorymap_.begin(); dir_itr != directorymap_.end(); ++dir_itr) {
-		filenames.push_back(dir_itr->first);
+	const Member& member = group_[groupAt_++];
+	const Source& src = sources_[member.source];
+	const Entry& entry = src.entries[member.entry];
+	name.assign(src.arena, entry.offset, entry.length);
+	if (member.suffixed) {
+		name.append(BEGIN_BRACE.data(), BEGIN_BRACE.size());
+		name += src.server;
+		name.append(END_BRACE.data(), END_BRACE.size());
 	}
+	stbuf = entry.stbuf;
+	return true;
+}
 
-	return filenames;
+const std::vector<std::string>& Disambiguater::holders() const
+{
+	return holders_;
 }
 
-std::vector<std::pair<std::string, struct stat>> Disambiguater::disambiguatedFilepathsWithStats()
+void Disambiguater::clearPaths()
 {
-	std::vector<std::pair<std::string, struct stat>> filenames;
-
-	std::map<std::string, std::vector<std::pair<std::string, struct stat>>>::iterator it;
-	for (it = filemap_.begin(); it != filemap_.end(); ++it) {
-		std::string filepath{it->first};
-		std::vector<std::pair<std::string, struct stat>> servers{it->second};
-
-		if (servers.size() == 1) {
-			filenames.push_back(std::pair<std::string, struct stat>{filepath, servers[0].second});
-		} else {
-			for (size_t i = 0; i < servers.size(); i++) {
-				std::string file = filepath + BEGIN_BRACE + servers[i].first + END_BRACE;
-				struct stat stbuf = servers[i].second;
-				filenames.push_back(std::pair<std::string, struct stat>{file, stbuf});
-			}
-		}
+	sources_.clear();
+	group_.clear();
+	groupAt_ = 0;
+	holders_.clear();
+}
+
+boost::string_view Disambiguater::ambiguate(boost::string_view path, boost::string_view& file)
+{
+	file = path;
+	if (!path.ends_with(END_BRACE)) {
+		return boost::string_view{};
 	}
 
-	std::map<std::string, struct stat>::iterator dir_itr;
-	for (dir_itr = directorymap_.begin(); dir_itr != directorymap_.end(); ++dir_itr) {
-		filenames.push_back(*dir_itr);
+	//The braces of "{:}" overlap, so the opening one must end in time.
+	size_t begin_position = path.rfind(BEGIN_BRACE);
+	size_t serverLoc = begin_position + BEGIN_BRACE.size();
+	if (begin_position == boost::string_view::npos || serverLoc > path.size() - END_BRACE.size()) {
+		return boost::string_view{};
 	}
 
-	return filenames;
+	//The server name sits between the braces, and the path is what precedes them.
+	file = path.substr(0, begin_position);
+	return path.substr(serverLoc, path.size() - END_BRACE.size() - serverLoc);
 }
 
-void Disambiguater::clearPaths()
+/*********************
+ * Private Functions *
+ *********************/
+
+int Disambiguater::compare(const Source& a, size_t x, const Source& b, size_t y) const
 {
-	filemap_.clear();
-	directorymap_.clear();
+	const Entry& left = a.entries[x];
+	const Entry& right = b.entries[y];
+	return a.arena.compare(left.offset, left.length, b.arena, right.offset, right.length);
 }
 
-std::pair<std::string, std::string> Disambiguater::ambiguate(std::string path)
+bool Disambiguater::nextGroup()
 {
-	size_t begin_position = path.find(BEGIN_BRACE);
-	size_t end_position = path.find(END_BRACE);
-
-	std::string server, filepath;
-
-	if (begin_position == std::string::npos || end_position == std::string::npos) {
-		server = "";
-		filepath = path;
-	} else {
-		//Retrieve the server name
-		size_t serverLoc = begin_position + BEGIN_BRACE.size();
-		server = path.substr(serverLoc, end_position - serverLoc);
-
-		//Retrieve the path
-		filepath = path.substr(0, begin_position);
-		filepath += path.substr(end_position + END_BRACE.size());
+	group_.clear();
+	groupAt_ = 0;
+	holders_.clear();
+
+	//Find the smallest name at the front of any listing.
+	size_t first = NONE;
+	for (size_t i = 0; i < sources_.size(); i++) {
+		if (sources_[i].head < sources_[i].entries.size() &&
+		    (first == NONE || compare(sources_[i], sources_[i].head, sources_[first], sources_[first].head) < 0)) {
+			first = i;
+		}
+	}
+	if (first == NONE) {
+		return false;
 	}
 
-	return std::pair<std::string, std::string>{server, filepath};
-}
+	//Take every entry with that name off the front of its listing.
+	size_t smallest = sources_[first].head;
+	bool directory = false;
+	size_t files = 0;
+	for (size_t i = first; i < sources_.size(); i++) {
+		Source& src = sources_[i];
+		if (src.head == src.entries.size() || compare(src, src.head, sources_[first], smallest) != 0) {
+			continue;
+		}
 
+		holders_.push_back(src.server);
+		if (!S_ISDIR(src.entries[src.head].stbuf.st_mode)) {
+			group_.push_back(Member{i, src.head, true});
+			files++;
+		} else if (!directory) {
+			group_.push_back(Member{i, src.head, false});
+			directory = true;
+		}
+		src.head++;
+	}
+
+	//A file only needs its server named if something else shares its name.
+	if (files == 1 && !directory) {
+		group_[0].suffixed = false;
+	}
+	return true;
+}
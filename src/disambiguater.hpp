@@ -1,42 +1,119 @@
-
 #ifndef DISAMBIGUATER_HPP_INC
 #define DISAMBIGUATER_HPP_INC
 
-#include <map>
 #include <string>
 #include <vector>
-#include <set>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <boost/utility/string_view.hpp>
 #include "constants.hpp"
 
+/**
+ * \brief Merges the listings of one directory from several servers.
+ * \details Every server sends its listing in bytewise order of the names, so
+ *          the listings are merged like sorted runs: only the next entry of
+ *          each is looked at, and entries are handed out as soon as every
+ *          server that could share their name has been heard from. Names are
+ *          kept packed in one buffer per server, which is reused once its
+ *          entries have all been merged.
+ *
+ *          A directory found on several servers is listed once. A file whose
+ *          name is also used on another server is listed once per server with
+ *          the server appended, as name{:server:}.
+ */
 class Disambiguater {
 public:
+	/// Returned by starved() when the merge can go on.
+	static constexpr size_t NONE = (size_t)-1;
+
 	Disambiguater();
 
-	//Returns EEXIST if the path/server combo is already in the map.
-	agerr_t addFilepath(std::string path, std::string server);
-	agerr_t addFilepath(std::pair<std::string, struct stat> value, std::string server);
+	/**
+	 * \brief Add a server whose listing will be merged.
+	 * \returns The index its entries are added under.
+	 */
+	size_t addServer(const std::string& server);
+
+	/**
+	 * \brief Add the next entry of a server's listing.
+	 * \details Entries must be added in the order the server sent them, and
+	 *          only while the server is starved() or before the merge begins.
+	 */
+	void addFilepath(size_t source, const std::string& name, const struct stat& stbuf);
 
-	agerr_t addFilepaths(std::vector<std::string> paths, std::string server);
-	agerr_t addFilepaths(std::vector<std::pair<std::string, struct stat>> paths, std::string server);
+	/// Note that a server's listing has no more entries.
+	void finish(size_t source);
 
-	//Returns a vector of disambiguated filepaths
-	std::vector<std::string> disambiguatedFilepaths();
-	std::vector<std::pair<std::string, struct stat>> disambiguatedFilepathsWithStats();
+	/**
+	 * \brief Find a server whose listing has to grow before next() can go on.
+	 * \returns The index of a server whose entries have all been merged but
+	 *          whose listing isn't finished, or NONE.
+	 */
+	size_t starved() const;
 
-	//Clears all file/server combos from the map.
+	/**
+	 * \brief Take the next entry of the merged listing.
+	 * \details Must not be called while a server is starved().
+	 * \returns false once every listing is finished and has been merged.
+	 */
+	bool next(std::string& name, struct stat& stbuf);
+
+	/// Returns the servers holding the name last returned by next().
+	const std::vector<std::string>& holders() const;
+
+	/// Forget every server and entry.
 	void clearPaths();
 
-	//Ambiguates a file by returning the {server, filepath} pair
-	static std::pair<std::string, std::string> ambiguate(std::string path);
-	
+	/**
+	 * \brief Split a path into the server it names and the path on that server.
+	 * \details Only a suffix ending the path counts, since that is the only
+	 *          place one is ever added. Nothing is copied: both views point
+	 *          into path.
+	 * \param file Set to the path without its suffix.
+	 * \returns The server named by the suffix, or an empty view if there is none.
+	 */
+	static boost::string_view ambiguate(boost::string_view path, boost::string_view& file);
+
 private:
+	//An entry of a listing. Its name is in the listing's arena.
+	struct Entry {
+		size_t offset;
+		size_t length;
+		struct stat stbuf;
+	};
+
+	struct Source {
+		std::string server;
+		std::string arena;
+		std::vector<Entry> entries;
+		size_t head;
+		bool finished;
+	};
+
+	//An entry of the group being handed out
+	struct Member {
+		size_t source;
+		size_t entry;
+		bool suffixed;
+	};
+
+	//Compare two entries by name.
+	int compare(const Source& a, size_t x, const Source& b, size_t y) const;
+
+	//Take the entries sharing the smallest name off the front of every
+	//listing. Returns false if there are none left.
+	bool nextGroup();
+
+	std::vector<Source> sources_;
+
+	//Entries that share the name being handed out, and the next to go
+	std::vector<Member> group_;
+	size_t groupAt_;
 
-	std::map<std::string, std::vector<std::pair<std::string, struct stat>>> filemap_;
-	std::map<std::string, struct stat> directorymap_;
+	std::vector<std::string> holders_;
 
-	static const std::string BEGIN_BRACE;
-	static const std::string END_BRACE;
+	static const boost::string_view BEGIN_BRACE;
+	static const boost::string_view END_BRACE;
 };
 
 #endif
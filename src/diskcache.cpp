@@ -0,0 +1,373 @@
+#include "diskcache.hpp"
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//First line of every meta file, so a change of layout can be told apart
+static const std::string META_MAGIC = "agfs-disk-cache 2";
+
+DiskCache::Mapping::Mapping(const char* data, size_t size)
+	:data_{data},
+	 size_{size}
+{
+	//Nothing to do here...
+}
+
+DiskCache::Mapping::~Mapping()
+{
+	if (size_ > 0) {
+		munmap((void*)data_, size_);
+	}
+}
+
+const char* DiskCache::Mapping::data() const
+{
+	return data_;
+}
+
+size_t DiskCache::Mapping::size() const
+{
+	return size_;
+}
+
+DiskCache::DiskCache()
+	:capacity_{0},
+	 enabled_{false},
+	 bytes_{0},
+	 hits_{0},
+	 misses_{0}
+{
+	//Nothing to do here...
+}
+
+bool DiskCache::start(const std::string& dir, size_t capacity)
+{
+	if (capacity == 0) {
+		return false;
+	}
+	if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+		return false;
+	}
+	DIR* listing = opendir(dir.c_str());
+	if (listing == NULL) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> l{lock_};
+	dir_ = dir;
+	capacity_ = capacity;
+
+	//Load every entry with a meta file. Temporary files are what a crash
+	//left behind, and data without meta was never finished.
+	std::vector<std::string> names, strays;
+	struct dirent* entry;
+	while ((entry = readdir(listing)) != NULL) {
+		std::string file{entry->d_name};
+		size_t dot = file.find('.');
+		if (dot == std::string::npos || dot == 0) {
+			continue;
+		}
+		std::string extension{file.substr(dot)};
+		if (extension == ".meta") {
+			names.push_back(file.substr(0, dot));
+		} else if (extension != ".data") {
+			strays.push_back(file);
+		}
+	}
+	closedir(listing);
+
+	for (const std::string& file: strays) {
+		unlink((dir_ + "/" + file).c_str());
+	}
+	for (const std::string& name: names) {
+		load(name);
+	}
+
+	listing = opendir(dir.c_str());
+	if (listing != NULL) {
+		while ((entry = readdir(listing)) != NULL) {
+			std::string file{entry->d_name};
+			size_t dot = file.find('.');
+			if (dot != std::string::npos && file.substr(dot) == ".data" &&
+					entries_.count(file.substr(0, dot)) == 0) {
+				unlink((dir_ + "/" + file).c_str());
+			}
+		}
+		closedir(listing);
+	}
+
+	evict();
+	enabled_ = true;
+	return true;
+}
+
+bool DiskCache::enabled() const
+{
+	return enabled_;
+}
+
+std::shared_ptr<DiskCache::Mapping> DiskCache::open(const std::string& server,
+	const std::string& path, const struct stat& stbuf)
+{
+	std::string name{nameOf(server, path)};
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		std::unordered_map<std::string, Entry>::iterator it = entries_.find(name);
+		if (it == entries_.end()) {
+			misses_++;
+			return nullptr;
+		}
+		if (!current(it->second, stbuf)) {
+			remove(name);
+			misses_++;
+			return nullptr;
+		}
+		it->second.used = time(NULL);
+	}
+
+	//The meta file's mtime keeps the order entries were used in for the
+	//next mount.
+	std::string meta{fileOf(name, ".meta")};
+	utimensat(AT_FDCWD, meta.c_str(), NULL, 0);
+
+	//The entry may be evicted as we map it; the mapping outlives its file,
+	//but the file must still be there to open.
+	int fd = ::open(fileOf(name, ".data").c_str(), O_RDONLY);
+	if (fd < 0) {
+		misses_++;
+		return nullptr;
+	}
+
+	size_t size = stbuf.st_size;
+	void* data = NULL;
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		misses_++;
+		return nullptr;
+	}
+
+	hits_++;
+	return std::shared_ptr<Mapping>{new Mapping{(const char*)data, size}};
+}
+
+bool DiskCache::wants(agsize_t size) const
+{
+	return enabled_ && size <= capacity_ / DISK_CACHE_FILE_SHARE;
+}
+
+void DiskCache::fill(const std::string& server, const std::string& path,
+	const struct stat& stbuf, Fetcher fetch)
+{
+	//Meta files are line based.
+	if (!wants(stbuf.st_size) || server.find('\n') != std::string::npos ||
+			path.find('\n') != std::string::npos) {
+		return;
+	}
+
+	std::string name{nameOf(server, path)};
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		std::unordered_map<std::string, Entry>::iterator it = entries_.find(name);
+		if (filling_.count(name) > 0 ||
+				(it != entries_.end() && current(it->second, stbuf))) {
+			return;
+		}
+		filling_.insert(name);
+	}
+
+	//Only a complete, synced copy is renamed into place.
+	std::string temporary{fileOf(name, ".data.tmp")};
+	std::string data{fileOf(name, ".data")};
+	agerr_t error = 0;
+	int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		error = -errno;
+	} else {
+		error = fetch(fd);
+		if (error >= 0 && fsync(fd) < 0) {
+			error = -errno;
+		}
+		close(fd);
+	}
+
+	Entry entry;
+	entry.size = stbuf.st_size;
+	entry.mtime = stbuf.st_mtime;
+	entry.ctime = stbuf.st_ctime;
+	entry.used = time(NULL);
+
+	//Whatever copy was there is out of date, and must lose its meta file
+	//before its data is replaced.
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		if (entries_.count(name) > 0) {
+			remove(name);
+		}
+	}
+	if (error >= 0 && (rename(temporary.c_str(), data.c_str()) < 0 ||
+			!writeMeta(name, server, path, entry))) {
+		unlink(data.c_str());
+		error = -EIO;
+	}
+
+	std::lock_guard<std::mutex> l{lock_};
+	filling_.erase(name);
+	if (error < 0) {
+		unlink(temporary.c_str());
+		return;
+	}
+	entries_[name] = entry;
+	bytes_ += entry.size;
+	evict();
+}
+
+void DiskCache::invalidate(const std::string& server, const std::string& path)
+{
+	if (!enabled_) {
+		return;
+	}
+	std::string name{nameOf(server, path)};
+	std::lock_guard<std::mutex> l{lock_};
+	if (entries_.count(name) > 0) {
+		remove(name);
+	}
+}
+
+uint64_t DiskCache::hits() const
+{
+	return hits_;
+}
+
+uint64_t DiskCache::misses() const
+{
+	return misses_;
+}
+
+size_t DiskCache::bytes()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	return bytes_;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+std::string DiskCache::nameOf(const std::string& server, const std::string& path)
+{
+	//FNV-1a, which unlike std::hash is the same from one build to the next.
+	uint64_t hash = 14695981039346656037ULL;
+	std::string key{server + '\0' + path};
+	for (unsigned char c: key) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+	return name;
+}
+
+bool DiskCache::current(const Entry& entry, const struct stat& stbuf)
+{
+	return entry.size == (agsize_t)stbuf.st_size && entry.mtime == stbuf.st_mtime &&
+		entry.ctime == stbuf.st_ctime;
+}
+
+std::string DiskCache::fileOf(const std::string& name, const char* extension) const
+{
+	return dir_ + "/" + name + extension;
+}
+
+void DiskCache::load(const std::string& name)
+{
+	std::string meta{fileOf(name, ".meta")};
+	std::string data{fileOf(name, ".data")};
+
+	std::ifstream in{meta};
+	std::string magic, server, path;
+	Entry entry;
+	long long mtime, ctime;
+	std::getline(in, magic);
+	std::getline(in, server);
+	std::getline(in, path);
+	in >> entry.size >> mtime >> ctime;
+	entry.mtime = mtime;
+	entry.ctime = ctime;
+
+	struct stat metaStat, dataStat;
+	bool good = in && magic == META_MAGIC && nameOf(server, path) == name &&
+		stat(meta.c_str(), &metaStat) == 0 && stat(data.c_str(), &dataStat) == 0 &&
+		(agsize_t)dataStat.st_size == entry.size;
+	if (!good) {
+		unlink(meta.c_str());
+		unlink(data.c_str());
+		return;
+	}
+
+	entry.used = metaStat.st_mtime;
+	entries_[name] = entry;
+	bytes_ += entry.size;
+}
+
+bool DiskCache::writeMeta(const std::string& name, const std::string& server,
+	const std::string& path, const Entry& entry)
+{
+	std::string temporary{fileOf(name, ".meta.tmp")};
+	std::string meta{fileOf(name, ".meta")};
+
+	std::string contents{META_MAGIC + "\n" + server + "\n" + path + "\n" +
+		std::to_string(entry.size) + " " + std::to_string((long long)entry.mtime) + " " +
+		std::to_string((long long)entry.ctime) + "\n"};
+	int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	bool good = write(fd, contents.data(), contents.size()) == (ssize_t)contents.size() &&
+		fsync(fd) == 0;
+	close(fd);
+
+	if (!good || rename(temporary.c_str(), meta.c_str()) < 0) {
+		unlink(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+void DiskCache::remove(const std::string& name)
+{
+	//Meta first: a crash in between leaves data that start() throws away.
+	unlink(fileOf(name, ".meta").c_str());
+	unlink(fileOf(name, ".data").c_str());
+
+	std::unordered_map<std::string, Entry>::iterator it = entries_.find(name);
+	if (it != entries_.end()) {
+		bytes_ -= it->second.size;
+		entries_.erase(it);
+	}
+}
+
+void DiskCache::evict()
+{
+	while (bytes_ > capacity_ && !entries_.empty()) {
+		std::unordered_map<std::string, Entry>::iterator oldest = entries_.begin();
+		for (std::unordered_map<std::string, Entry>::iterator it = entries_.begin();
+				it != entries_.end(); ++it) {
+			if (it->second.used < oldest->second.used) {
+				oldest = it;
+			}
+		}
+		std::string name{oldest->first};
+		remove(name);
+	}
+}
@@ -0,0 +1,153 @@
+#ifndef DISKCACHE_HPP_INC
+#define DISKCACHE_HPP_INC
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "constants.hpp"
+
+/**
+ * \brief Keeps whole copies of files on local disk, so they survive remounts
+ *        and are read at disk speed.
+ * \details Each file is stored under a name derived from its server and path,
+ *          as a data file holding its contents and a meta file naming it and
+ *          recording the size, mtime and ctime it had when fetched. A copy is
+ *          only served while the file on the server still has all three; the
+ *          ctime catches a rewrite to the same size within the same second.
+ *
+ *          Data is written and synced under a temporary name and renamed into
+ *          place before its meta file is written the same way, so a crash at
+ *          any point leaves either a complete entry or pieces that start()
+ *          throws away. The least recently used entries are removed once the
+ *          cache holds more than its capacity; a meta file's mtime records
+ *          when its entry was last used, so the order survives remounts.
+ */
+class DiskCache {
+public:
+	/// A cached copy mapped into memory. It stays readable even if the entry
+	/// is removed meanwhile.
+	class Mapping {
+	public:
+		Mapping(const char* data, size_t size);
+		Mapping(Mapping const&) = delete;
+		Mapping& operator=(Mapping const&) = delete;
+		~Mapping();
+
+		const char* data() const;
+		size_t size() const;
+
+	private:
+		const char* data_;
+		size_t size_;
+	};
+
+	/**
+	 * \brief Writes the contents of a file into a descriptor.
+	 * \returns 0, or a negative errno if the copy is no good.
+	 */
+	typedef std::function<agerr_t(int fd)> Fetcher;
+
+	DiskCache();
+	DiskCache(DiskCache const&) = delete;
+	DiskCache& operator=(DiskCache const&) = delete;
+
+	/**
+	 * \brief Start caching in a directory, creating it if need be.
+	 * \details Entries left by an earlier mount are kept, and anything a
+	 *          crash left half written is removed.
+	 * \param capacity Number of bytes the cache may hold.
+	 * \returns false if the directory can't be used.
+	 */
+	bool start(const std::string& dir, size_t capacity);
+
+	/// Returns true once start() has succeeded.
+	bool enabled() const;
+
+	/**
+	 * \brief Map the cached copy of a file.
+	 * \param server Name of the server holding the file.
+	 * \param path Path of the file on that server.
+	 * \param stbuf Attributes the file has now; a copy made when they were
+	 *        different is removed.
+	 * \returns The mapping, or null if there is no good copy.
+	 */
+	std::shared_ptr<Mapping> open(const std::string& server, const std::string& path,
+		const struct stat& stbuf);
+
+	/// Returns true if a file of this size would be cached.
+	bool wants(agsize_t size) const;
+
+	/**
+	 * \brief Make a cached copy of a file, unless there is one or it is being
+	 *        made already.
+	 * \details Runs fetch on the calling thread.
+	 * \param stbuf Attributes the file had when it was opened; fetch must
+	 *        fail if the file no longer has them.
+	 */
+	void fill(const std::string& server, const std::string& path, const struct stat& stbuf,
+		Fetcher fetch);
+
+	/// Remove the copy of a file, because it is about to change.
+	void invalidate(const std::string& server, const std::string& path);
+
+	/// Returns the number of opens served by a cached copy.
+	uint64_t hits() const;
+
+	/// Returns the number of opens that found no good copy.
+	uint64_t misses() const;
+
+	/// Returns the number of bytes of file data held.
+	size_t bytes();
+
+private:
+	struct Entry {
+		agsize_t size;
+		time_t mtime;
+		time_t ctime;
+		time_t used;
+	};
+
+	//Returns true if an entry was fetched from the file as it is now.
+	static bool current(const Entry& entry, const struct stat& stbuf);
+
+	//Returns the name an entry's files are stored under.
+	static std::string nameOf(const std::string& server, const std::string& path);
+
+	//Returns the path of one of an entry's files.
+	std::string fileOf(const std::string& name, const char* extension) const;
+
+	//Load the entry a meta file describes, or remove it if it is broken.
+	void load(const std::string& name);
+
+	//Write a meta file under a temporary name and rename it into place.
+	bool writeMeta(const std::string& name, const std::string& server,
+		const std::string& path, const Entry& entry);
+
+	//Forget an entry and remove its files. The caller holds lock_.
+	void remove(const std::string& name);
+
+	//Remove the least recently used entries until the cache fits its
+	//capacity. The caller holds lock_.
+	void evict();
+
+	std::string dir_;
+	size_t capacity_;
+	std::atomic<bool> enabled_;
+
+	std::mutex lock_;
+	std::unordered_map<std::string, Entry> entries_;
+	size_t bytes_;
+
+	//Entries being fetched
+	std::set<std::string> filling_;
+
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> misses_;
+};
+
+#endif
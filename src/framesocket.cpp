@@ -0,0 +1,793 @@
+#include "framesocket.hpp"
+#include <algorithm>
+#include <memory>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+
+FrameSocket::FrameSocket()
+	:FrameSocket{-1}
+{
+	//Nothing to do here...
+}
+
+FrameSocket::FrameSocket(int fd)
+	:fd_{fd},
+	 recvBuffer_{},
+	 recvStart_{0},
+	 recvEnd_{0},
+	 wholeWaiting_{0},
+	 sendGate_{},
+	 pieceLength_{0},
+	 stallTimeout_{RECV_TIMEOUT_MSEC},
+	 syscalls_{0},
+	 framesSent_{0},
+	 framesReceived_{0}
+{
+	//Nothing to do here...
+}
+
+void FrameSocket::reset(int fd)
+{
+	fd_ = fd;
+	recvStart_ = 0;
+	recvEnd_ = 0;
+}
+
+int FrameSocket::fd() const
+{
+	return fd_;
+}
+
+void FrameSocket::setPieceLength(size_t length)
+{
+	pieceLength_ = length;
+}
+
+void FrameSocket::setStallTimeout(int msec)
+{
+	stallTimeout_ = std::chrono::milliseconds{msec};
+}
+
+/*
+ * Wire format of a frame:
+ *
+ *      LENGTH ID BODY
+ *
+ * LENGTH is a big endian agframelen_t counting the bytes of BODY, which holds
+ * the fields encoded by the agfs_write_* helpers followed by any payload. ID
+ * is the big endian agreqid_t of the request; a reply carries the id of the
+ * request it answers.
+ *
+ * A frame sent in pieces is cut anywhere in BODY. Each piece goes out with the
+ * frame's ID and FRAME_MORE set in LENGTH, except the last. Pieces of other
+ * frames and whole frames may come in between.
+ */
+static void encodeHeader(unsigned char* header, size_t length, agreqid_t id, bool more)
+{
+	agframelen_t wireLength = htobe32((agframelen_t)length | (more ? FRAME_MORE : 0));
+	agreqid_t wireId = htobe32(id);
+	memcpy(header, &wireLength, sizeof(agframelen_t));
+	memcpy(header + sizeof(agframelen_t), &wireId, sizeof(agreqid_t));
+}
+
+int FrameSocket::send(const Frame& frame, const void* payload, size_t length)
+{
+	size_t total = frame.size() + length;
+	if (total > MAX_FRAME_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (pieceLength_ > 0 && total > pieceLength_) {
+		return sendPieces(frame, payload, length);
+	}
+
+	unsigned char header[FRAME_HEADER_LEN];
+	encodeHeader(header, total, frame.id(), false);
+
+	struct iovec iov[3];
+	iov[0].iov_base = header;
+	iov[0].iov_len = FRAME_HEADER_LEN;
+	iov[1].iov_base = (void*)frame.data();
+	iov[1].iov_len = frame.size();
+	iov[2].iov_base = (void*)payload;
+	iov[2].iov_len = length;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+
+	std::unique_lock<std::mutex> l{sendLock_, std::defer_lock};
+	lockWhole(l);
+	int err = sendAll(msg, FRAME_HEADER_LEN + total, 0);
+	unlockWhole(l);
+	if (err < 0) {
+		return -1;
+	}
+
+	framesSent_++;
+	return 0;
+}
+
+int FrameSocket::sendFile(const Frame& frame, int fileFd, off_t offset, size_t length)
+{
+	size_t total = frame.size() + length;
+	if (total > MAX_FRAME_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	bool whole = pieceLength_ == 0 || total <= pieceLength_;
+	size_t pieceLength = whole ? total : pieceLength_;
+
+	const unsigned char* head = frame.data();
+	size_t headLeft = frame.size();
+	size_t fileLeft = length;
+	do {
+		size_t fromHead = std::min(headLeft, pieceLength);
+		size_t fromFile = std::min(fileLeft, pieceLength - fromHead);
+		bool more = headLeft + fileLeft > fromHead + fromFile;
+
+		unsigned char header[FRAME_HEADER_LEN];
+		encodeHeader(header, fromHead + fromFile, frame.id(), more);
+
+		struct iovec iov[2];
+		iov[0].iov_base = header;
+		iov[0].iov_len = FRAME_HEADER_LEN;
+		iov[1].iov_base = (void*)head;
+		iov[1].iov_len = fromHead;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+
+		//MSG_MORE lets the header share a segment with the start of the data.
+		std::unique_lock<std::mutex> l{sendLock_, std::defer_lock};
+		if (whole) {
+			lockWhole(l);
+		} else {
+			lockPiece(l);
+		}
+		int err = sendAll(msg, FRAME_HEADER_LEN + fromHead, fromFile > 0 ? MSG_MORE : 0);
+		if (err >= 0 && fromFile > 0) {
+			ssize_t unsent = streamFile(fileFd, offset, fromFile);
+			if (unsent < 0 || (unsent > 0 && copyFile(fileFd, offset, unsent) < 0)) {
+				err = -1;
+			}
+			offset += unsent > 0 ? unsent : 0;
+		}
+		if (whole) {
+			unlockWhole(l);
+		} else {
+			l.unlock();
+		}
+		if (err < 0) {
+			return -1;
+		}
+
+		framesSent_++;
+		head += fromHead;
+		headLeft -= fromHead;
+		fileLeft -= fromFile;
+	} while (headLeft + fileLeft > 0);
+
+	return 0;
+}
+
+int FrameSocket::recv(Frame& frame)
+{
+	agframelen_t length;
+	agreqid_t id;
+	bool more;
+	int err = recvHead(length, id, more);
+	if (err <= 0) {
+		return err;
+	}
+
+	//Only recvHead() and recvBody() deal with pieces.
+	if (more) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	frame.setId(id);
+	return recvBody(frame, length, false);
+}
+
+int FrameSocket::recvHead(agframelen_t& length, agreqid_t& id, bool& more)
+{
+	//Wait for a complete header. Only a timeout before any of it came in
+	//is handed back to the caller.
+	std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+	while (buffered() < FRAME_HEADER_LEN) {
+		int err = fill();
+		if (err > 0) {
+			since = std::chrono::steady_clock::now();
+		} else if (buffered() == 0) {
+			return err;
+		} else if (!patient(err, since)) {
+			return stalled(err);
+		}
+	}
+
+	memcpy(&length, &recvBuffer_[recvStart_], sizeof(agframelen_t));
+	length = be32toh(length);
+	more = (length & FRAME_MORE) != 0;
+	length &= ~FRAME_MORE;
+
+	memcpy(&id, &recvBuffer_[recvStart_ + sizeof(agframelen_t)], sizeof(agreqid_t));
+	id = be32toh(id);
+
+	if (length > MAX_FRAME_LEN) {
+		errno = EPROTO;
+		return -1;
+	}
+	recvStart_ += FRAME_HEADER_LEN;
+	return 1;
+}
+
+int FrameSocket::recvBody(Frame& frame, agframelen_t length, bool append)
+{
+	//Bodies that fit in the buffer are collected there, so that small frames
+	//arriving back to back are read with one system call.
+	std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+	if (length <= RECV_BUFFER_LEN) {
+		while (buffered() < length) {
+			int err = fill();
+			if (err > 0) {
+				since = std::chrono::steady_clock::now();
+			} else if (!patient(err, since)) {
+				return stalled(err);
+			}
+		}
+	}
+
+	unsigned char* body = append ? frame.extend(length) : frame.prepare(length);
+	size_t got = std::min(buffered(), (size_t)length);
+	memcpy(body, &recvBuffer_[recvStart_], got);
+	recvStart_ += got;
+
+	//Anything left over is large; read it straight into the frame. Whatever
+	//follows it on the socket goes into the emptied buffer in the same call,
+	//so the next header doesn't cost a read of its own.
+	if (got < length) {
+		if (recvBuffer_.size() < RECV_BUFFER_LEN) {
+			recvBuffer_.resize(RECV_BUFFER_LEN);
+		}
+		recvStart_ = 0;
+		recvEnd_ = 0;
+	}
+	while (got < length) {
+		struct iovec iov[2];
+		iov[0].iov_base = body + got;
+		iov[0].iov_len = length - got;
+		iov[1].iov_base = &recvBuffer_[0];
+		iov[1].iov_len = recvBuffer_.size();
+		ssize_t n = ::readv(fd_, iov, 2);
+		syscalls_++;
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (patient(n, since)) {
+				continue;
+			}
+			return stalled(n);
+		}
+		since = std::chrono::steady_clock::now();
+		if ((size_t)n > length - got) {
+			recvEnd_ = n - (length - got);
+			n = length - got;
+		}
+		got += n;
+	}
+
+	framesReceived_++;
+	return 1;
+}
+
+int FrameSocket::pump()
+{
+	return fill();
+}
+
+int FrameSocket::extract(Frame& frame, agframelen_t limit)
+{
+	if (buffered() < FRAME_HEADER_LEN) {
+		return 0;
+	}
+
+	agframelen_t length;
+	memcpy(&length, &recvBuffer_[recvStart_], sizeof(agframelen_t));
+	length = be32toh(length);
+	if (length > std::min(limit, MAX_FRAME_LEN)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	//Make room for more of a large frame, in step with what has arrived.
+	size_t whole = FRAME_HEADER_LEN + length;
+	if (buffered() < whole) {
+		size_t room = std::min(whole, std::max(2 * buffered(), RECV_BUFFER_LEN));
+		if (recvBuffer_.size() < room) {
+			recvBuffer_.resize(room);
+		}
+		return 0;
+	}
+
+	agreqid_t id;
+	memcpy(&id, &recvBuffer_[recvStart_ + sizeof(agframelen_t)], sizeof(agreqid_t));
+	frame.setId(be32toh(id));
+	recvStart_ += FRAME_HEADER_LEN;
+
+	unsigned char* body = frame.prepare(length);
+	memcpy(body, &recvBuffer_[recvStart_], length);
+	recvStart_ += length;
+
+	framesReceived_++;
+	return 1;
+}
+
+ssize_t FrameSocket::peek(agframelen_t& length, agreqid_t& id, const unsigned char** body)
+{
+	if (buffered() < FRAME_HEADER_LEN) {
+		return -1;
+	}
+
+	memcpy(&length, &recvBuffer_[recvStart_], sizeof(agframelen_t));
+	length = be32toh(length);
+	memcpy(&id, &recvBuffer_[recvStart_ + sizeof(agframelen_t)], sizeof(agreqid_t));
+	id = be32toh(id);
+	if (body != NULL) {
+		*body = &recvBuffer_[recvStart_ + FRAME_HEADER_LEN];
+	}
+	return std::min(buffered() - FRAME_HEADER_LEN, (size_t)length);
+}
+
+size_t FrameSocket::extractHead(Frame& frame, size_t head)
+{
+	agframelen_t length;
+	agreqid_t id;
+	peek(length, id);
+	frame.setId(id);
+	recvStart_ += FRAME_HEADER_LEN;
+
+	unsigned char* body = frame.prepare(head);
+	memcpy(body, &recvBuffer_[recvStart_], head);
+	recvStart_ += head;
+
+	framesReceived_++;
+	return length - head;
+}
+
+/*
+ * Each worker thread keeps one pipe for splicing, since creating and sizing a
+ * pipe costs more system calls than a small write.
+ */
+namespace {
+struct SplicePipe {
+	SplicePipe()
+	{
+		capacity = RECV_BUFFER_LEN;
+		if (pipe2(fds, O_CLOEXEC) < 0) {
+			fds[0] = fds[1] = -1;
+			return;
+		}
+		//A bigger pipe moves more per splice(); the default is fine if the
+		//system won't allow it.
+		fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_LEN);
+		int size = fcntl(fds[1], F_GETPIPE_SZ);
+		if (size > 0) {
+			capacity = size;
+		}
+	}
+
+	~SplicePipe()
+	{
+		if (fds[0] >= 0) {
+			close(fds[0]);
+			close(fds[1]);
+		}
+	}
+
+	int fds[2];
+	int capacity;
+};
+}
+
+int FrameSocket::receiveFile(int fileFd, off_t offset, size_t length, size_t& written,
+	int& fileError)
+{
+	written = 0;
+	fileError = 0;
+
+	//Whatever was read along with the head goes out first.
+	size_t have = std::min(buffered(), length);
+	store(fileFd, offset, &recvBuffer_[recvStart_], have, written, fileError);
+	recvStart_ += have;
+	length -= have;
+
+	thread_local SplicePipe pipe;
+	std::unique_ptr<unsigned char[]> chunk;
+	size_t inPipe = 0;
+	bool spliceFile = true;
+	while (length > 0 || inPipe > 0) {
+		if (length > 0 && (size_t)pipe.capacity > inPipe) {
+			ssize_t moved;
+			if (pipe.fds[0] >= 0) {
+				moved = splice(fd_, NULL, pipe.fds[1], NULL,
+					std::min(length, pipe.capacity - inPipe),
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			} else {
+				//No pipe to splice through; read into a buffer instead.
+				if (!chunk) {
+					chunk.reset(new unsigned char[RECV_BUFFER_LEN]);
+				}
+				moved = ::read(fd_, chunk.get(), std::min(length, RECV_BUFFER_LEN));
+			}
+			syscalls_++;
+
+			if (moved < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					return -1;
+				}
+				//Flush what the pipe holds before waiting for the peer.
+				if (inPipe == 0 && !readable()) {
+					return stalled(-1);
+				}
+			} else if (moved == 0) {
+				return stalled(0);
+			} else if (pipe.fds[0] >= 0) {
+				length -= moved;
+				inPipe += moved;
+				continue;
+			} else {
+				length -= moved;
+				store(fileFd, offset, chunk.get(), moved, written, fileError);
+				continue;
+			}
+		}
+
+		//Empty the pipe into the file.
+		while (inPipe > 0) {
+			ssize_t moved = -1;
+			if (fileError == 0 && spliceFile) {
+				moved = splice(pipe.fds[0], NULL, fileFd, &offset, inPipe, SPLICE_F_MOVE);
+				syscalls_++;
+				if (moved < 0 && errno == EINTR) {
+					continue;
+				}
+				if (moved > 0) {
+					written += moved;
+					inPipe -= moved;
+					continue;
+				}
+				//Files that can't be spliced into are written from a buffer.
+				if (moved < 0 && errno == EINVAL) {
+					spliceFile = false;
+				} else if (moved < 0) {
+					fileError = -errno;
+				} else if (moved == 0) {
+					fileError = -EIO;
+				}
+			}
+
+			if (!chunk) {
+				chunk.reset(new unsigned char[RECV_BUFFER_LEN]);
+			}
+			moved = ::read(pipe.fds[0], chunk.get(), std::min(inPipe, RECV_BUFFER_LEN));
+			syscalls_++;
+			if (moved < 0 && errno == EINTR) {
+				continue;
+			}
+			if (moved <= 0) {
+				return -1;
+			}
+			inPipe -= moved;
+			store(fileFd, offset, chunk.get(), moved, written, fileError);
+		}
+	}
+	return 0;
+}
+
+void FrameSocket::trim()
+{
+	if (buffered() == 0) {
+		std::vector<unsigned char>{}.swap(recvBuffer_);
+		recvStart_ = 0;
+		recvEnd_ = 0;
+	}
+}
+
+uint64_t FrameSocket::syscalls() const
+{
+	return syscalls_;
+}
+
+uint64_t FrameSocket::framesSent() const
+{
+	return framesSent_;
+}
+
+uint64_t FrameSocket::framesReceived() const
+{
+	return framesReceived_;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+void FrameSocket::lockWhole(std::unique_lock<std::mutex>& l)
+{
+	wholeWaiting_++;
+	l.lock();
+	wholeWaiting_--;
+}
+
+void FrameSocket::unlockWhole(std::unique_lock<std::mutex>& l)
+{
+	l.unlock();
+	sendGate_.notify_all();
+}
+
+void FrameSocket::lockPiece(std::unique_lock<std::mutex>& l)
+{
+	l.lock();
+	sendGate_.wait(l, [this]() { return wholeWaiting_ == 0; });
+}
+
+int FrameSocket::sendPieces(const Frame& frame, const void* payload, size_t length)
+{
+	const unsigned char* head = frame.data();
+	size_t headLeft = frame.size();
+	const unsigned char* data = (const unsigned char*)payload;
+	size_t dataLeft = length;
+	do {
+		size_t fromHead = std::min(headLeft, pieceLength_);
+		size_t fromData = std::min(dataLeft, pieceLength_ - fromHead);
+		bool more = headLeft + dataLeft > fromHead + fromData;
+
+		unsigned char header[FRAME_HEADER_LEN];
+		encodeHeader(header, fromHead + fromData, frame.id(), more);
+
+		struct iovec iov[3];
+		iov[0].iov_base = header;
+		iov[0].iov_len = FRAME_HEADER_LEN;
+		iov[1].iov_base = (void*)head;
+		iov[1].iov_len = fromHead;
+		iov[2].iov_base = (void*)data;
+		iov[2].iov_len = fromData;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 3;
+
+		//Frames sent whole overtake the rest of this one between pieces.
+		std::unique_lock<std::mutex> l{sendLock_, std::defer_lock};
+		lockPiece(l);
+		int err = sendAll(msg, FRAME_HEADER_LEN + fromHead + fromData, 0);
+		l.unlock();
+		if (err < 0) {
+			return -1;
+		}
+
+		framesSent_++;
+		head += fromHead;
+		headLeft -= fromHead;
+		data += fromData;
+		dataLeft -= fromData;
+	} while (headLeft + dataLeft > 0);
+
+	return 0;
+}
+
+int FrameSocket::sendAll(struct msghdr& msg, size_t left, int flags)
+{
+	//Keep going until every vector has been drained; the kernel may accept
+	//only part of a large frame.
+	while (left > 0) {
+		ssize_t sent = sendmsg(fd_, &msg, MSG_NOSIGNAL | flags);
+		syscalls_++;
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && writable()) {
+				continue;
+			}
+			return -1;
+		}
+		left -= sent;
+
+		while (sent > 0 && msg.msg_iovlen > 0) {
+			if ((size_t)sent >= msg.msg_iov->iov_len) {
+				sent -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			} else {
+				msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+				msg.msg_iov->iov_len -= sent;
+				sent = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+ssize_t FrameSocket::streamFile(int fileFd, off_t& offset, size_t length)
+{
+	size_t left = length;
+	while (left > 0) {
+		ssize_t sent = sendfile(fd_, fileFd, &offset, left);
+		syscalls_++;
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && writable()) {
+				continue;
+			}
+			if (errno == EINVAL || errno == ENOSYS) {
+				//The file can't be sent from the page cache; copy it instead.
+				break;
+			}
+			return -1;
+		}
+		if (sent == 0) {
+			break;
+		}
+		left -= sent;
+	}
+	return left;
+}
+
+int FrameSocket::copyFile(int fileFd, off_t offset, size_t left)
+{
+	std::unique_ptr<unsigned char[]> chunk{new unsigned char[RECV_BUFFER_LEN]};
+	while (left > 0) {
+		size_t want = std::min(left, RECV_BUFFER_LEN);
+		ssize_t got = pread(fileFd, chunk.get(), want, offset);
+		syscalls_++;
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+
+		//The length was promised in the header, so if the file shrank or
+		//fails underneath us the rest of the frame is padded with zeros.
+		if (got <= 0) {
+			memset(chunk.get(), 0, want);
+			got = want;
+		}
+
+		struct iovec iov;
+		iov.iov_base = chunk.get();
+		iov.iov_len = got;
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (sendAll(msg, got, 0) < 0) {
+			return -1;
+		}
+		offset += got;
+		left -= got;
+	}
+	return 0;
+}
+
+int FrameSocket::fill()
+{
+	if (recvBuffer_.size() < RECV_BUFFER_LEN) {
+		recvBuffer_.resize(RECV_BUFFER_LEN);
+	}
+
+	//Slide unconsumed bytes to the front to make room.
+	if (recvStart_ > 0) {
+		memmove(&recvBuffer_[0], &recvBuffer_[recvStart_], buffered());
+		recvEnd_ -= recvStart_;
+		recvStart_ = 0;
+	}
+
+	ssize_t n;
+	do {
+		n = ::read(fd_, &recvBuffer_[recvEnd_], recvBuffer_.size() - recvEnd_);
+		syscalls_++;
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0) {
+		recvEnd_ += n;
+	}
+	return n;
+}
+
+bool FrameSocket::writable()
+{
+	struct pollfd pfd;
+	pfd.fd = fd_;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+
+	int ready;
+	do {
+		ready = poll(&pfd, 1, SEND_TIMEOUT_MSEC);
+	} while (ready < 0 && errno == EINTR);
+
+	if (ready == 0) {
+		errno = ETIMEDOUT;
+	}
+	return ready > 0;
+}
+
+bool FrameSocket::readable()
+{
+	struct pollfd pfd;
+	pfd.fd = fd_;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	int ready;
+	do {
+		ready = poll(&pfd, 1, RECV_TIMEOUT_MSEC);
+	} while (ready < 0 && errno == EINTR);
+
+	if (ready == 0) {
+		errno = EAGAIN;
+	}
+	return ready > 0;
+}
+
+void FrameSocket::store(int fileFd, off_t& offset, const unsigned char* data, size_t length,
+	size_t& written, int& fileError)
+{
+	while (fileError == 0 && length > 0) {
+		ssize_t n = pwrite(fileFd, data, length, offset);
+		syscalls_++;
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			fileError = n < 0 ? -errno : -EIO;
+			return;
+		}
+		data += n;
+		length -= n;
+		offset += n;
+		written += n;
+	}
+}
+
+bool FrameSocket::patient(int err, std::chrono::steady_clock::time_point since) const
+{
+	return err < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+		std::chrono::steady_clock::now() - since < stallTimeout_;
+}
+
+int FrameSocket::stalled(int err)
+{
+	//Once part of a frame has been consumed the stream can't be resynchronised,
+	//so a timeout here is as fatal as the peer going away.
+	if (err == 0) {
+		errno = ECONNRESET;
+	} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		errno = ETIMEDOUT;
+	}
+	return -1;
+}
+
+size_t FrameSocket::buffered() const
+{
+	return recvEnd_ - recvStart_;
+}
@@ -0,0 +1,272 @@
+#ifndef FRAMESOCKET_HPP_INC
+#define FRAMESOCKET_HPP_INC
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "agfsio.hpp"
+
+/**
+ * Length prefix which precedes every frame on the wire.
+ */
+typedef uint32_t agframelen_t;
+
+/// Size of the LENGTH and ID fields that precede every frame body.
+constexpr size_t FRAME_HEADER_LEN = sizeof(agframelen_t) + sizeof(agreqid_t);
+
+/// Frames larger than this are treated as a protocol error.
+constexpr agframelen_t MAX_FRAME_LEN = 64 * 1024 * 1024;
+
+/// Frames larger than this are a protocol error until the peer's key is checked.
+constexpr agframelen_t MAX_KEY_FRAME_LEN = 64 * 1024;
+
+/// Set in LENGTH on every piece of a frame but the last.
+constexpr agframelen_t FRAME_MORE = 0x80000000;
+
+/// Size of the buffer that small frames are received through.
+constexpr size_t RECV_BUFFER_LEN = 64 * 1024;
+
+/// How long a send waits for a full non-blocking socket to drain.
+constexpr int SEND_TIMEOUT_MSEC = 10 * 1000;
+
+/// How long receiveFile() waits for more of a frame to arrive.
+constexpr int RECV_TIMEOUT_MSEC = 10 * 1000;
+
+/// Capacity asked for the pipe that receiveFile() splices through.
+constexpr int SPLICE_PIPE_LEN = 1024 * 1024;
+
+/**
+ * \brief Sends and receives length-prefixed frames on a connected socket.
+ * \details A frame goes out with one sendmsg() no matter how many fields were
+ *          encoded into it. Incoming data is read in large chunks and split
+ *          back into frames, retrying short reads, so a reply containing many
+ *          fields normally costs a single read().
+ *
+ *          Every frame carries the id of the request it belongs to, so replies
+ *          may come back in any order. Any number of threads may send at once;
+ *          receiving is left to a single reader.
+ *
+ *          Blocking readers use recv(). An event loop watching a non-blocking
+ *          socket uses pump() when it is readable and then extract() to pull
+ *          out whatever frames are complete.
+ *
+ *          A sender may split long frames into pieces, each sent as a frame of
+ *          its own under the same id. Frames sent whole go ahead of the next
+ *          piece of any split frame, so a small reply waits for at most one
+ *          piece of a large one. A reader expecting pieces uses recvHead() and
+ *          recvBody() to put them back together.
+ */
+class FrameSocket {
+public:
+	FrameSocket();
+	explicit FrameSocket(int fd);
+	FrameSocket(FrameSocket const&) = delete;
+	FrameSocket& operator=(FrameSocket const&) = delete;
+
+	/// Attach the stream to a new descriptor and drop any buffered input.
+	void reset(int fd);
+
+	/// Returns the descriptor the stream is attached to.
+	int fd() const;
+
+	/**
+	 * \brief Split frames longer than length into pieces when sending.
+	 * \details 0, the default, sends every frame whole. The peer must be
+	 *          able to put pieces back together.
+	 */
+	void setPieceLength(size_t length);
+
+	/**
+	 * \brief Wait up to msec for the rest of a frame once part of it is in.
+	 * \details Blocking readers give up on a frame only when nothing more of
+	 *          it has arrived for this long, however short the socket's own
+	 *          receive timeout. Defaults to RECV_TIMEOUT_MSEC.
+	 */
+	void setStallTimeout(int msec);
+
+	/**
+	 * \brief Send a frame, optionally followed by a payload.
+	 * \details The payload is sent straight from the caller's buffer as part
+	 *          of the same frame, so bulk data is never copied into the frame.
+	 *          The frame goes out tagged with frame.id().
+	 * \returns 0 on success, or -1 with errno set.
+	 */
+	int send(const Frame& frame, const void* payload = NULL, size_t length = 0);
+
+	/**
+	 * \brief Send a frame followed by a range of a file.
+	 * \details The file data goes from the page cache to the socket with
+	 *          sendfile(), never passing through user space. Files sendfile()
+	 *          can't handle are copied through a small buffer instead. If the
+	 *          file turns out shorter than length, the frame is padded with
+	 *          zeros so the stream stays in step.
+	 * \returns 0 on success, or -1 with errno set.
+	 */
+	int sendFile(const Frame& frame, int fileFd, off_t offset, size_t length);
+
+	/**
+	 * \brief Receive the next frame, setting its id from the wire.
+	 * \details A piece of a frame is a protocol error (EPROTO) here.
+	 * \returns 1 when a frame was received, 0 when the peer closed the
+	 *          connection, or -1 with errno set. EAGAIN means the receive
+	 *          timeout expired before a frame arrived and the call may be
+	 *          retried.
+	 */
+	int recv(Frame& frame);
+
+	/**
+	 * \brief Receive the header of the next frame or piece of one.
+	 * \details Its body must be collected with recvBody() before anything
+	 *          else is received.
+	 * \param more Set if further pieces of the frame follow this one.
+	 * \returns As recv().
+	 */
+	int recvHead(agframelen_t& length, agreqid_t& id, bool& more);
+
+	/**
+	 * \brief Receive the body of the frame or piece whose header was just read.
+	 * \param append Add the body to what frame holds instead of replacing it,
+	 *        for the later pieces of a frame.
+	 * \returns As recv().
+	 */
+	int recvBody(Frame& frame, agframelen_t length, bool append);
+
+	/**
+	 * \brief Read whatever the socket has ready without blocking.
+	 * \returns The number of bytes read, 0 when the peer closed the
+	 *          connection, or -1 with errno set (EAGAIN if nothing was ready).
+	 */
+	int pump();
+
+	/**
+	 * \brief Take the next complete frame out of the bytes already pumped.
+	 * \details The receive buffer grows as the frame arrives, never to more
+	 *          than about twice what has come so far, so a header alone can't
+	 *          make the stream set aside room for a large frame.
+	 * \param limit Frames longer than this break the protocol.
+	 * \returns 1 when a frame was extracted, 0 when more input is needed, or
+	 *          -1 with errno set if the peer broke the protocol.
+	 */
+	int extract(Frame& frame, agframelen_t limit = MAX_FRAME_LEN);
+
+	/**
+	 * \brief Look at the header of the next frame without consuming it.
+	 * \param body If given, set to the body bytes already buffered.
+	 * \returns The number of body bytes already buffered, or -1 if the whole
+	 *          header hasn't arrived yet.
+	 */
+	ssize_t peek(agframelen_t& length, agreqid_t& id, const unsigned char** body = NULL);
+
+	/**
+	 * \brief Take the next frame's header and the first bytes of its body.
+	 * \details The rest of the body stays on the socket, to be collected with
+	 *          receiveFile(). The caller must have seen with peek() that head
+	 *          bytes of the body are buffered.
+	 * \returns The number of body bytes left unread.
+	 */
+	size_t extractHead(Frame& frame, size_t head);
+
+	/**
+	 * \brief Move the next length bytes of the stream into a file.
+	 * \details Bytes already buffered are written with pwrite(); the rest go
+	 *          from the socket through a pipe into the file with splice(),
+	 *          never entering user space. Every byte is consumed even if the
+	 *          file refuses them, so the stream stays in step.
+	 * \param written Set to the number of bytes that reached the file.
+	 * \param fileError Set to 0, or the negative errno the file failed with.
+	 * \returns 0 on success, or -1 with errno set if the socket failed.
+	 */
+	int receiveFile(int fileFd, off_t offset, size_t length, size_t& written,
+		int& fileError);
+
+	/// Free the receive buffer if it holds nothing, so idle streams cost little.
+	void trim();
+
+	/// Returns the number of read/write system calls issued so far.
+	uint64_t syscalls() const;
+
+	/// Returns the number of frames sent so far.
+	uint64_t framesSent() const;
+
+	/// Returns the number of frames received so far.
+	uint64_t framesReceived() const;
+
+private:
+	//Read whatever is available into the receive buffer.
+	int fill();
+
+	//Take sendLock_ to send a frame whole, ahead of any waiting piece.
+	void lockWhole(std::unique_lock<std::mutex>& l);
+
+	//Release sendLock_ after sending a frame whole.
+	void unlockWhole(std::unique_lock<std::mutex>& l);
+
+	//Take sendLock_ to send a piece, once no whole frame is waiting.
+	void lockPiece(std::unique_lock<std::mutex>& l);
+
+	//Send a frame too long to go out whole, piece by piece.
+	int sendPieces(const Frame& frame, const void* payload, size_t length);
+
+	//Send every byte described by msg. The caller holds sendLock_.
+	int sendAll(struct msghdr& msg, size_t left, int flags);
+
+	//Send length bytes of a file with sendfile(). Returns the number of
+	//bytes it couldn't send, for copyFile(), or -1 with errno set.
+	ssize_t streamFile(int fileFd, off_t& offset, size_t length);
+
+	//Send part of a file by reading it through a bounce buffer.
+	int copyFile(int fileFd, off_t offset, size_t left);
+
+	//Wait until the socket can take more data after a send hit EAGAIN.
+	bool writable();
+
+	//Wait until the socket has more data after a read hit EAGAIN.
+	bool readable();
+
+	//Move bytes that have been read from the socket into the file, or throw
+	//them away once the file has failed.
+	void store(int fileFd, off_t& offset, const unsigned char* data, size_t length,
+		size_t& written, int& fileError);
+
+	//Returns true if a read in the middle of a frame that failed with err
+	//should be retried: it only hit the receive timeout, and data last came
+	//in less than the stall timeout ago.
+	bool patient(int err, std::chrono::steady_clock::time_point since) const;
+
+	//Turn an EOF or timeout in the middle of a frame into an error.
+	int stalled(int err);
+
+	//Returns the number of buffered bytes that have not been consumed.
+	size_t buffered() const;
+
+	int fd_;
+
+	//Keeps frames sent by different threads from interleaving
+	std::mutex sendLock_;
+
+	std::vector<unsigned char> recvBuffer_;
+	size_t recvStart_;
+	size_t recvEnd_;
+
+	//Number of threads waiting to send a frame whole, and the signal that
+	//holds pieces back until they are done
+	std::atomic<size_t> wholeWaiting_;
+	std::condition_variable sendGate_;
+
+	//Frames longer than this are sent in pieces; 0 sends them whole
+	size_t pieceLength_;
+
+	//How long a blocking reader waits for more of a frame
+	std::chrono::milliseconds stallTimeout_;
+
+	std::atomic<uint64_t> syscalls_;
+	std::atomic<uint64_t> framesSent_;
+	std::atomic<uint64_t> framesReceived_;
+};
+
+#endif
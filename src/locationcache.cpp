@@ -0,0 +1,88 @@
+#include "locationcache.hpp"
+#include <functional>
+
+LocationCache::LocationCache()
+	:shards_(LOCATION_CACHE_SHARDS),
+	 avoided_{0}
+{
+	//Nothing to do here...
+}
+
+void LocationCache::insert(const std::string& path, const std::vector<std::string>& servers)
+{
+	if (servers.empty()) {
+		return;
+	}
+
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> l{shard.lock};
+
+	//Nothing here goes stale on a timer, so a full shard simply starts over.
+	if (shard.servers.size() >= LOCATION_CACHE_ENTRIES / LOCATION_CACHE_SHARDS) {
+		shard.servers.clear();
+	}
+	shard.servers[path] = servers;
+}
+
+std::vector<std::string> LocationCache::lookup(const std::string& path, bool& exact)
+{
+	exact = true;
+	std::string prefix{path};
+	while (prefix.length() > 1) {
+		Shard& shard = shardFor(prefix);
+		{
+			std::lock_guard<std::mutex> l{shard.lock};
+			std::unordered_map<std::string, std::vector<std::string>>::iterator it;
+			it = shard.servers.find(prefix);
+			if (it != shard.servers.end()) {
+				return it->second;
+			}
+		}
+
+		//Try the directory above. The root is on every server, so it tells
+		//us nothing.
+		exact = false;
+		size_t slash = prefix.find_last_of('/');
+		if (slash == std::string::npos) {
+			break;
+		}
+		prefix.erase(slash);
+	}
+
+	exact = false;
+	return std::vector<std::string>{};
+}
+
+void LocationCache::invalidate(const std::string& path)
+{
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> l{shard.lock};
+	shard.servers.erase(path);
+}
+
+void LocationCache::clear()
+{
+	for (size_t i = 0; i < shards_.size(); i++) {
+		std::lock_guard<std::mutex> l{shards_[i].lock};
+		shards_[i].servers.clear();
+	}
+}
+
+void LocationCache::avoided(uint64_t requests)
+{
+	avoided_ += requests;
+}
+
+uint64_t LocationCache::requestsAvoided() const
+{
+	return avoided_;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+LocationCache::Shard& LocationCache::shardFor(const std::string& path)
+{
+	return shards_[std::hash<std::string>{}(path) % shards_.size()];
+}
@@ -0,0 +1,65 @@
+#ifndef LOCATIONCACHE_HPP_INC
+#define LOCATIONCACHE_HPP_INC
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "constants.hpp"
+
+/**
+ * \brief Remembers which servers hold a path, so requests for it can go
+ *        straight to them instead of to every server.
+ * \details Paths are the server-free form that FUSE paths ambiguate to. A
+ *          file maps to the servers it was found on. A directory maps to the
+ *          servers that list it, and since nothing can exist below a
+ *          directory a server doesn't have, it narrows the search for every
+ *          path underneath too.
+ *
+ *          Entries don't expire. Callers fall back to asking every server
+ *          when the servers named here turn out not to have the path.
+ */
+class LocationCache {
+public:
+	LocationCache();
+	LocationCache(LocationCache const&) = delete;
+	LocationCache& operator=(LocationCache const&) = delete;
+
+	/// Record the servers a path was found on.
+	void insert(const std::string& path, const std::vector<std::string>& servers);
+
+	/**
+	 * \brief Find the servers that may hold a path.
+	 * \param exact Set to true if the path itself was recorded, false if the
+	 *        answer comes from the closest recorded directory above it.
+	 * \returns The servers to ask, or an empty list if nothing is known.
+	 */
+	std::vector<std::string> lookup(const std::string& path, bool& exact);
+
+	/// Forget a path whose recorded servers turned out to be wrong.
+	void invalidate(const std::string& path);
+
+	/// Forget everything, because the set of servers changed.
+	void clear();
+
+	/// Count requests that didn't have to be sent thanks to the cache.
+	void avoided(uint64_t requests);
+
+	/// Returns the number of requests the cache saved.
+	uint64_t requestsAvoided() const;
+
+private:
+	struct Shard {
+		std::mutex lock;
+		std::unordered_map<std::string, std::vector<std::string>> servers;
+	};
+
+	//Returns the shard a path lives in.
+	Shard& shardFor(const std::string& path);
+
+	std::vector<Shard> shards_;
+	std::atomic<uint64_t> avoided_;
+};
+
+#endif
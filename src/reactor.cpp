@@ -0,0 +1,167 @@
+#include "reactor.hpp"
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "agfs-server.hpp"
+#include "constants.hpp"
+
+//Number of events collected by one epoll_wait()
+static constexpr int REACTOR_EVENTS = 64;
+
+//How long epoll_wait() sleeps, so idle clients are noticed without traffic
+static constexpr int REACTOR_TICK_MSEC = 1000;
+
+Reactor::Reactor(int listenFd)
+	:epollFd_{epoll_create1(EPOLL_CLOEXEC)},
+	 listenFd_{listenFd},
+	 lastExpiry_{time(NULL)},
+	 workers_{SERVER_WORKERS},
+	 clients_{}
+{
+	fcntl(listenFd_, F_SETFL, fcntl(listenFd_, F_GETFL) | O_NONBLOCK);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = listenFd_;
+	if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev) < 0) {
+		std::cerr << "Could not watch listening socket: " << strerror(errno) << std::endl;
+	}
+}
+
+Reactor::~Reactor()
+{
+	workers_.drain();
+	clients_.clear();
+	close(epollFd_);
+}
+
+void Reactor::run()
+{
+	struct epoll_event events[REACTOR_EVENTS];
+	while (1) {
+		int ready = epoll_wait(epollFd_, events, REACTOR_EVENTS, REACTOR_TICK_MSEC);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+			return;
+		}
+
+		for (int i = 0; i < ready; i++) {
+			if (events[i].data.fd == listenFd_) {
+				acceptClients();
+			} else {
+				serve(events[i].data.fd);
+			}
+		}
+		expire();
+	}
+}
+
+void Reactor::watch(int fd, bool reading)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = reading ? (uint32_t)EPOLLIN : 0;
+	ev.data.fd = fd;
+
+	//A client dropped in the meantime is no longer registered; that's fine.
+	epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+WorkerPool& Reactor::workers()
+{
+	return workers_;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+void Reactor::acceptClients()
+{
+	while (1) {
+		int connfd = accept4(listenFd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				std::cerr << "Accept failed: " << strerror(errno) << std::endl;
+			}
+			return;
+		}
+
+		//Requests and replies are whole frames; don't hold them back.
+		int nodelay = 1;
+		setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		//Keep little unsent in the socket, or a reply that overtakes the
+		//pieces of a large one would still queue behind what they left.
+		int unsent = REPLY_QUEUE_LEN;
+		setsockopt(connfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unsent, sizeof(unsent));
+
+		Client client;
+		client.connection = std::make_shared<ClientConnection>(connfd, *this);
+		client.lastActive = time(NULL);
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN;
+		ev.data.fd = connfd;
+		if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+			std::cerr << "Could not watch client: " << strerror(errno) << std::endl;
+			continue;
+		}
+		clients_[connfd] = client;
+		std::cerr << "Accepted client" << std::endl;
+	}
+}
+
+void Reactor::serve(int fd)
+{
+	std::map<int, Client>::iterator it = clients_.find(fd);
+	if (it == clients_.end()) {
+		return;
+	}
+
+	it->second.lastActive = time(NULL);
+	if (!it->second.connection->processInput()) {
+		drop(fd);
+	}
+}
+
+void Reactor::expire()
+{
+	time_t now = time(NULL);
+	if (now == lastExpiry_) {
+		return;
+	}
+	lastExpiry_ = now;
+
+	std::map<int, Client>::iterator it = clients_.begin();
+	while (it != clients_.end()) {
+		int fd = it->first;
+		bool idle = now - it->second.lastActive > SERVER_IDLE_SEC &&
+			!it->second.connection->busy();
+		it++;
+		if (idle) {
+			std::cerr << "Client timed out" << std::endl;
+			drop(fd);
+		}
+	}
+}
+
+void Reactor::drop(int fd)
+{
+	epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
+	clients_.erase(fd);
+}
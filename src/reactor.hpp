@@ -0,0 +1,75 @@
+#ifndef REACTOR_HPP_INC
+#define REACTOR_HPP_INC
+
+#include <ctime>
+#include <map>
+#include <memory>
+#include "workerpool.hpp"
+
+class ClientConnection;
+
+/**
+ * \brief Serves every client of the daemon from one process.
+ * \details A single thread waits on the listening socket and all client
+ *          sockets with epoll. Readable connections are drained without
+ *          blocking and their requests are run on one shared pool of
+ *          SERVER_WORKERS threads, so the number of threads stays fixed no
+ *          matter how many clients are connected.
+ */
+class Reactor {
+public:
+	/**
+	 * \brief Create the reactor.
+	 * \param listenFd A bound, listening socket to accept clients on.
+	 */
+	explicit Reactor(int listenFd);
+	Reactor(Reactor const&) = delete;
+	Reactor& operator=(Reactor const&) = delete;
+
+	/// Close every connection and the event queue.
+	~Reactor();
+
+	/// Accept and serve clients until the event queue fails.
+	void run();
+
+	/**
+	 * \brief Start or stop waiting for input on a client socket.
+	 * \details Safe to call from any thread; a connection uses it to stop
+	 *          reading while too many of its requests are in flight.
+	 */
+	void watch(int fd, bool reading);
+
+	/// Returns the pool that requests are served on.
+	WorkerPool& workers();
+
+private:
+	struct Client {
+		std::shared_ptr<ClientConnection> connection;
+		time_t lastActive;
+	};
+
+	//Accept every pending client on the listening socket.
+	void acceptClients();
+
+	//Read input from a client, dropping it if the connection is over.
+	void serve(int fd);
+
+	//Drop clients that have been silent for too long.
+	void expire();
+
+	//Stop watching a client. The connection closes once its last request
+	//has finished.
+	void drop(int fd);
+
+	int epollFd_;
+	int listenFd_;
+	time_t lastExpiry_;
+
+	//Each job holds on to its connection, so a client can be dropped while
+	//its requests are still running.
+	WorkerPool workers_;
+
+	std::map<int, Client> clients_;
+};
+
+#endif
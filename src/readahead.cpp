@@ -0,0 +1,90 @@
+#include "readahead.hpp"
+#include <algorithm>
+
+Readahead::Readahead()
+	:expected_{0},
+	 window_{0},
+	 ahead_{0},
+	 closing_{false}
+{
+	//Nothing to do here...
+}
+
+void Readahead::plan(uint64_t offset, size_t length, size_t limit, uint64_t& first, uint64_t& end)
+{
+	first = end = 0;
+	if (length == 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> l{lock_};
+	if (closing_) {
+		return;
+	}
+
+	uint64_t block = offset / BLOCK_CACHE_BLOCK_LEN;
+	uint64_t reached = expected_ / BLOCK_CACHE_BLOCK_LEN;
+	bool sequential = offset == expected_ ||
+		(window_ > 0 && block + window_ >= reached && block < ahead_);
+
+	if (sequential) {
+		window_ = window_ == 0 ? READAHEAD_MIN_BLOCKS : window_ * 2;
+		window_ = std::min(window_, limit);
+		expected_ = std::max<uint64_t>(expected_, offset + length);
+	} else {
+		window_ = 0;
+		expected_ = offset + length;
+		ahead_ = 0;
+	}
+	if (window_ == 0) {
+		return;
+	}
+
+	//Keep the window's worth of blocks after the furthest one read fetched.
+	uint64_t next = (expected_ - 1) / BLOCK_CACHE_BLOCK_LEN + 1;
+	uint64_t start = std::max(ahead_, next);
+	uint64_t target = next + window_;
+	if (start < target) {
+		first = start;
+		end = target;
+		ahead_ = target;
+		for (uint64_t index = first; index < end; index++) {
+			inFlight_.insert(index);
+		}
+	}
+}
+
+void Readahead::finished(uint64_t index)
+{
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		std::multiset<uint64_t>::iterator it = inFlight_.find(index);
+		if (it != inFlight_.end()) {
+			inFlight_.erase(it);
+		}
+	}
+	landed_.notify_all();
+}
+
+bool Readahead::wait(uint64_t index)
+{
+	std::unique_lock<std::mutex> l{lock_};
+	if (inFlight_.count(index) == 0) {
+		return false;
+	}
+	landed_.wait(l, [this, index]() { return inFlight_.count(index) == 0; });
+	return true;
+}
+
+bool Readahead::closing()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	return closing_;
+}
+
+void Readahead::close()
+{
+	std::unique_lock<std::mutex> l{lock_};
+	closing_ = true;
+	landed_.wait(l, [this]() { return inFlight_.empty(); });
+}
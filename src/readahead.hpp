@@ -0,0 +1,74 @@
+#ifndef READAHEAD_HPP_INC
+#define READAHEAD_HPP_INC
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include "constants.hpp"
+
+/**
+ * \brief Follows how one open file is being read and decides which blocks to
+ *        fetch before they are asked for.
+ * \details While reads follow on from each other, the window of blocks kept
+ *          fetched ahead of the reader starts at READAHEAD_MIN_BLOCKS and
+ *          doubles with every read, up to a limit. A read inside the window
+ *          still counts as sequential, since FUSE may hand us a stream's reads
+ *          slightly out of order. Any other read closes the window until the
+ *          reader settles into a sequence again.
+ *
+ *          Blocks picked for fetching are in flight until finished() is
+ *          called for them. A reader wanting one of them waits for it rather
+ *          than asking the server a second time.
+ */
+class Readahead {
+public:
+	Readahead();
+	Readahead(Readahead const&) = delete;
+	Readahead& operator=(Readahead const&) = delete;
+
+	/**
+	 * \brief Note a read and pick the blocks to fetch ahead of it.
+	 * \param limit The most blocks to keep fetched ahead of the reader.
+	 * \param first Set to the first block to fetch.
+	 * \param end Set to the block after the last one to fetch; equal to first
+	 *        if there is nothing to fetch.
+	 */
+	void plan(uint64_t offset, size_t length, size_t limit, uint64_t& first, uint64_t& end);
+
+	/// Mark a block picked by plan() as no longer in flight.
+	void finished(uint64_t index);
+
+	/**
+	 * \brief Wait for a block that is being fetched ahead.
+	 * \returns true if the block was in flight.
+	 */
+	bool wait(uint64_t index);
+
+	/// Returns true once close() has been called.
+	bool closing();
+
+	/// Stop picking blocks and wait for those in flight to be finished.
+	void close();
+
+private:
+	std::mutex lock_;
+
+	//Signalled whenever a block stops being in flight
+	std::condition_variable landed_;
+
+	//Offset the next read will start at if the reader is sequential
+	uint64_t expected_;
+
+	//Number of blocks kept fetched ahead; 0 while reads are random
+	size_t window_;
+
+	//First block that hasn't been picked for fetching yet
+	uint64_t ahead_;
+
+	//A block picked again while still in flight appears twice
+	std::multiset<uint64_t> inFlight_;
+	bool closing_;
+};
+
+#endif
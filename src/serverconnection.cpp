@@ -13,49 +13,67 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <endian.h>
+#include <chrono>
+#include <algorithm>
 
-ServerConnection::ServerConnection(std::string hostname, std::string port, std::string key):
+ServerConnection::ServerConnection(std::string hostname, std::string port, std::string key,
+		const Hello& offer):
 	failedCommand_{false},
 	connectionStopped_{false},
 	hostname_{hostname},
 	port_{port},
 	key_{key},
-	socket_{-1},
+	offer_(offer),
+	link_{},
+	meta_{new Channel{hostname, port}},
+	bulkLock_{},
+	bulk_{},
+	growing_{false},
+	bulkFailed_{false},
+	session_{0},
+	retired_{},
 	closed_{false}
 {
 	connect();
 };
 
-ServerConnection::ServerConnection(ServerConnection const& connection) :
-	failedCommand_{connection.failedCommand_},
-	connectionStopped_{connection.connectionStopped_},
-	hostname_{connection.hostname_},
-	port_{connection.port_},
-	key_{connection.key_},
-	socket_{connection.socket_},
-	closed_{connection.closed_}
+ServerConnection::~ServerConnection()
 {
-	//Copy constructor!
+	//Nothing to do here...
 }
 
 bool ServerConnection::connected()
 {
-	if (socket_ < 0) {
-		return false;
-	}
-	return true;
+	return meta_->connected();
 }
 
 agerr_t ServerConnection::stop() {
-	std::lock_guard<std::mutex> l{monitor_};
-	agerr_t error = 0;
-	if (connected()) {
-		agfs_write_cmd(socket_, cmd::STOP);
-		error = close(socket_);
-		socket_ = -1;
-	}
-	closed_ = true;
-	return error;
+	if (meta_->connected()) {
+		std::cerr << "Server " << hostname_ << ": " << ioStats() << std::endl;
+	}
+
+	std::vector<std::shared_ptr<Channel>> pool;
+	{
+		std::lock_guard<std::mutex> l{bulkLock_};
+		pool.swap(bulk_);
+		closed_ = true;
+	}
+	for (size_t i = 0; i < pool.size(); i++) {
+		pool[i]->stop();
+	}
+	{
+		std::lock_guard<std::mutex> l{bulkLock_};
+		for (size_t i = 0; i < pool.size(); i++) {
+			retired_ += pool[i]->counts();
+		}
+	}
+	meta_->stop();
+	return 0;
+}
+
+const std::string& ServerConnection::hostname() const
+{
+	return hostname_;
 }
 
 bool ServerConnection::closed()
@@ -63,71 +81,83 @@ bool ServerConnection::closed()
 	return closed_;
 }
 
-void ServerConnection::connect(){
-	//Perform DNS lookup and handle DNS errors.
-	socket_ = dnsLookup(port_.c_str());
+bool ServerConnection::supports(agmask_t features)
+{
+	return (meta_->agreed().features & features) == features;
+}
 
-	switch (socket_){
-	case DNS_ERROR:
-		std::cerr << "Failed DNS lookup" << std::endl;
-		return;
-		break;
-	case SOCKET_FAILURE:
-		std::cerr << "Failed to create socket" << std::endl;
-		return;
-		break;
-	case CONNECTION_FAILURE:
-		std::cerr << "Could not connect to server " << hostname_ << ":" << port_ << std::endl;
-		return;
-		break;
-	default:
-		break;
+void ServerConnection::connect(){
+	//Channels of the old session go with it.
+	std::vector<std::shared_ptr<Channel>> pool;
+	{
+		std::lock_guard<std::mutex> l{bulkLock_};
+		pool.swap(bulk_);
+		session_ = 0;
+	}
+	for (size_t i = 0; i < pool.size(); i++) {
+		pool[i]->stop();
 	}
 
-	//Set timeout
-	struct timeval tv;
-	tv.tv_sec = CLIENT_BLOCK_SEC;
-	tv.tv_usec = CLIENT_BLOCK_USEC;
-	setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *)(&tv), sizeof(struct timeval));
-	int iMode = 0;
-	ioctl(socket_, FIONBIO, &iMode);
-
-	//send key for verification
-	agfs_write_string(socket_, key_);
-	cmd_t servResp = cmd::NONE;
-	agfs_read_cmd(socket_, servResp);
+	agsize_t session = 0;
+	cmd_t servResp = meta_->connect(key_, session, offer_);
 
 	switch(servResp) {
 	case cmd::INVALID_KEY:
 		std::cerr << "Server " << hostname_ << ": Invalid key" << std::endl;
-		close(socket_);
-		socket_ = -1;
 		break;
 	case cmd::MOUNT_NOT_FOUND:
 		std::cerr << "Server " << hostname_ << ": Remote mount not found" << std::endl;
-		close(socket_);
-		socket_ = -1;
 		break;
 	case cmd::USER_NOT_FOUND:
 		std::cerr << "Server " << hostname_ << ": Remote user not found" << std::endl;
-		close(socket_);
-		socket_ = -1;
 		break;
 	case cmd::ACCEPT:
-		std::cerr << "Connected to server" << std::endl;
+		std::cerr << "Connected to server (protocol " << meta_->agreed().version << ")" << std::endl;
 		break;
 	default:
 		std::cerr << "Other/No response: " << servResp << std::endl;
-		close(socket_);
-		socket_ = -1;
 		break;
 	}
+
+	std::lock_guard<std::mutex> l{bulkLock_};
+	for (size_t i = 0; i < pool.size(); i++) {
+		retired_ += pool[i]->counts();
+	}
+	session_ = session;
+	bulkFailed_ = false;
 };
 
 bool ServerConnection::stopped() {
 	return connectionStopped_;
 }
 
+std::string ServerConnection::ioStats() {
+	size_t channels = 1;
+	Channel::Counts counts = meta_->counts();
+	{
+		std::lock_guard<std::mutex> l{bulkLock_};
+		counts += retired_;
+		for (size_t i = 0; i < bulk_.size(); i++) {
+			counts += bulk_[i]->counts();
+		}
+		channels += bulk_.size();
+	}
+
+	std::string stats = std::to_string(counts.requests) + " requests, " +
+		std::to_string(counts.framesSent) + " frames sent, " +
+		std::to_string(counts.framesReceived) + " frames received, " +
+		std::to_string(counts.syscalls) + " syscalls";
+	if (counts.requests > 0) {
+		stats += " (" + std::to_string((double)counts.syscalls / counts.requests) + " per request)";
+	}
+	stats += " over " + std::to_string(channels) + " connections";
+	if (link_.bytes() > 0) {
+		stats += ", " + std::to_string(link_.bytes() / 1024) + " KB compressed to " +
+			std::to_string(link_.packed() / 1024) + " KB";
+	}
+	return stats;
+}
+
 /******************
  * FUSE functions *
  ******************/
@@ -135,6 +165,9 @@ bool ServerConnection::stopped() {
 /*
  * Function stack objects with [] around them indicate tthat they are optional
  * or not always present, based on preceding objects in the stack.
+ *
+ * Each stack below is the body of a single frame (see framesocket.hpp). The
+ * command that starts every outgoing stack is left out.
  */
 
 /*
@@ -147,21 +180,24 @@ bool ServerConnection::stopped() {
  *      ERROR [STAT]
  */
 std::pair<struct stat, agerr_t> ServerConnection::getattr(const char* path) {
-	std::lock_guard<std::mutex> l{monitor_};
 	//Let server know we want file metadata
-	cmd_t cmd = cmd::GETATTR;
-	agfs_write_cmd(socket_, cmd);
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::GETATTR);
 
 	//Outgoing stack calls
-	agfs_write_string(socket_, std::string(path));
-
-	agerr_t error = 0;
-	agfs_read_error(socket_, error);
+	agfs_write_string(request, std::string(path));
 
 	struct stat readValues;
 	memset(&readValues, 0, sizeof(struct stat));
+	agerr_t error = meta_->roundTrip(request, reply);
+	if (error < 0) {
+		return std::pair<struct stat, agerr_t>(readValues, error);
+	}
+
+	agfs_read_error(reply, error);
+
 	if(error >= 0) {
-		agfs_read_stat(socket_, readValues);
+		agfs_read_stat(reply, readValues);
 	}
 
 	return std::pair<struct stat, agerr_t>(readValues, error);
@@ -177,143 +213,330 @@ std::pair<struct stat, agerr_t> ServerConnection::getattr(const char* path) {
  *      ERROR
  */
 agerr_t ServerConnection::access(const char* path, int mask) {
-	std::lock_guard<std::mutex> l{monitor_};
 	//Let server know we want file access
-	cmd_t cmd = cmd::ACCESS;
-	agfs_write_cmd(socket_, cmd);
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::ACCESS);
 
 	//Outgoing stack calls
-	agfs_write_string(socket_, std::string(path));
+	agfs_write_string(request, std::string(path));
 
-	agfs_write_mask(socket_, (agmask_t)mask);
+	agfs_write_mask(request, (agmask_t)mask);
+
+	agerr_t retValue = meta_->roundTrip(request, reply);
+	if (retValue < 0) {
+		return retValue;
+	}
 
 	//Incoming stack calls
-	agerr_t retValue;
-	agfs_read_error(socket_, retValue);
+	retValue = -EIO;
+	agfs_read_error(reply, retValue);
 
 	return retValue;
 }
 
+std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t> ServerConnection::readdir(const char* path) {
+	std::vector<std::pair<std::string, struct stat>> files;
+	agsize_t cookie = 0;
+	std::string last;
+	do {
+		std::pair<DirChunk, agerr_t> chunk{readdirChunk(path, cookie, last)};
+		if (chunk.second < 0) {
+			return std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t>{files, chunk.second};
+		}
+
+		std::vector<DirEntry>& entries = chunk.first.entries;
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (entries[i].name == "." || entries[i].name == "..") {
+				continue;
+			}
+			files.push_back(std::pair<std::string, struct stat>{entries[i].name, entries[i].stbuf});
+		}
+		if (!entries.empty()) {
+			last = entries.back().name;
+		}
+		cookie = chunk.first.next;
+	} while (cookie != 0);
+
+	return std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t>{files, 0};
+}
+
+std::pair<ServerConnection::DirChunk, agerr_t> ServerConnection::readdirChunk(const char* path, agsize_t cookie,
+		const std::string& after) {
+	std::pair<DirChunk, agerr_t> chunk{fetchChunk(path, cookie)};
+	if (cookie == 0 || chunk.second != -ESTALE) {
+		return chunk;
+	}
+
+	//Listings are sorted bytewise, as std::string compares, so the entries
+	//not yet taken are the ones after the last name taken.
+	cookie = 0;
+	do {
+		chunk = fetchChunk(path, cookie);
+		if (chunk.second < 0) {
+			return chunk;
+		}
+
+		std::vector<DirEntry>& entries = chunk.first.entries;
+		std::vector<DirEntry>::iterator first = std::find_if(entries.begin(), entries.end(),
+			[&after](const DirEntry& entry) { return entry.name > after; });
+		if (first != entries.end()) {
+			entries.erase(entries.begin(), first);
+			return chunk;
+		}
+		cookie = chunk.first.next;
+	} while (cookie != 0);
+
+	chunk.first.entries.clear();
+	return chunk;
+}
+
 /*
  * Outgoing stack looks like:
  *
- *      STRING
+ *      STRING SIZE [SIZE]
  *
  * Incoming stack looks like:
  *
- *      ERROR [COUNT [STRING STAT]*]
+ *      ERROR [COUNT [STRING STAT SIZE]* SIZE]
+ *
+ * or, if we can take compressed chunks and send a level,
+ *
+ *      ERROR [MASK [SIZE] BODY]
  */
-std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t> ServerConnection::readdir(const char* path) {
-	std::lock_guard<std::mutex> l{monitor_};
+std::pair<ServerConnection::DirChunk, agerr_t> ServerConnection::fetchChunk(const char* path, agsize_t cookie) {
 	//Let server know we want to read a directory.
-	cmd_t cmd = cmd::READDIR;
-	agfs_write_cmd(socket_, cmd);
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::READDIR);
 
 	//Outgoing stack calls
-	agfs_write_string(socket_, std::string(path));
+	agfs_write_string(request, std::string(path));
+	agfs_write_size(request, cookie);
+
+	//A full chunk is about this big on the wire.
+	bool encoded = (meta_->agreed().encodings & enc::ZLIB) != 0;
+	if (encoded) {
+		agfs_write_size(request, link_.level(READDIR_CHUNK_ENTRIES * sizeof(struct stat)));
+	}
+
+	DirChunk chunk;
+	chunk.next = 0;
+	agerr_t error = meta_->roundTrip(request, reply);
+	if (error < 0) {
+		return std::pair<DirChunk, agerr_t>{chunk, error};
+	}
 
 	//Incoming stack calls
-	agerr_t error = 0;
-	agfs_read_error(socket_, error);
+	agfs_read_error(reply, error);
+
+	//A compressed chunk is unpacked into a frame of its own and read from
+	//there.
+	Frame unpacked;
+	agmask_t encoding = enc::NONE;
+	if (error >= 0 && encoded && agfs_read_mask(reply, encoding) < 0) {
+		error = -EIO;
+	}
+	if (error >= 0 && encoding != enc::NONE) {
+		agsize_t length = 0;
+		if (encoding != enc::ZLIB || agfs_read_size(reply, length) < 0 || length > meta_->agreed().maxFrame) {
+			error = -EIO;
+		} else {
+			size_t packed = reply.remaining();
+			const unsigned char* data = reply.take(packed);
+			if (!link_.decompress(data, packed, (char*)unpacked.prepare(length), length)) {
+				error = -EIO;
+			}
+		}
+	}
+	Frame& body = encoding == enc::NONE ? reply : unpacked;
 
 	//Since the server doesn't send data on errors, we need to
 	//short circuit.
-	std::vector<std::pair<std::string, struct stat>> files;
 	if (error >= 0) {
 		agsize_t count = 0;
-		agfs_read_size(socket_, count);
+		agfs_read_size(body, count);
 
+		//Never trust the count further than the frame can back it up.
+		chunk.entries.reserve(std::min<agsize_t>(count, READDIR_CHUNK_ENTRIES));
 		while (count-- > 0) {
-			std::string file;
-			agfs_read_string(socket_, file);
-
-			struct stat stbuf;
-			agfs_read_stat(socket_, stbuf);
+			DirEntry entry;
+			if (agfs_read_string(body, entry.name) < 0 || agfs_read_stat(body, entry.stbuf) < 0 ||
+			    agfs_read_size(body, entry.cookie) < 0) {
+				error = -EIO;
+				break;
+			}
+
+			chunk.entries.push_back(entry);
+		}
 
-			files.push_back(std::pair<std::string, struct stat>{file, stbuf});
+		if (error >= 0 && agfs_read_size(body, chunk.next) < 0) {
+			error = -EIO;
 		}
 	}
 
-	return std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t>{files, error};
+	return std::pair<DirChunk, agerr_t>{chunk, error};
 }
 
 /*
  * Outgoing stack looks like:
  *
- *      STRING SIZE OFFSET
+ *      HANDLE SIZE OFFSET [SIZE]
  *
  * Incoming stack looks like:
  *
- *      ERROR [SIZE [DATA]*]
+ *      ERROR [SIZE [MASK] [DATA]*]
+ *
+ * When we can take compressed data we send the level we want it at, and
+ * the server says whether it compressed it.
  */
-std::pair<std::vector<unsigned char>, agerr_t> ServerConnection::readFile(const char* path, agsize_t size, agsize_t offset) {
-	std::lock_guard<std::mutex> l{monitor_};
+std::pair<agsize_t, agerr_t> ServerConnection::readFile(agfh_t handle, agsize_t size, agsize_t offset, char* buf) {
+	//Reads and writes are the bulk of the traffic, so each thread keeps its
+	//frames and their buffers from one call to the next.
+	thread_local Frame request, reply;
+	request.clear();
+
+	//Ask for no more than fits in a frame we take; the caller reads the rest
+	//as after any short read.
+	size = std::min(size, frameRoom());
+
 	//Send command to read data from file.
-	agfs_write_cmd(socket_, cmd::READ);
+	agfs_write_cmd(request, cmd::READ);
 
 	//Send parameters
-	agfs_write_string(socket_, std::string(path));
-	agfs_write_size(socket_, size);
-	agfs_write_size(socket_, offset);
+	agfs_write_handle(request, handle);
+	agfs_write_size(request, size);
+	agfs_write_size(request, offset);
+
+	std::shared_ptr<Channel> channel{bulkChannel()};
+	bool encoded = (channel->agreed().encodings & enc::ZLIB) != 0;
+	int level = 0;
+	if (encoded) {
+		level = link_.level(size);
+		agfs_write_size(request, level);
+	}
+
+	agsize_t amount_read = 0;
+	link_.starting();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	agerr_t error = channel->roundTrip(request, reply);
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+	if (error < 0) {
+		link_.transferred(0, 0, 0, elapsed);
+		return std::pair<agsize_t, agerr_t>{0, error};
+	}
 
-	agerr_t error = 0;
-	agfs_read_error(socket_, error);
+	agfs_read_error(reply, error);
 
-	std::vector<unsigned char> data;
 	if (error >= 0) {
-		agsize_t amount_read = 0;
-		agfs_read_size(socket_, amount_read);
+		agfs_read_size(reply, amount_read);
+
+		agmask_t encoding = enc::NONE;
+		if (encoded && agfs_read_mask(reply, encoding) < 0) {
+			error = -EIO;
+		}
 
-		data.resize(amount_read);
-		error = std::min((long long)read(socket_, &data[0], amount_read), (long long)error);
+		size_t wire = reply.remaining();
+		if (error < 0 || amount_read > size) {
+			error = -EIO;
+		} else if (encoding == enc::NONE) {
+			if (reply.consume(buf, amount_read) < 0) {
+				error = -EIO;
+			}
+		} else if (encoding != enc::ZLIB ||
+				!link_.decompress(reply.take(wire), wire, buf, amount_read)) {
+			error = -EIO;
+		}
+
+		if (error < 0) {
+			amount_read = 0;
+		}
+		link_.transferred(amount_read, wire, encoding == enc::ZLIB ? level : 0, elapsed);
+	} else {
+		link_.transferred(0, 0, 0, elapsed);
 	}
 
-	return std::pair<std::vector<unsigned char>, agerr_t>{data, error};
+	return std::pair<agsize_t, agerr_t>{amount_read, error};
 }
 
 
 /*
  * Outgoing stack looks like:
  *
- *      STRING [SIZE OFFSET DATA]
+ *      HANDLE SIZE OFFSET [MASK] DATA
  *
  * Incoming stack looks like:
  *
- *      ERROR [ERROR [SIZE]]
+ *      ERROR [SIZE]
+ *
+ * Data worth compressing goes as a PACKED_WRITE, with the MASK saying how
+ * it is encoded; the rest goes as a plain WRITE.
  */
-std::pair<agsize_t, agerr_t> ServerConnection::writeFile(const char* path, agsize_t size, agsize_t offset, const char* buf) {
-	std::lock_guard<std::mutex> l{monitor_};
-	//Send command to write data to file.
-	agfs_write_cmd(socket_, cmd::WRITE);
+std::pair<agsize_t, agerr_t> ServerConnection::writeFile(agfh_t handle, agsize_t size, agsize_t offset, const char* buf) {
+	//A server that takes smaller frames gets the data in pieces.
+	agsize_t room = frameRoom();
+	if (size > room) {
+		agsize_t done = 0;
+		while (done < size) {
+			agsize_t want = std::min(room, size - done);
+			std::pair<agsize_t, agerr_t> piece = writeFile(handle, want, offset + done, buf + done);
+			if (piece.second < 0) {
+				return done > 0 ? std::pair<agsize_t, agerr_t>{done, 0} : piece;
+			}
+			done += piece.first;
+			if (piece.first < want) {
+				break;
+			}
+		}
+		return std::pair<agsize_t, agerr_t>{done, 0};
+	}
 
-	//Send parameters.
-	agfs_write_string(socket_, std::string(path));
+	thread_local Frame request, reply;
+	thread_local std::vector<char> packed;
+	request.clear();
 
-	agerr_t error = 0;
-	agfs_read_error(socket_, error);
-	if (error < 0) {
-		return std::pair<agsize_t, agerr_t>{0, error};
+	//Data that doesn't shrink, like data that already is compressed, goes
+	//as it is.
+	std::shared_ptr<Channel> channel{bulkChannel()};
+	int level = 0;
+	if (channel->agreed().encodings & enc::ZLIB) {
+		level = link_.level(size);
+	}
+	if (level > 0 && !(Compressor::compressible(buf, size) && link_.compress(buf, size, level, packed))) {
+		level = 0;
 	}
 
-	agfs_write_size(socket_, size);
-	agfs_write_size(socket_, offset);
-
-	//Write the buffer data to the socket.
-	agsize_t total_written = 0;
-	while (total_written != size &&
-		(error = write(socket_, buf + total_written, size - total_written)) > 0) {
-		total_written += error;
+	//Send command to write data to file.
+	agfs_write_cmd(request, level > 0 ? cmd::PACKED_WRITE : cmd::WRITE);
+
+	//Send parameters. The buffer data travels in the same frame.
+	agfs_write_handle(request, handle);
+	agfs_write_size(request, size);
+	agfs_write_size(request, offset);
+	const char* data = buf;
+	size_t wire = size;
+	if (level > 0) {
+		agfs_write_mask(request, enc::ZLIB);
+		data = packed.data();
+		wire = packed.size();
 	}
 
-	//Handle an error writing to the socket.
+	link_.starting();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	agreqid_t id = channel->acquire();
+	agerr_t error = channel->send(id, request, data, wire);
+	if (error >= 0) {
+		error = channel->await(id, reply);
+	}
+	channel->release(id);
+	link_.transferred(error < 0 ? 0 : size, wire, level, std::chrono::steady_clock::now() - start);
 	if (error < 0) {
-		return std::pair<agsize_t, agerr_t>{0, -errno};
+		return std::pair<agsize_t, agerr_t>{0, error};
 	}
 
 	//Read in the return values.
-	agfs_read_error(socket_, error);
+	agsize_t total_written = 0;
+	agfs_read_error(reply, error);
 	if (error >= 0) {
-		agfs_read_size(socket_, total_written);
+		agfs_read_size(reply, total_written);
 	}
 
 	return std::pair<agsize_t, agerr_t>{total_written, error};
@@ -326,37 +549,270 @@ std::pair<agsize_t, agerr_t> ServerConnection::writeFile(const char* path, agsiz
  *
  * Incoming stack looks like:
  *
- *      ERROR
+ *      ERROR [HANDLE STAT]
  */
-agerr_t ServerConnection::open(const char* path, agmask_t flags) {
-	std::lock_guard<std::mutex> l{monitor_};
+std::pair<agfh_t, agerr_t> ServerConnection::open(const char* path, agmask_t flags,
+		struct stat& stbuf) {
 	//Send command to open a file.
-	agfs_write_cmd(socket_, cmd::OPEN);
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::OPEN);
 
 	//Write the path and the flags to the socket.
-	agfs_write_string(socket_, std::string(path));
-	agfs_write_mask(socket_, flags);
+	agfs_write_string(request, std::string(path));
+	agfs_write_mask(request, flags);
+
+	agfh_t handle = 0;
+	agerr_t error = meta_->roundTrip(request, reply);
+	if (error < 0) {
+		return std::pair<agfh_t, agerr_t>{handle, error};
+	}
+
+	//Read the resulting error, handle and attributes from the server.
+	error = -EIO;
+	agfs_read_error(reply, error);
+	if (error >= 0 && (agfs_read_handle(reply, handle) < 0 ||
+			agfs_read_stat(reply, stbuf) < 0)) {
+		error = -EIO;
+	}
+
+	return std::pair<agfh_t, agerr_t>{handle, error};
+}
+
+/*
+ * Outgoing stack looks like:
+ *
+ *      HANDLE OFFSET COUNT LENGTH
+ *
+ * Incoming stack looks like:
+ *
+ *      ERROR [SIZE COUNT [HASH]*]
+ */
+std::pair<agsize_t, agerr_t> ServerConnection::blockHashes(agfh_t handle, agsize_t offset,
+		agsize_t count, agsize_t length, std::vector<aghash_t>& hashes) {
+	if (!supports(feature::BLOCK_HASHES)) {
+		return std::pair<agsize_t, agerr_t>{0, -ENOSYS};
+	}
 
-	//Read the resulting error from the server.
-	agerr_t error = 0;
-	agfs_read_error(socket_, error);
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::BLOCKHASH);
+	agfs_write_handle(request, handle);
+	agfs_write_size(request, offset);
+	agfs_write_size(request, count);
+	agfs_write_size(request, length);
+
+	//The server reads every block to hash it, so this goes with the reads.
+	hashes.clear();
+	agerr_t error = bulkChannel()->roundTrip(request, reply);
+	if (error < 0) {
+		return std::pair<agsize_t, agerr_t>{0, error};
+	}
+
+	agsize_t size = 0;
+	agfs_read_error(reply, error);
+	if (error >= 0) {
+		agfs_read_size(reply, size);
+		agsize_t sent = 0;
+		agfs_read_size(reply, sent);
+		if (sent > count || sent * BLOCK_HASH_LEN > reply.remaining()) {
+			return std::pair<agsize_t, agerr_t>{0, -EIO};
+		}
+		hashes.resize(sent);
+		for (aghash_t& hash: hashes) {
+			reply.consume(hash.data(), hash.size());
+		}
+	}
+
+	return std::pair<agsize_t, agerr_t>{size, error};
+}
+
+/*
+ * Outgoing stack looks like:
+ *
+ *      HANDLE
+ *
+ * Incoming stack looks like:
+ *
+ *      ERROR [SIZE LENGTH COUNT [SUM HASH]*]
+ */
+agerr_t ServerConnection::signature(agfh_t handle, Delta::Signature& signature) {
+	if (!supports(feature::DELTA)) {
+		return -ENOSYS;
+	}
+
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::SIGNATURE);
+	agfs_write_handle(request, handle);
+
+	//The server reads the whole file to sign it.
+	agerr_t error = bulkChannel()->roundTrip(request, reply);
+	if (error < 0) {
+		return error;
+	}
+
+	agfs_read_error(reply, error);
+	if (error < 0) {
+		return error;
+	}
+
+	agsize_t size = 0, count = 0;
+	agfs_read_size(reply, size);
+	agfs_read_size(reply, signature.blockLength);
+	agfs_read_size(reply, count);
+	if (count > reply.remaining() / (sizeof(agsum_t) + BLOCK_HASH_LEN)) {
+		return -EIO;
+	}
+
+	signature.sums.resize(count);
+	signature.hashes.resize(count);
+	for (agsize_t i = 0; i < count; i++) {
+		agfs_read_sum(reply, signature.sums[i]);
+		reply.consume(signature.hashes[i].data(), BLOCK_HASH_LEN);
+	}
+	return 0;
+}
+
+/*
+ * Outgoing stack looks like:
+ *
+ *      HANDLE SIZE COUNT [FROM LENGTH]* DATA
+ *
+ * Incoming stack looks like:
+ *
+ *      ERROR
+ */
+agerr_t ServerConnection::patch(agfh_t handle, agsize_t size, const Delta& delta) {
+	const std::vector<Delta::Instruction>& instructions = delta.instructions();
+	const std::vector<char>& literal = delta.literal();
+	if (!supports(feature::DELTA)) {
+		return -ENOSYS;
+	}
+	if (instructions.size() * 2 * sizeof(agsize_t) + literal.size() > frameRoom()) {
+		return -EFBIG;
+	}
+
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::PATCH);
+	agfs_write_handle(request, handle);
+	agfs_write_size(request, size);
+	agfs_write_size(request, instructions.size());
+	for (const Delta::Instruction& instruction: instructions) {
+		agfs_write_size(request, instruction.from);
+		agfs_write_size(request, instruction.length);
+	}
+
+	//The literal data goes out straight from the delta, as with a WRITE.
+	std::shared_ptr<Channel> channel{bulkChannel()};
+	agreqid_t id = channel->acquire();
+	agerr_t error = channel->send(id, request, literal.data(), literal.size());
+	if (error >= 0) {
+		error = channel->await(id, reply);
+	}
+	channel->release(id);
+	if (error < 0) {
+		return error;
+	}
+
+	error = -EIO;
+	agfs_read_error(reply, error);
+	return error;
+}
+
+/*
+ * Outgoing stack looks like:
+ *
+ *      HANDLE SIZE
+ *
+ * Incoming stack looks like:
+ *
+ *      ERROR
+ */
+agerr_t ServerConnection::truncate(agfh_t handle, agsize_t size) {
+	if (!supports(feature::DELTA)) {
+		return -ENOSYS;
+	}
+
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::TRUNCATE);
+	agfs_write_handle(request, handle);
+	agfs_write_size(request, size);
+
+	agerr_t error = meta_->roundTrip(request, reply);
+	if (error < 0) {
+		return error;
+	}
+
+	error = -EIO;
+	agfs_read_error(reply, error);
+	return error;
+}
+
+/*
+ * Outgoing stack looks like:
+ *
+ *      HANDLE
+ *
+ * Incoming stack looks like:
+ *
+ *      ERROR
+ */
+agerr_t ServerConnection::release(agfh_t handle) {
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::RELEASE);
+	agfs_write_handle(request, handle);
+
+	agerr_t error = meta_->roundTrip(request, reply);
+	if (error < 0) {
+		return error;
+	}
+
+	error = -EIO;
+	agfs_read_error(reply, error);
 
 	return error;
 }
 
 agerr_t ServerConnection::heartbeat() {
-	std::lock_guard<std::mutex> l{monitor_};
+	Frame request, reply;
+	agfs_write_cmd(request, cmd::HEARTBEAT);
 
-	agfs_write_cmd(socket_, cmd::HEARTBEAT);
+	//Nothing slows a heartbeat down but the round trip itself.
 	cmd_t resp = cmd::NONE;
-	agfs_read_cmd(socket_, resp);
-	if (resp == cmd::NONE) {
-		//Failed to get heartbeat in timeout period so close socket
-		close(socket_);
-		socket_ = -1;
-	} else {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (meta_->roundTrip(request, reply) >= 0) {
+		link_.roundTrip(std::chrono::steady_clock::now() - start);
+		agfs_read_cmd(reply, resp);
 		//Here we would get sizes from the server
 	}
+
+	if (resp == cmd::NONE) {
+		//Failed to get heartbeat in timeout period so drop the connection
+		meta_->disconnect();
+	}
+
+	//Shrink the pool: channels that failed, or that nothing has used for a
+	//while. The server would drop them for silence after SERVER_IDLE_SEC.
+	std::vector<std::shared_ptr<Channel>> idle;
+	{
+		std::lock_guard<std::mutex> l{bulkLock_};
+		std::vector<std::shared_ptr<Channel>>::iterator it = bulk_.begin();
+		while (it != bulk_.end()) {
+			if (!(*it)->connected() || (*it)->idle() >= std::chrono::seconds(BULK_IDLE_SEC)) {
+				idle.push_back(*it);
+				it = bulk_.erase(it);
+			} else {
+				++it;
+			}
+		}
+		bulkFailed_ = false;
+	}
+	for (size_t i = 0; i < idle.size(); i++) {
+		idle[i]->stop();
+	}
+
+	std::lock_guard<std::mutex> l{bulkLock_};
+	for (size_t i = 0; i < idle.size(); i++) {
+		retired_ += idle[i]->counts();
+	}
 	return 0;
 }
 
@@ -364,32 +820,52 @@ agerr_t ServerConnection::heartbeat() {
  * Private Functions *
  *********************/
 
-int ServerConnection::dnsLookup(const char* port) {
-  struct addrinfo hints, *hostaddress = NULL;
-  int error, fd;
-
-  memset(&hints, 0, sizeof(hints));
-
-  hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_CANONNAME;
-
-  if ((error = getaddrinfo(hostname_.c_str(), port, &hints, &hostaddress)) != 0) {
-    return DNS_ERROR;
-  }
-
-  fd = socket(hostaddress->ai_family, hostaddress->ai_socktype, hostaddress->ai_protocol);
-
-  if (fd == -1) {
-  	return SOCKET_FAILURE;
-  }
+agsize_t ServerConnection::frameRoom() {
+	agsize_t frame = meta_->agreed().maxFrame;
+	return frame > FRAME_HEADER_LEN + 1024 ? frame - FRAME_HEADER_LEN - 1024 : 1;
+}
 
-  if (::connect(fd, hostaddress->ai_addr, hostaddress->ai_addrlen) == -1) {
-  	return CONNECTION_FAILURE;
-  }
+std::shared_ptr<Channel> ServerConnection::bulkChannel() {
+	std::unique_lock<std::mutex> l{bulkLock_};
+	std::shared_ptr<Channel> best;
+	for (size_t i = 0; i < bulk_.size(); i++) {
+		if (bulk_[i]->connected() && (!best || bulk_[i]->load() < best->load())) {
+			best = bulk_[i];
+		}
+	}
+	if (best && best->load() == 0) {
+		return best;
+	}
 
-  freeaddrinfo(hostaddress);
+	//Every channel is busy. One thread at a time opens another, while the
+	//rest make do with what there is.
+	if (!growing_ && !bulkFailed_ && !closed_ && session_ != 0 && bulk_.size() < BULK_CONNECTIONS) {
+		growing_ = true;
+		agsize_t session = session_;
+		l.unlock();
+		std::shared_ptr<Channel> channel{new Channel{hostname_, port_}};
+		agsize_t joined = session;
+		bool opened = channel->connect(key_, joined, offer_) == cmd::ACCEPT && joined == session;
+		l.lock();
+		growing_ = false;
+
+		//The session may have been replaced while we were connecting.
+		if (opened && session == session_ && !closed_) {
+			bulk_.push_back(channel);
+			return channel;
+		}
+		if (!opened) {
+			std::cerr << "Server " << hostname_ << ": Could not open a data connection" << std::endl;
+			bulkFailed_ = true;
+		}
+		best.reset();
+		for (size_t i = 0; i < bulk_.size(); i++) {
+			if (bulk_[i]->connected() && (!best || bulk_[i]->load() < best->load())) {
+				best = bulk_[i];
+			}
+		}
+	}
 
-  return fd;
+	return best ? best : meta_;
 }
+
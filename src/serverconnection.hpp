@@ -4,14 +4,37 @@
 #include <sys/stat.h>
 #include <string>
 #include "constants.hpp"
+#include "channel.hpp"
+#include "compressor.hpp"
+#include "delta.hpp"
 #include <vector>
+#include <memory>
 #include <mutex>
+#include <atomic>
 
-/// Provides the client with an interface over which to talk with the server.
+/**
+ * \brief Provides the client with an interface over which to talk with the server.
+ * \details Any number of threads may issue requests at once. Requests about
+ *          names and attributes go over one channel, and file data over a
+ *          pool of up to BULK_CONNECTIONS more, so a large read or write never
+ *          sits in front of a getattr. Data requests go to the least busy
+ *          channel of the pool, which grows while all of them are busy and
+ *          loses channels that go unused for BULK_IDLE_SEC. Every channel
+ *          joins the same session on the server, so handles work on all of
+ *          them.
+ */
 class ServerConnection {
 public:
-	ServerConnection(std::string hostname, std::string port, std::string key);
-	ServerConnection(ServerConnection const& connection);
+	/**
+	 * \brief Connect to a server.
+	 * \param offer What we can do. Each feature and encoding in it is used
+	 *        only if the server has it too.
+	 */
+	ServerConnection(std::string hostname, std::string port, std::string key,
+		const Hello& offer = Hello::local());
+	ServerConnection(ServerConnection const& connection) = delete;
+	ServerConnection& operator=(ServerConnection const& connection) = delete;
+	~ServerConnection();
 
 	/// Returns true if we have a healty connection with the server
 	bool connected();
@@ -19,8 +42,11 @@ public:
 	/// Returns true if we successfully terminated the connection to the server
 	bool closed();
 
+	/// Returns true if we and the server agreed on all of the given features
+	bool supports(agmask_t features);
+
 	/// Returns the hostname
-	std::string hostname();
+	const std::string& hostname() const;
 
 	/**
 	 * \brief Execute getattr on a specified path
@@ -39,37 +65,119 @@ public:
 	/**
 	 * \brief Execute open a specified path on the remote server.
 	 * \param path String containing the path to be looked up
+	 * \param flags The open(2) flags to open the file with.
+	 * \param stbuf Set to the attributes of the file once opened.
+	 * \returns A pair of the handle naming the open file on the server and
+	 *          the error code generated.
+	 */
+	std::pair<agfh_t, agerr_t> open(const char* path, agmask_t flags, struct stat& stbuf);
+
+	/**
+	 * \brief Release a handle returned by open.
+	 * \param handle The handle of the file to close on the server.
 	 * \returns The error code generated
 	 */
-	agerr_t open(const char* path, agmask_t flags);
+	agerr_t release(agfh_t handle);
 
 	/**
 	 * \brief Execute readdir on a specified path
+	 * \details Collects every chunk of the listing, leaving out "." and "..".
 	 * \param path String containing the path to be looked up
 	 * \returns a pair of a vector containing the children files/directories,
 	  *         and any error generated.
 	 */
 	std::pair<std::vector<std::pair<std::string, struct stat>>, agerr_t> readdir(const char* path);
 
+	/// One entry of a directory listing.
+	struct DirEntry {
+		std::string name;
+		struct stat stbuf;
+
+		/// Cookie that resumes the listing right after this entry
+		agsize_t cookie;
+	};
+
+	/// Part of a directory listing.
+	struct DirChunk {
+		std::vector<DirEntry> entries;
+
+		/// Cookie of the next chunk, or 0 if this was the last one
+		agsize_t next;
+	};
+
 	/**
-	 * \brief Execute read on a specified path
+	 * \brief Read one chunk of a directory listing.
+	 * \details The chunk holds at most READDIR_CHUNK_ENTRIES entries,
+	 *          including "." and "..". The server drops a listing once its
+	 *          last chunk is sent, or to make room for others; it is then
+	 *          started over and skipped ahead to the first name after
+	 *          \p after.
 	 * \param path String containing the path to be looked up
+	 * \param cookie 0 to start at the beginning, or a cookie from an earlier
+	 *        chunk to carry on from there.
+	 * \param after The name of the entry the cookie came with.
+	 * \returns The chunk and any error generated.
+	 */
+	std::pair<DirChunk, agerr_t> readdirChunk(const char* path, agsize_t cookie, const std::string& after);
+
+	/**
+	 * \brief Execute read on an open file
+	 * \param handle The handle returned when the file was opened
 	 * \param size The number of bytes to read from the file.
 	 * \param offset The offset to start reading from.
-	 * \returns A pair of a vector of the data that the server
-	 *          read from the file and an error code.
+	 * \param buf Where to put the data; it must have room for size bytes.
+	 * \returns A pair of the number of bytes the server read from the file
+	 *          and an error code.
 	 */
-	std::pair<std::vector<unsigned char>, agerr_t> readFile(const char* path, agsize_t size, agsize_t offset);
+	std::pair<agsize_t, agerr_t> readFile(agfh_t handle, agsize_t size, agsize_t offset, char* buf);
 
 	/**
-	 * \brief Execute write on a specified path
-	 * \param path String containing the path to be looked up
+	 * \brief Execute write on an open file
+	 * \param handle The handle returned when the file was opened
 	 * \param size The number of bytes to write to the file.
 	 * \param offset The offset to start writing at.
 	 * \returns A pair of the number of bytes written and the error
 	 *          code returned by the external server.
 	 */
-	std::pair<agsize_t, agerr_t> writeFile(const char* path, agsize_t size, agsize_t offset, const char* buf);
+	std::pair<agsize_t, agerr_t> writeFile(agfh_t handle, agsize_t size, agsize_t offset, const char* buf);
+
+	/**
+	 * \brief Get the hashes of a run of blocks of an open file
+	 * \param handle The handle returned when the file was opened
+	 * \param offset The offset the first block starts at.
+	 * \param count The number of blocks, at most BLOCK_HASH_MAX_LEN bytes in all.
+	 * \param length The length of every block.
+	 * \param hashes Filled with the hash of each block, stopping at the end
+	 *        of the file.
+	 * \returns A pair of the size of the file and an error code.
+	 */
+	std::pair<agsize_t, agerr_t> blockHashes(agfh_t handle, agsize_t offset, agsize_t count,
+		agsize_t length, std::vector<aghash_t>& hashes);
+
+	/**
+	 * \brief Get the signature of an open file's current contents
+	 * \param handle The handle returned when the file was opened
+	 * \param signature Filled with the signature.
+	 * \returns An error code.
+	 */
+	agerr_t signature(agfh_t handle, Delta::Signature& signature);
+
+	/**
+	 * \brief Replace the contents of an open file with a delta
+	 * \param handle The handle returned when the file was opened
+	 * \param size The size of the new contents.
+	 * \param delta Instructions for building them from the file's signature.
+	 * \returns An error code; -EFBIG if the delta is too large to send.
+	 */
+	agerr_t patch(agfh_t handle, agsize_t size, const Delta& delta);
+
+	/**
+	 * \brief Truncate an open file
+	 * \param handle The handle returned when the file was opened
+	 * \param size The size to cut or extend the file to.
+	 * \returns An error code.
+	 */
+	agerr_t truncate(agfh_t handle, agsize_t size);
 
 	/**
 	 * \brief Halt communication with the server
@@ -91,10 +199,24 @@ public:
 	///Helper function which connects us to the server
 	void connect();
 
+	/**
+	 * \brief Describe the traffic on this connection so far.
+	 * \returns A line with the request, frame and system call counts.
+	 */
+	std::string ioStats();
+
 private:
+	//Send one READDIR and read the chunk it returns.
+	std::pair<DirChunk, agerr_t> fetchChunk(const char* path, agsize_t cookie);
 
+	//Pick the channel for a file data request: the least busy of the pool,
+	//a new one if all of them are busy and there is room, or the metadata
+	//channel if the pool can't be used.
+	std::shared_ptr<Channel> bulkChannel();
 
-	int dnsLookup(const char* port);
+	//Bytes of data that fit in one frame the server takes, with room left
+	//for the request around them.
+	agsize_t frameRoom();
 
 	//heartbeat missed or
 	bool failedCommand_;
@@ -111,20 +233,35 @@ private:
 	//The key we use to connect
 	std::string key_;
 
-	//A mutex to turn this object into a monitor
-	std::mutex monitor_;
+	//What we offer the server when connecting
+	Hello offer_;
 
-	//Socket descriptor
-	int socket_;
+	//Decides when data is worth compressing
+	Compressor link_;
 
-	//Connection closed
-	bool closed_;
+	//Carries every request but file data; its loss is the connection's loss
+	std::shared_ptr<Channel> meta_;
 
-	enum {
-		DNS_ERROR = -1,
-		SOCKET_FAILURE = -2,
-		CONNECTION_FAILURE = -3
-	};
+	//Guards the pool and the session
+	std::mutex bulkLock_;
+
+	//Channels carrying file data
+	std::vector<std::shared_ptr<Channel>> bulk_;
+
+	//Set while a channel is being added to the pool
+	bool growing_;
+
+	//Set when adding a channel failed; cleared by the next heartbeat
+	bool bulkFailed_;
+
+	//The session the metadata channel started, or 0 if the server has none
+	agsize_t session_;
+
+	//Traffic of channels that have left the pool
+	Channel::Counts retired_;
+
+	//Connection closed
+	std::atomic<bool> closed_;
 };
 
 #endif
@@ -0,0 +1,102 @@
+#include "session.hpp"
+#include <random>
+#include <unistd.h>
+
+//Every running session by id. Sessions remove themselves when they end.
+static std::mutex sessionsLock;
+static std::map<uint64_t, std::weak_ptr<Session>> sessions;
+
+Session::OpenFile::OpenFile(int fd, const std::string& path)
+	:fd{fd},
+	 path{path}
+{
+	//Nothing to do here...
+}
+
+Session::OpenFile::~OpenFile()
+{
+	close(fd);
+}
+
+Session::Session(uint64_t id, const std::string& key)
+	:id_{id},
+	 key_{key},
+	 filesLock_{},
+	 openFiles_{},
+	 nextHandle_{1}
+{
+	//Nothing to do here...
+}
+
+Session::~Session()
+{
+	std::lock_guard<std::mutex> l{sessionsLock};
+	std::map<uint64_t, std::weak_ptr<Session>>::iterator it = sessions.find(id_);
+	if (it != sessions.end() && it->second.expired()) {
+		sessions.erase(it);
+	}
+}
+
+uint64_t Session::id() const
+{
+	return id_;
+}
+
+agfh_t Session::addFile(int fd, const std::string& path)
+{
+	std::shared_ptr<OpenFile> file{new OpenFile{fd, path}};
+
+	std::lock_guard<std::mutex> l{filesLock_};
+	agfh_t handle = nextHandle_++;
+	openFiles_[handle] = file;
+	return handle;
+}
+
+std::shared_ptr<Session::OpenFile> Session::findFile(agfh_t handle)
+{
+	std::lock_guard<std::mutex> l{filesLock_};
+	std::map<agfh_t, std::shared_ptr<OpenFile>>::iterator it = openFiles_.find(handle);
+	if (it == openFiles_.end()) {
+		return std::shared_ptr<OpenFile>{};
+	}
+	return it->second;
+}
+
+bool Session::removeFile(agfh_t handle)
+{
+	std::lock_guard<std::mutex> l{filesLock_};
+	return openFiles_.erase(handle) > 0;
+}
+
+std::shared_ptr<Session> Session::create(const std::string& key)
+{
+	//Ids are random, so a client can't stumble into another's session even
+	//with the same key.
+	static std::random_device device;
+	static std::mt19937_64 generator{((uint64_t)device() << 32) | device()};
+
+	std::lock_guard<std::mutex> l{sessionsLock};
+	uint64_t id;
+	do {
+		id = generator();
+	} while (id == 0 || sessions.count(id) > 0);
+
+	std::shared_ptr<Session> session{new Session{id, key}};
+	sessions[id] = session;
+	return session;
+}
+
+std::shared_ptr<Session> Session::join(uint64_t id, const std::string& key)
+{
+	std::lock_guard<std::mutex> l{sessionsLock};
+	std::map<uint64_t, std::weak_ptr<Session>>::iterator it = sessions.find(id);
+	if (it == sessions.end()) {
+		return std::shared_ptr<Session>{};
+	}
+
+	std::shared_ptr<Session> session{it->second.lock()};
+	if (!session || session->key_ != key) {
+		return std::shared_ptr<Session>{};
+	}
+	return session;
+}
@@ -0,0 +1,76 @@
+#ifndef SESSION_HPP_INC
+#define SESSION_HPP_INC
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "constants.hpp"
+
+/**
+ * \brief What a client shares across all of its connections.
+ * \details A client may open several connections to the daemon to keep bulk
+ *          transfers out of the way of small requests. The first connection
+ *          starts a session and the others join it with its id, so a file
+ *          opened on one connection can be read or written on any of them.
+ *          The session, and every file still open in it, goes away with its
+ *          last connection.
+ */
+class Session {
+public:
+	/// A file held open on behalf of the client. The descriptor is closed
+	/// when the last request using it lets go, even if it was released first.
+	struct OpenFile {
+		OpenFile(int fd, const std::string& path);
+		~OpenFile();
+
+		int fd;
+
+		//Where the file was opened, so a new copy can be renamed over it
+		std::string path;
+	};
+
+	Session(uint64_t id, const std::string& key);
+	Session(Session const&) = delete;
+	Session& operator=(Session const&) = delete;
+
+	/// Forget the session, closing the files still open in it.
+	~Session();
+
+	/// Returns the id other connections join the session with.
+	uint64_t id() const;
+
+	/// Register an open descriptor and return the handle naming it.
+	agfh_t addFile(int fd, const std::string& path);
+
+	/// Look up the file named by a handle; empty if the handle is unknown.
+	std::shared_ptr<OpenFile> findFile(agfh_t handle);
+
+	/// Forget a handle. Returns false if it was unknown.
+	bool removeFile(agfh_t handle);
+
+	/**
+	 * \brief Start a session for a client that has just authenticated.
+	 * \param key The key the client authenticated with.
+	 */
+	static std::shared_ptr<Session> create(const std::string& key);
+
+	/**
+	 * \brief Find a running session for another connection of its client.
+	 * \returns The session, or nothing if it has ended or was started with a
+	 *          different key.
+	 */
+	static std::shared_ptr<Session> join(uint64_t id, const std::string& key);
+
+private:
+	uint64_t id_;
+	std::string key_;
+
+	//Files opened by the client, keyed by the handles OPEN returned
+	std::mutex filesLock_;
+	std::map<agfh_t, std::shared_ptr<OpenFile>> openFiles_;
+	agfh_t nextHandle_;
+};
+
+#endif
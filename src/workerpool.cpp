@@ -0,0 +1,67 @@
+#include "workerpool.hpp"
+
+WorkerPool::WorkerPool(size_t threads)
+	:busy_{0},
+	 stopping_{false}
+{
+	for (size_t i = 0; i < threads; i++) {
+		threads_.push_back(std::thread(&WorkerPool::run, this));
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		stopping_ = true;
+	}
+	ready_.notify_all();
+
+	for (size_t i = 0; i < threads_.size(); i++) {
+		threads_[i].join();
+	}
+}
+
+void WorkerPool::submit(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		jobs_.push_back(std::move(job));
+	}
+	ready_.notify_one();
+}
+
+void WorkerPool::drain()
+{
+	std::unique_lock<std::mutex> l{lock_};
+	idle_.wait(l, [this]() { return jobs_.empty() && busy_ == 0; });
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+void WorkerPool::run()
+{
+	std::unique_lock<std::mutex> l{lock_};
+	while (true) {
+		ready_.wait(l, [this]() { return stopping_ || !jobs_.empty(); });
+		if (jobs_.empty()) {
+			//Only reachable once we are stopping and the queue is drained.
+			return;
+		}
+
+		std::function<void()> job{std::move(jobs_.front())};
+		jobs_.pop_front();
+		busy_++;
+
+		l.unlock();
+		job();
+		l.lock();
+
+		busy_--;
+		if (jobs_.empty() && busy_ == 0) {
+			idle_.notify_all();
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef WORKERPOOL_HPP_INC
+#define WORKERPOOL_HPP_INC
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief A fixed set of threads running submitted jobs in arrival order.
+ */
+class WorkerPool {
+public:
+	/**
+	 * \brief Start the pool.
+	 * \param threads The number of threads to run jobs on.
+	 */
+	explicit WorkerPool(size_t threads);
+	WorkerPool(WorkerPool const&) = delete;
+	WorkerPool& operator=(WorkerPool const&) = delete;
+
+	/// Finish every queued job and stop the threads.
+	~WorkerPool();
+
+	/// Queue a job to run on one of the pool's threads.
+	void submit(std::function<void()> job);
+
+	/// Wait until every job submitted so far has finished.
+	void drain();
+
+private:
+	void run();
+
+	std::mutex lock_;
+
+	//Signalled when a job is queued or the pool is stopping
+	std::condition_variable ready_;
+
+	//Signalled when the pool runs out of work
+	std::condition_variable idle_;
+
+	std::deque<std::function<void()>> jobs_;
+
+	//Number of jobs currently running
+	size_t busy_;
+
+	bool stopping_;
+
+	std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include "writebuffer.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+WriteBuffer::WriteBuffer(Writer writer)
+	:writer_{writer},
+	 bytes_{0},
+	 since_{},
+	 flushing_{false},
+	 queued_{false},
+	 error_{0}
+{
+	//Nothing to do here...
+}
+
+size_t WriteBuffer::add(agsize_t offset, const char* data, size_t length)
+{
+	std::lock_guard<std::mutex> l{lock_};
+	if (length == 0) {
+		return bytes_;
+	}
+	if (extents_.empty()) {
+		since_ = clock::now();
+	}
+
+	//Find the first extent the write touches: the one before it if that
+	//reaches the write, otherwise the first one after it.
+	agsize_t end = offset + length;
+	std::map<agsize_t, std::vector<char>>::iterator it = extents_.upper_bound(offset);
+	if (it != extents_.begin()) {
+		std::map<agsize_t, std::vector<char>>::iterator before = std::prev(it);
+		if (before->first + before->second.size() >= offset) {
+			it = before;
+		}
+	}
+
+	if (it == extents_.end() || it->first > end) {
+		extents_[offset].assign(data, data + length);
+		bytes_ += length;
+		return bytes_;
+	}
+
+	//Grow the first extent touched, which for an append is all there is to
+	//do, and fold in any others the write reaches.
+	agsize_t start = std::min(it->first, offset);
+	std::vector<char> merged;
+	merged.swap(it->second);
+	bytes_ -= merged.size();
+	if (it->first > start) {
+		merged.insert(merged.begin(), it->first - start, 0);
+	}
+	it = extents_.erase(it);
+
+	while (it != extents_.end() && it->first <= end) {
+		size_t at = it->first - start;
+		if (merged.size() < at + it->second.size()) {
+			merged.resize(at + it->second.size());
+		}
+		memcpy(merged.data() + at, it->second.data(), it->second.size());
+		bytes_ -= it->second.size();
+		it = extents_.erase(it);
+	}
+
+	if (merged.size() < end - start) {
+		merged.resize(end - start);
+	}
+	memcpy(merged.data() + (offset - start), data, length);
+	bytes_ += merged.size();
+	extents_[start].swap(merged);
+	return bytes_;
+}
+
+bool WriteBuffer::dirty()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	return !extents_.empty() || flushing_ || replacer_;
+}
+
+std::chrono::steady_clock::duration WriteBuffer::age()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	if (extents_.empty() || replacer_) {
+		return clock::duration::zero();
+	}
+	return clock::now() - since_;
+}
+
+void WriteBuffer::replaceWhole(Replacer replacer)
+{
+	std::lock_guard<std::mutex> l{lock_};
+	replacer_ = replacer;
+}
+
+bool WriteBuffer::replacing()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	return (bool)replacer_;
+}
+
+bool WriteBuffer::replacedSize(agsize_t& size)
+{
+	std::lock_guard<std::mutex> l{lock_};
+	if (!replacer_) {
+		return false;
+	}
+	size = 0;
+	if (!extents_.empty()) {
+		std::map<agsize_t, std::vector<char>>::iterator last = std::prev(extents_.end());
+		size = last->first + last->second.size();
+	}
+	return true;
+}
+
+bool WriteBuffer::readReplaced(agsize_t offset, char* buf, size_t size, size_t& length)
+{
+	std::lock_guard<std::mutex> l{lock_};
+	if (!replacer_) {
+		return false;
+	}
+
+	//Gaps read as zeros, as they will once the file is replaced.
+	length = 0;
+	if (extents_.empty()) {
+		return true;
+	}
+	std::map<agsize_t, std::vector<char>>::iterator last = std::prev(extents_.end());
+	agsize_t end = last->first + last->second.size();
+	if (offset >= end) {
+		return true;
+	}
+	length = std::min<agsize_t>(size, end - offset);
+	memset(buf, 0, length);
+
+	std::map<agsize_t, std::vector<char>>::iterator it = extents_.upper_bound(offset);
+	if (it != extents_.begin()) {
+		--it;
+	}
+	for (; it != extents_.end() && it->first < offset + length; ++it) {
+		agsize_t from = std::max(it->first, offset);
+		agsize_t to = std::min<agsize_t>(it->first + it->second.size(), offset + length);
+		if (from < to) {
+			memcpy(buf + (from - offset), it->second.data() + (from - it->first), to - from);
+		}
+	}
+	return true;
+}
+
+bool WriteBuffer::claimFlush()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	if (queued_) {
+		return false;
+	}
+	queued_ = true;
+	return true;
+}
+
+void WriteBuffer::flush()
+{
+	std::lock_guard<std::mutex> f{flushLock_};
+
+	std::map<agsize_t, std::vector<char>> extents;
+	Replacer replacer;
+	{
+		std::lock_guard<std::mutex> l{lock_};
+		queued_ = false;
+		if (extents_.empty() && !replacer_) {
+			return;
+		}
+		extents.swap(extents_);
+		replacer.swap(replacer_);
+		bytes_ = 0;
+		flushing_ = true;
+	}
+
+	agerr_t error = 0;
+	if (replacer) {
+		error = replace(replacer, extents);
+		extents.clear();
+	}
+
+	//Keep going after an error; the other extents may still get through.
+	for (std::map<agsize_t, std::vector<char>>::iterator it = extents.begin();
+			it != extents.end(); ++it) {
+		size_t done = 0;
+		while (done < it->second.size()) {
+			size_t length = std::min(it->second.size() - done, WRITEBACK_WRITE_LEN);
+			std::pair<agsize_t, agerr_t> result{writer_(it->first + done,
+				it->second.data() + done, length)};
+			if (result.second < 0 || result.first < length) {
+				if (error == 0) {
+					error = result.second < 0 ? result.second : -EIO;
+				}
+				break;
+			}
+			done += length;
+		}
+	}
+
+	std::lock_guard<std::mutex> l{lock_};
+	flushing_ = false;
+	if (error_ == 0) {
+		error_ = error;
+	}
+}
+
+agerr_t WriteBuffer::takeError()
+{
+	std::lock_guard<std::mutex> l{lock_};
+	agerr_t error = error_;
+	error_ = 0;
+	return error;
+}
+
+/*********************
+ * Private Functions *
+ *********************/
+
+agerr_t WriteBuffer::replace(Replacer& replacer, std::map<agsize_t, std::vector<char>>& extents)
+{
+	//A file written from the start in order is a single extent already.
+	if (extents.empty()) {
+		return replacer(NULL, 0);
+	}
+	if (extents.size() == 1 && extents.begin()->first == 0) {
+		const std::vector<char>& data = extents.begin()->second;
+		return replacer(data.data(), data.size());
+	}
+
+	std::map<agsize_t, std::vector<char>>::iterator last = std::prev(extents.end());
+	std::vector<char> whole(last->first + last->second.size());
+	for (std::map<agsize_t, std::vector<char>>::iterator it = extents.begin();
+			it != extents.end(); ++it) {
+		memcpy(whole.data() + it->first, it->second.data(), it->second.size());
+	}
+	return replacer(whole.data(), whole.size());
+}
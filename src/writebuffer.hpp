@@ -0,0 +1,136 @@
+#ifndef WRITEBUFFER_HPP_INC
+#define WRITEBUFFER_HPP_INC
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "constants.hpp"
+
+/**
+ * \brief Holds writes to one open file until they can go to the server in
+ *        large pieces.
+ * \details Writes that touch or overlap are merged into one extent, so an
+ *          application appending a few kilobytes at a time ends up sending a
+ *          few large writes instead of many small ones. Later writes win
+ *          where they overlap earlier ones.
+ *
+ *          Flushes run one at a time, in the order they were asked for, and a
+ *          flush returns only once everything buffered before it has been
+ *          written. Writes may be added while a flush is under way; they go
+ *          out with the next one. The first error a flush hits is kept until
+ *          takeError() hands it to the application.
+ *
+ *          A buffer can instead hold a file that is being rewritten from
+ *          scratch. Its next flush hands everything held, as the whole of the
+ *          file's new contents, to a replacer rather than the writer, and the
+ *          buffer goes back to writing extents after that.
+ */
+class WriteBuffer {
+public:
+	/**
+	 * \brief Sends one extent to the server.
+	 * \returns A pair of the number of bytes written and any error.
+	 */
+	typedef std::function<std::pair<agsize_t, agerr_t>(agsize_t offset, const char* data,
+		size_t length)> Writer;
+
+	/**
+	 * \brief Replaces the whole contents of the file.
+	 * \returns 0, or a negative errno.
+	 */
+	typedef std::function<agerr_t(const char* data, size_t length)> Replacer;
+
+	explicit WriteBuffer(Writer writer);
+	WriteBuffer(WriteBuffer const&) = delete;
+	WriteBuffer& operator=(WriteBuffer const&) = delete;
+
+	/**
+	 * \brief Buffer a write.
+	 * \returns The number of bytes buffered and not yet being flushed.
+	 */
+	size_t add(agsize_t offset, const char* data, size_t length);
+
+	/// Returns true if anything is buffered or being flushed, or the file
+	/// is waiting to be replaced.
+	bool dirty();
+
+	/// Returns how long the oldest buffered write has waited, or zero while
+	/// the file is waiting to be replaced, since that waits for a flush.
+	std::chrono::steady_clock::duration age();
+
+	/**
+	 * \brief Hold the file's new contents until the next flush, which hands
+	 *        them to replacer.
+	 * \details Gaps between writes read as zeros, as they would in a file
+	 *          that had been truncated. The next flush calls replacer even if
+	 *          nothing was written, to empty the file.
+	 */
+	void replaceWhole(Replacer replacer);
+
+	/// Returns true while the file is waiting to be replaced.
+	bool replacing();
+
+	/**
+	 * \brief Find the size of the file's new contents held so far.
+	 * \returns false, leaving size alone, unless the file is waiting to be
+	 *          replaced.
+	 */
+	bool replacedSize(agsize_t& size);
+
+	/**
+	 * \brief Read from the file's new contents held so far.
+	 * \param length Set to the number of bytes read, short at their end.
+	 * \returns false unless the file is waiting to be replaced.
+	 */
+	bool readReplaced(agsize_t offset, char* buf, size_t size, size_t& length);
+
+	/**
+	 * \brief Note that a flush is about to be queued.
+	 * \returns false if one is already queued and hasn't started, so there's
+	 *          no need for another.
+	 */
+	bool claimFlush();
+
+	/// Write out everything buffered so far, including what other flushes hold.
+	void flush();
+
+	/// Returns the first error a flush hit since the last call, or 0.
+	agerr_t takeError();
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	//Hand everything held to a replacer as the file's new contents.
+	static agerr_t replace(Replacer& replacer, std::map<agsize_t, std::vector<char>>& extents);
+
+	Writer writer_;
+
+	//Set until the next flush replaces the file
+	Replacer replacer_;
+
+	//Held for the whole of a flush, so flushes run in order
+	std::mutex flushLock_;
+
+	//Guards everything below
+	std::mutex lock_;
+
+	//Buffered data by offset. Extents never touch or overlap.
+	std::map<agsize_t, std::vector<char>> extents_;
+	size_t bytes_;
+
+	//When the oldest buffered write arrived
+	clock::time_point since_;
+
+	//Set while a flush is under way
+	bool flushing_;
+
+	//Set between claimFlush() and the start of the flush it queued
+	bool queued_;
+
+	agerr_t error_;
+};
+
+#endif